@@ -0,0 +1,1198 @@
+#include "bench.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <array>
+#include <condition_variable>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+#ifdef _WIN32
+#include <io.h>
+#include <fcntl.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+
+extern "C" {
+#include "sha1.h"
+}
+
+#include "serializer.h"
+#include "deserializer.h"
+#include "protocol.h"
+#include "blake3.h"
+#include "hash_batch.h"
+#include "worker_pool.h"
+#include "file_index.h"
+#include "change_batch.h"
+#include "path_filter.h"
+#ifdef __linux__
+#include "inotify_watcher.h"
+#include "fanotify_watcher.h"
+#endif
+#include "queue.h"
+#include "pacer.h"
+#include "stats.h"
+#include "trace.h"
+
+// The decoded header as the server kept it before protocol.h.
+struct Header
+{
+	uint64_t full_size;
+	uint32_t header_size;
+	FileAction action;
+	uint8_t sha[20];
+	uint32_t path_size;
+};
+
+static std::vector<uint8_t> make_data(size_t size)
+{
+	std::vector<uint8_t> data(size);
+	uint32_t x = 0x12345678;
+	for (auto &byte : data)
+	{
+		x = x * 1664525 + 1013904223;
+		byte = uint8_t(x >> 24);
+	}
+	return data;
+}
+
+static std::string make_path(size_t i)
+{
+	char buffer[128];
+	snprintf(buffer, sizeof(buffer), "src\\module_%zu\\subdir_%zu\\file_%zu.cpp", i % 97, i % 13, i);
+	return buffer;
+}
+
+// The memcpy codec send_action and read_header used before protocol.h,
+// kept as the baseline for the codec benchmarks.
+static size_t serializer_encode_header(uint8_t *buffer, size_t buffer_size, const HashedFile &file, FileAction action, size_t data_size)
+{
+	Serializer s(buffer, buffer_size);
+	char magic[] = { 'P', 'I', 'D', '0' };
+	uint32_t header_size = uint32_t(4 + 8 + 4 + 4 + 20 + 4 + file.path.size());
+	uint64_t message_size = header_size + data_size;
+	s.add_data(magic, 4);
+	s.add_typed_data(message_size);
+	s.add_typed_data(header_size);
+	s.add_typed_data(action);
+	s.add_data(file.digest, 20);
+	s.add_typed_data(uint32_t(file.path.size()));
+	if (!s.add_data(file.path.data(), file.path.size()))
+		return 0;
+	return s.offset;
+}
+
+static bool serializer_decode_header(const uint8_t *buffer, Header &target_header)
+{
+	if (memcmp(buffer, "PID0", 4))
+		return false;
+	DeSerializer ds(buffer + 4, 40);
+	ds.read_to_type(target_header.full_size);
+	ds.read_to_type(target_header.header_size);
+	ds.read_to_type(target_header.action);
+	ds.read_to(target_header.sha, 20);
+	return ds.read_to_type(target_header.path_size);
+}
+
+static void add_serializer_benchmarks(std::vector<Benchmark> &benchmarks)
+{
+	for (size_t size : { 4, 8, 20, 64, 256, 4096 })
+	{
+		benchmarks.push_back({ "Serializer::add_data/" + std::to_string(size), [size](uint64_t iterations) {
+			static uint8_t buffer[1 << 16];
+			std::vector<uint8_t> data = make_data(size);
+			Serializer s(buffer, sizeof(buffer));
+			for (uint64_t i = 0; i < iterations; i++)
+			{
+				if (s.offset + size > s.buffer_size)
+					s.offset = 0;
+				s.add_data(data.data(), size);
+				do_not_optimize(s.offset);
+			}
+			do_not_optimize(buffer[0]);
+		}, size, 1 });
+
+		benchmarks.push_back({ "DeSerializer::read_to/" + std::to_string(size), [size](uint64_t iterations) {
+			std::vector<uint8_t> source = make_data(1 << 16);
+			std::vector<uint8_t> target(size);
+			DeSerializer ds(source.data(), source.size());
+			for (uint64_t i = 0; i < iterations; i++)
+			{
+				if (ds.offset + size > ds.buffer_size)
+					ds.offset = 0;
+				ds.read_to(target.data(), size);
+				do_not_optimize(target[0]);
+			}
+		}, size, 1 });
+	}
+}
+
+static void add_header_benchmarks(std::vector<Benchmark> &benchmarks)
+{
+	benchmarks.push_back({ "header/serializer/encode", [](uint64_t iterations) {
+		HashedFile file = {};
+		file.path = make_path(42);
+		uint8_t buffer[4096];
+		for (uint64_t i = 0; i < iterations; i++)
+		{
+			size_t size = serializer_encode_header(buffer, sizeof(buffer), file, FileAction::Modified, size_t(i));
+			do_not_optimize(size);
+			do_not_optimize(buffer[0]);
+		}
+	}, 0, 1 });
+
+	benchmarks.push_back({ "header/serializer/decode", [](uint64_t iterations) {
+		HashedFile file = {};
+		file.path = make_path(42);
+		uint8_t buffer[4096];
+		serializer_encode_header(buffer, sizeof(buffer), file, FileAction::Modified, 1234);
+		Header header;
+		for (uint64_t i = 0; i < iterations; i++)
+		{
+			bool ok = serializer_decode_header(buffer, header);
+			do_not_optimize(ok);
+			do_not_optimize(header);
+		}
+	}, 0, 1 });
+
+	benchmarks.push_back({ "header/codec/encode", [](uint64_t iterations) {
+		HashedFile file = {};
+		file.path = make_path(42);
+		uint8_t buffer[4096];
+		for (uint64_t i = 0; i < iterations; i++)
+		{
+			size_t size = encode_header(buffer, sizeof(buffer), FileAction::Modified, file.digest, 20, file.path, size_t(i));
+			do_not_optimize(size);
+			do_not_optimize(buffer[0]);
+		}
+	}, 0, 1 });
+
+	benchmarks.push_back({ "header/codec/decode", [](uint64_t iterations) {
+		HashedFile file = {};
+		file.path = make_path(42);
+		uint8_t buffer[4096];
+		encode_header(buffer, sizeof(buffer), FileAction::Modified, file.digest, 20, file.path, 1234);
+		Header header;
+		for (uint64_t i = 0; i < iterations; i++)
+		{
+			HeaderView view(buffer);
+			bool ok = view.valid();
+			header.full_size = view.message_size();
+			header.header_size = view.header_size();
+			header.action = view.action();
+			memcpy(header.sha, view.digest(), sizeof(header.sha));
+			header.path_size = view.path_size();
+			do_not_optimize(ok);
+			do_not_optimize(header);
+		}
+	}, 0, 1 });
+}
+
+static void add_sha1_benchmarks(std::vector<Benchmark> &benchmarks)
+{
+	for (size_t size : { 64, 1024, 4096, 65536, 1 << 20 })
+	{
+		benchmarks.push_back({ "SHA1Update/" + std::to_string(size), [size](uint64_t iterations) {
+			std::vector<uint8_t> data = make_data(size);
+			unsigned char digest[20];
+			for (uint64_t i = 0; i < iterations; i++)
+			{
+				SHA1_CTX ctx;
+				SHA1Init(&ctx);
+				SHA1Update(&ctx, data.data(), uint32_t(data.size()));
+				SHA1Final(digest, &ctx);
+				do_not_optimize(digest);
+			}
+		}, size, 1 });
+
+		benchmarks.push_back({ "SHA1/" + std::to_string(size), [size](uint64_t iterations) {
+			std::vector<uint8_t> data = make_data(size);
+			char digest[21];
+			for (uint64_t i = 0; i < iterations; i++)
+			{
+				SHA1(digest, reinterpret_cast<const char *>(data.data()), int(data.size()));
+				do_not_optimize(digest);
+			}
+		}, size, 1 });
+	}
+}
+
+// Single threaded BLAKE3 against SHA1 above, and the tree split over every
+// core for the sizes where the client does that.
+static void add_blake3_benchmarks(std::vector<Benchmark> &benchmarks)
+{
+	for (size_t size : { 64, 1024, 4096, 65536, 1 << 20 })
+	{
+		benchmarks.push_back({ "BLAKE3/" + std::to_string(size), [size](uint64_t iterations) {
+			std::vector<uint8_t> data = make_data(size);
+			uint8_t digest[BLAKE3_OUT_LEN];
+			for (uint64_t i = 0; i < iterations; i++)
+			{
+				blake3_hash(data.data(), data.size(), digest, 1);
+				do_not_optimize(digest);
+			}
+		}, size, 1 });
+	}
+
+	for (size_t size : { 16 << 20, 64 << 20 })
+	{
+		auto data = std::make_shared<std::vector<uint8_t>>(make_data(size));
+		benchmarks.push_back({ "BLAKE3/" + std::to_string(size), [data](uint64_t iterations) {
+			uint8_t digest[BLAKE3_OUT_LEN];
+			for (uint64_t i = 0; i < iterations; i++)
+			{
+				blake3_hash(data->data(), data->size(), digest, 1);
+				do_not_optimize(digest);
+			}
+		}, size, 1 });
+
+		benchmarks.push_back({ "BLAKE3/parallel/" + std::to_string(size), [data](uint64_t iterations) {
+			uint8_t digest[BLAKE3_OUT_LEN];
+			for (uint64_t i = 0; i < iterations; i++)
+			{
+				blake3_hash(data->data(), data->size(), digest, 0);
+				do_not_optimize(digest);
+			}
+		}, size, 1 });
+	}
+}
+
+// The small files of a large batch, hashed one after another as before and
+// a lane each with hash_batch.h. Items are files.
+struct SmallFiles
+{
+	std::vector<std::vector<uint8_t>> files;
+	std::vector<const uint8_t *> data;
+	std::vector<size_t> sizes;
+	uint64_t bytes = 0;
+};
+
+static std::shared_ptr<SmallFiles> make_small_files(size_t count)
+{
+	auto small = std::make_shared<SmallFiles>();
+	uint32_t seed = 1;
+	for (size_t i = 0; i < count; i++)
+	{
+		seed = seed * 1664525 + 1013904223;
+		size_t size = 512 + (seed >> 8) % 3585;
+		small->files.push_back(make_data(size));
+		small->data.push_back(small->files.back().data());
+		small->sizes.push_back(size);
+		small->bytes += size;
+	}
+	return small;
+}
+
+static void add_hash_batch_benchmarks(std::vector<Benchmark> &benchmarks)
+{
+	const size_t count = 1000;
+	auto small = make_small_files(count);
+	auto digests = std::make_shared<std::vector<uint8_t>>(count * BLAKE3_OUT_LEN);
+
+	benchmarks.push_back({ "HashMany/SHA1/serial", [small](uint64_t iterations) {
+		char digest[21];
+		for (uint64_t i = 0; i < iterations; i++)
+		{
+			for (size_t f = 0; f < small->data.size(); f++)
+				SHA1(digest, reinterpret_cast<const char *>(small->data[f]), int(small->sizes[f]));
+			do_not_optimize(digest);
+		}
+	}, small->bytes, count });
+
+	benchmarks.push_back({ "HashMany/BLAKE3/serial", [small](uint64_t iterations) {
+		uint8_t digest[BLAKE3_OUT_LEN];
+		for (uint64_t i = 0; i < iterations; i++)
+		{
+			for (size_t f = 0; f < small->data.size(); f++)
+				blake3_hash(small->data[f], small->sizes[f], digest, 1);
+			do_not_optimize(digest);
+		}
+	}, small->bytes, count });
+
+	for (unsigned lanes : { 1, 4, 8, 16 })
+	{
+		if (lanes > hash_batch_lanes())
+			break;
+		benchmarks.push_back({ "HashMany/SHA1/lanes/" + std::to_string(lanes), [small, digests, lanes](uint64_t iterations) {
+			for (uint64_t i = 0; i < iterations; i++)
+			{
+				sha1_hash_many(small->data.data(), small->sizes.data(), small->data.size(),
+					reinterpret_cast<uint8_t (*)[SHA1_DIGEST_LEN]>(digests->data()), lanes);
+				do_not_optimize(digests->data());
+			}
+		}, small->bytes, count });
+
+		benchmarks.push_back({ "HashMany/BLAKE3/lanes/" + std::to_string(lanes), [small, digests, lanes](uint64_t iterations) {
+			for (uint64_t i = 0; i < iterations; i++)
+			{
+				blake3_hash_many(small->data.data(), small->sizes.data(), small->data.size(),
+					reinterpret_cast<uint8_t (*)[BLAKE3_OUT_LEN]>(digests->data()), lanes);
+				do_not_optimize(digests->data());
+			}
+		}, small->bytes, count });
+	}
+}
+
+// Reading and hashing a window of files, as the client prepares a batch,
+// on pools of different sizes. The files stay in the page cache after the
+// first run, so this shows how the CPU side scales. Items are files.
+static void add_worker_pool_benchmarks(std::vector<Benchmark> &benchmarks)
+{
+	const size_t count = 512;
+	const size_t file_size = 128 << 10;
+	auto directory = std::make_shared<std::string>((std::filesystem::temp_directory_path() / "win_drop_bench_worker_pool").string());
+	auto created = std::make_shared<bool>(false);
+	auto create_files = [directory, created, count, file_size] {
+		if (*created)
+			return;
+		std::filesystem::create_directories(*directory);
+		std::vector<uint8_t> data = make_data(file_size);
+		for (size_t i = 0; i < count; i++)
+		{
+			FILE *file = fopen((*directory + "/" + std::to_string(i)).c_str(), "wb");
+			if (!file)
+				continue;
+			fwrite(data.data(), 1, data.size(), file);
+			fclose(file);
+		}
+		*created = true;
+	};
+
+	std::vector<unsigned> thread_counts = { 1, 2, 4, 8 };
+	unsigned cores = std::max(1u, std::thread::hardware_concurrency());
+	if (std::find(thread_counts.begin(), thread_counts.end(), cores) == thread_counts.end())
+		thread_counts.push_back(cores);
+	for (unsigned threads : thread_counts)
+	{
+		benchmarks.push_back({ "WorkerPool/read_hash/threads/" + std::to_string(threads), [directory, create_files, threads, count, file_size](uint64_t iterations) {
+			create_files();
+			WorkerPool pool;
+			worker_pool_start(pool, threads);
+			std::vector<std::vector<uint8_t>> buffers(worker_pool_size(pool), std::vector<uint8_t>(file_size));
+			std::vector<std::array<uint8_t, BLAKE3_OUT_LEN>> digests(count);
+			for (uint64_t i = 0; i < iterations; i++)
+			{
+				run_parallel(pool, count, [&](size_t index, unsigned worker) {
+					std::vector<uint8_t> &buffer = buffers[worker];
+					FILE *file = fopen((*directory + "/" + std::to_string(index)).c_str(), "rb");
+					if (!file)
+						return;
+					size_t size = fread(buffer.data(), 1, buffer.size(), file);
+					fclose(file);
+					blake3_hash(buffer.data(), size, digests[index].data(), 1);
+				});
+				do_not_optimize(digests[0]);
+			}
+			worker_pool_stop(pool);
+		}, count * file_size, count });
+	}
+}
+
+static void add_file_index_benchmarks(std::vector<Benchmark> &benchmarks)
+{
+	for (size_t count : { 100, 1000, 10000, 100000 })
+	{
+		auto files = std::make_shared<FileIndex>();
+		auto paths = std::make_shared<std::vector<std::string>>();
+		for (size_t i = 0; i < count; i++)
+		{
+			add_hashed_file(*files, make_path(i));
+			paths->push_back(make_path((i * 7919) % count));
+		}
+
+		benchmarks.push_back({ "get_hashed_file/hit/" + std::to_string(count), [files, paths](uint64_t iterations) {
+			size_t n = paths->size();
+			for (uint64_t i = 0; i < iterations; i++)
+			{
+				HashedFile *file = get_hashed_file(*files, (*paths)[size_t(i % n)]);
+				do_not_optimize(file);
+			}
+		}, 0, 1 });
+
+		benchmarks.push_back({ "get_hashed_file/miss/" + std::to_string(count), [files](uint64_t iterations) {
+			std::string missing = make_path(size_t(-1));
+			for (uint64_t i = 0; i < iterations; i++)
+			{
+				HashedFile *file = get_hashed_file(*files, missing);
+				do_not_optimize(file);
+			}
+		}, 0, 1 });
+
+		// Moves a directory holding count files back and forth.
+		auto tree = std::make_shared<FileIndex>();
+		for (size_t i = 0; i < count; i++)
+		{
+			add_hashed_file(*tree, "project\\" + make_path(i));
+			add_hashed_file(*tree, "other\\" + make_path(i));
+		}
+		benchmarks.push_back({ "rename_hashed_path/directory/" + std::to_string(count), [tree](uint64_t iterations) {
+			for (uint64_t i = 0; i < iterations; i++)
+			{
+				bool renamed = has_entries_below(*tree, "renamed");
+				rename_hashed_path(*tree, renamed ? "renamed" : "project", renamed ? "project" : "renamed");
+				do_not_optimize(tree->size());
+			}
+		}, 0, count });
+	}
+}
+
+static void add_change_batch_benchmarks(std::vector<Benchmark> &benchmarks)
+{
+	// One debounce window: 4096 events over 1024 distinct paths, then reset.
+	auto paths = std::make_shared<std::vector<std::string>>();
+	for (size_t i = 0; i < 4096; i++)
+		paths->push_back(make_path(i % 1024));
+
+	benchmarks.push_back({ "ChangeBatch/4096_events", [paths](uint64_t iterations) {
+		ChangeBatch batch;
+		for (uint64_t i = 0; i < iterations; i++)
+		{
+			for (auto &path : *paths)
+				batch.add(0, ChangeAction::Modified, path.data(), path.size());
+			do_not_optimize(batch.changes.back());
+			batch.reset();
+		}
+	}, 0, 4096 });
+
+	struct StringChange
+	{
+		ChangeAction action;
+		std::string name;
+	};
+	benchmarks.push_back({ "vector<string>/4096_events", [paths](uint64_t iterations) {
+		std::vector<StringChange> batch;
+		for (uint64_t i = 0; i < iterations; i++)
+		{
+			for (auto &path : *paths)
+				batch.push_back({ ChangeAction::Modified, std::string(path.data(), path.size()) });
+			do_not_optimize(batch.back());
+			batch.clear();
+		}
+	}, 0, 4096 });
+}
+
+// A typical ignore list against paths that mostly do not match, which is
+// what every change pays.
+static void add_path_filter_benchmarks(std::vector<Benchmark> &benchmarks)
+{
+	std::vector<FilterRule> rules;
+	for (const char *pattern : { ".git", "*.tmp", "*.swp", "~$*", "*.obj", "*.pdb", "*.ilk", "/build", "/out", "node_modules",
+		"__pycache__", "*.pyc", ".vs", "src/**/generated", "*.log", "Thumbs.db" })
+		rules.push_back({ true, pattern });
+	rules.push_back({ false, "keep.log" });
+	auto filter = std::make_shared<PathFilter>();
+	compile_path_filter(*filter, rules);
+	auto paths = std::make_shared<std::vector<std::string>>();
+	for (size_t i = 0; i < 1000; i++)
+		paths->push_back(make_path(i));
+
+	benchmarks.push_back({ "PathFilter/match", [filter, paths](uint64_t iterations) {
+		for (uint64_t i = 0; i < iterations; i++)
+		{
+			bool excluded = path_excluded(*filter, (*paths)[i % paths->size()]);
+			do_not_optimize(excluded);
+		}
+	}, 0, 1 });
+
+	benchmarks.push_back({ "PathFilter/excluded_directory", [filter](uint64_t iterations) {
+		std::string path = ".git\\objects\\pack\\pack-1234.idx";
+		for (uint64_t i = 0; i < iterations; i++)
+		{
+			bool excluded = path_excluded(*filter, path);
+			do_not_optimize(excluded);
+		}
+	}, 0, 1 });
+}
+
+static void add_queue_benchmarks(std::vector<Benchmark> &benchmarks)
+{
+	benchmarks.push_back({ "SpscQueue/push_pop", [](uint64_t iterations) {
+		SpscQueue<uint64_t> queue(256);
+		for (uint64_t i = 0; i < iterations; i++)
+		{
+			uint64_t value = i;
+			queue.try_push(value);
+			queue.try_pop(value);
+			do_not_optimize(value);
+		}
+	}, 0, 1 });
+
+	benchmarks.push_back({ "MpscQueue/push_pop", [](uint64_t iterations) {
+		MpscQueue<uint64_t> queue(256);
+		for (uint64_t i = 0; i < iterations; i++)
+		{
+			uint64_t value = i;
+			queue.try_push(value);
+			queue.try_pop(value);
+			do_not_optimize(value);
+		}
+	}, 0, 1 });
+
+	// A producer and a consumer thread moving items through a small queue.
+	benchmarks.push_back({ "SpscQueue/threaded", [](uint64_t iterations) {
+		SpscQueue<uint64_t> queue(256);
+		std::thread consumer([&queue] {
+			uint64_t value;
+			while (pop_wait(queue, value))
+				do_not_optimize(value);
+		});
+		for (uint64_t i = 0; i < iterations; i++)
+		{
+			uint64_t value = i;
+			push_wait(queue, value);
+		}
+		queue.close();
+		consumer.join();
+	}, 0, 1 });
+}
+
+static void add_pacer_benchmarks(std::vector<Benchmark> &benchmarks)
+{
+	benchmarks.push_back({ "TokenBucket/take", [](uint64_t iterations) {
+		TokenBucket bucket;
+		set_rate(bucket, uint64_t(1) << 40);
+		uint64_t now = stats_now();
+		for (uint64_t i = 0; i < iterations; i++)
+		{
+			uint64_t wait = token_bucket_take(bucket, PACING_CHUNK, now + i * 1000);
+			do_not_optimize(wait);
+		}
+	}, 0, 1 });
+}
+
+static void add_stats_benchmarks(std::vector<Benchmark> &benchmarks)
+{
+	benchmarks.push_back({ "stats_record", [](uint64_t iterations) {
+		for (uint64_t i = 0; i < iterations; i++)
+			stats_record(Stage::Hash, i * 977);
+	}, 0, 1 });
+
+	benchmarks.push_back({ "StatsTimer", [](uint64_t iterations) {
+		for (uint64_t i = 0; i < iterations; i++)
+			StatsTimer timer(Stage::Send);
+	}, 0, 1 });
+
+	benchmarks.push_back({ "TraceScope/disabled", [](uint64_t iterations) {
+		std::string path = make_path(42);
+		for (uint64_t i = 0; i < iterations; i++)
+		{
+			TraceScope trace("read_file");
+			trace.set_detail(path);
+			trace.bytes = i;
+			do_not_optimize(trace);
+		}
+	}, 0, 1 });
+}
+
+#ifdef _WIN32
+static int open_for_write(const std::string &path)
+{
+	return _open(path.c_str(), _O_WRONLY | _O_CREAT | _O_TRUNC | _O_BINARY, _S_IREAD | _S_IWRITE);
+}
+
+static void write_file(int file, const std::vector<uint8_t> &data)
+{
+	_write(file, data.data(), unsigned(data.size()));
+}
+
+static void flush_file(int file)
+{
+	_commit(file);
+}
+
+static void close_file(int file)
+{
+	_close(file);
+}
+#else
+static int open_for_write(const std::string &path)
+{
+	return open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+}
+
+static void write_file(int file, const std::vector<uint8_t> &data)
+{
+	ssize_t written = write(file, data.data(), data.size());
+	do_not_optimize(written);
+}
+
+static void flush_file(int file)
+{
+	fsync(file);
+}
+
+static void close_file(int file)
+{
+	close(file);
+}
+#endif
+
+// The same scheme as the server's group commit, with plain file
+// descriptors so it runs anywhere: written files are handed to a thread
+// that flushes and closes them a group at a time.
+struct GroupFlusher
+{
+	GroupFlusher(size_t max_batch)
+		: max_batch(max_batch)
+		, thread([this] { run(); })
+	{}
+
+	~GroupFlusher()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stop = true;
+			wake.notify_one();
+		}
+		thread.join();
+	}
+
+	void hand_off(int file)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		pending.push_back(file);
+		if (pending.size() >= max_batch)
+			wake.notify_one();
+	}
+
+	void run()
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		while (!stop || !pending.empty())
+		{
+			if (!stop && pending.size() < max_batch)
+			{
+				wake.wait_for(lock, std::chrono::milliseconds(10));
+				if (pending.empty())
+					continue;
+			}
+			std::vector<int> group;
+			group.swap(pending);
+			lock.unlock();
+			for (int file : group)
+			{
+				flush_file(file);
+				close_file(file);
+			}
+			lock.lock();
+		}
+	}
+
+	size_t max_batch;
+	std::mutex mutex;
+	std::condition_variable wake;
+	std::vector<int> pending;
+	bool stop = false;
+	std::thread thread;
+};
+
+// Small files written into a scratch directory, which is where the cost of
+// a flush per file hurts most. Iterations rewrite the same set of names.
+static void add_durability_benchmarks(std::vector<Benchmark> &benchmarks)
+{
+	const size_t file_size = 4096;
+	const size_t file_count = 64;
+	auto directory = std::make_shared<std::filesystem::path>(std::filesystem::temp_directory_path() / "win_drop_bench_durability");
+	auto write_files = [directory, file_size, file_count](uint64_t iterations, const std::function<void(int)> &done) {
+		std::filesystem::create_directories(*directory);
+		std::vector<uint8_t> data = make_data(file_size);
+		for (uint64_t i = 0; i < iterations; i++)
+		{
+			int file = open_for_write((*directory / ("file" + std::to_string(i % file_count))).string());
+			if (file < 0)
+				continue;
+			write_file(file, data);
+			done(file);
+		}
+	};
+
+	benchmarks.push_back({ "Durability/none", [write_files](uint64_t iterations) {
+		write_files(iterations, [](int file) { close_file(file); });
+	}, file_size, 1 });
+
+	benchmarks.push_back({ "Durability/flush_each", [write_files](uint64_t iterations) {
+		write_files(iterations, [](int file) {
+			flush_file(file);
+			close_file(file);
+		});
+	}, file_size, 1 });
+
+	for (size_t max_batch : { 8, 64 })
+	{
+		benchmarks.push_back({ "Durability/group/" + std::to_string(max_batch), [write_files, max_batch](uint64_t iterations) {
+			GroupFlusher flusher(max_batch);
+			write_files(iterations, [&flusher](int file) { flusher.hand_off(file); });
+		}, file_size, 1 });
+	}
+}
+
+#ifdef __linux__
+// The fraction of the file's pages the page cache holds.
+static double cached_fraction(const std::string &path, size_t size)
+{
+	int file = open(path.c_str(), O_RDONLY);
+	if (file < 0)
+		return 0;
+	void *mapped = mmap(nullptr, size, PROT_READ, MAP_SHARED, file, 0);
+	close(file);
+	if (mapped == MAP_FAILED)
+		return 0;
+	size_t page = size_t(sysconf(_SC_PAGESIZE));
+	std::vector<unsigned char> resident((size + page - 1) / page);
+	size_t cached = 0;
+	if (mincore(mapped, size, resident.data()) == 0)
+	{
+		for (unsigned char flags : resident)
+			cached += flags & 1;
+	}
+	munmap(mapped, size);
+	return double(cached) / double(resident.size());
+}
+
+// A large file written the way the server used to, in 32KB buffered
+// writes, against 4MB aligned O_DIRECT writes from a second thread while
+// the next buffer is filled. Both end with fdatasync so the buffered case
+// pays for its writeback too. How much of the file is left in the page
+// cache is printed once per benchmark.
+static void add_large_write_benchmarks(std::vector<Benchmark> &benchmarks)
+{
+	const size_t file_size = 256 << 20;
+	const size_t buffer_size = 4 << 20;
+	std::string path = (std::filesystem::temp_directory_path() / "win_drop_bench_large_write").string();
+	auto data = std::make_shared<std::vector<uint8_t>>(make_data(buffer_size));
+
+	auto printed = std::make_shared<bool>(false);
+	benchmarks.push_back({ "LargeWrite/buffered", [path, data, printed, file_size](uint64_t iterations) {
+		for (uint64_t i = 0; i < iterations; i++)
+		{
+			int file = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+			if (file < 0)
+				return;
+			for (size_t offset = 0; offset < file_size; offset += 1 << 15)
+			{
+				ssize_t written = write(file, data->data() + offset % data->size(), 1 << 15);
+				do_not_optimize(written);
+			}
+			fdatasync(file);
+			close(file);
+		}
+		if (!*printed)
+			fprintf(stderr, "LargeWrite/buffered leaves %.0f%% of the file cached\n", cached_fraction(path, file_size) * 100);
+		*printed = true;
+	}, file_size, 1 });
+
+	int probe = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, 0644);
+	if (probe < 0)
+	{
+		fprintf(stderr, "O_DIRECT is not supported in %s, skipping LargeWrite/direct\n", path.c_str());
+		return;
+	}
+	close(probe);
+
+	auto direct_printed = std::make_shared<bool>(false);
+	benchmarks.push_back({ "LargeWrite/direct", [path, data, direct_printed, file_size, buffer_size](uint64_t iterations) {
+		const int buffer_count = 4;
+		std::vector<uint8_t *> buffers(buffer_count);
+		for (auto &buffer : buffers)
+		{
+			if (posix_memalign((void **)&buffer, 4096, buffer_size) != 0)
+				return;
+		}
+		for (uint64_t i = 0; i < iterations; i++)
+		{
+			int file = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, 0644);
+			if (file < 0)
+				break;
+			SpscQueue<uint8_t *> filled(buffer_count);
+			SpscQueue<uint8_t *> returned(buffer_count);
+			std::thread writer([&filled, &returned, file, buffer_size] {
+				uint8_t *buffer;
+				off_t offset = 0;
+				while (pop_wait(filled, buffer))
+				{
+					ssize_t written = pwrite(file, buffer, buffer_size, offset);
+					do_not_optimize(written);
+					offset += off_t(buffer_size);
+					push_wait(returned, buffer);
+				}
+			});
+			size_t next = 0;
+			for (size_t offset = 0; offset < file_size; offset += buffer_size)
+			{
+				uint8_t *buffer;
+				if (next < buffers.size())
+					buffer = buffers[next++];
+				else
+					pop_wait(returned, buffer);
+				memcpy(buffer, data->data(), buffer_size);
+				push_wait(filled, buffer);
+			}
+			filled.close();
+			writer.join();
+			fdatasync(file);
+			close(file);
+		}
+		for (auto buffer : buffers)
+			free(buffer);
+		if (!*direct_printed)
+			fprintf(stderr, "LargeWrite/direct leaves %.0f%% of the file cached\n", cached_fraction(path, file_size) * 100);
+		*direct_printed = true;
+	}, file_size, 1 });
+}
+
+// Reads events until the change shows up in the batch.
+static bool wait_for_change(InotifyWatcher &watcher, ChangeBatch &batch, const PathFilter &filter, ChangeAction action, std::string_view name)
+{
+	while (wait_inotify_events(watcher, 1000))
+	{
+		if (!read_inotify_events(watcher, batch, filter))
+			return false;
+		for (auto &change : batch.changes)
+		{
+			if (change.action == action && batch.name(change) == name)
+			{
+				batch.reset();
+				return true;
+			}
+		}
+	}
+	fprintf(stderr, "Timed out waiting for %.*s\n", int(name.size()), name.data());
+	return false;
+}
+
+// From a change on disk to the change in a batch, through inotify. The
+// tree case creates a directory with a file already in it by the time its
+// watch is added, which the walk of the new directory has to find.
+static void add_inotify_benchmarks(std::vector<Benchmark> &benchmarks)
+{
+	auto directory = std::make_shared<std::string>((std::filesystem::temp_directory_path() / "win_drop_bench_inotify").string());
+	std::filesystem::remove_all(*directory);
+	std::filesystem::create_directories(*directory + "/a/b/c");
+
+	benchmarks.push_back({ "Inotify/create_delete", [directory](uint64_t iterations) {
+		InotifyWatcher watcher;
+		PathFilter filter;
+		ChangeBatch batch;
+		if (!open_inotify_watcher(watcher, { *directory }, filter))
+			return;
+		std::string path = *directory + "/a/b/c/file";
+		for (uint64_t i = 0; i < iterations; i++)
+		{
+			close(open(path.c_str(), O_WRONLY | O_CREAT, 0644));
+			if (!wait_for_change(watcher, batch, filter, ChangeAction::Added, "a\\b\\c\\file"))
+				break;
+			unlink(path.c_str());
+			if (!wait_for_change(watcher, batch, filter, ChangeAction::Removed, "a\\b\\c\\file"))
+				break;
+		}
+		close_inotify_watcher(watcher);
+	}, 0, 2 });
+
+	benchmarks.push_back({ "Inotify/new_tree", [directory](uint64_t iterations) {
+		InotifyWatcher watcher;
+		PathFilter filter;
+		ChangeBatch batch;
+		if (!open_inotify_watcher(watcher, { *directory }, filter))
+			return;
+		std::string tree = *directory + "/a/new";
+		std::string path = tree + "/file";
+		for (uint64_t i = 0; i < iterations; i++)
+		{
+			mkdir(tree.c_str(), 0755);
+			close(open(path.c_str(), O_WRONLY | O_CREAT, 0644));
+			if (!wait_for_change(watcher, batch, filter, ChangeAction::Added, "a\\new\\file"))
+				break;
+			unlink(path.c_str());
+			rmdir(tree.c_str());
+			if (!wait_for_change(watcher, batch, filter, ChangeAction::Removed, "a\\new"))
+				break;
+		}
+		close_inotify_watcher(watcher);
+	}, 0, 2 });
+
+	benchmarks.push_back({ "Inotify/rename", [directory](uint64_t iterations) {
+		InotifyWatcher watcher;
+		PathFilter filter;
+		ChangeBatch batch;
+		if (!open_inotify_watcher(watcher, { *directory }, filter))
+			return;
+		std::string from = *directory + "/a/b/renamed";
+		std::string to = *directory + "/a/renamed";
+		std::string from_name = "a\\b\\renamed";
+		std::string to_name = "a\\renamed";
+		close(open(from.c_str(), O_WRONLY | O_CREAT, 0644));
+		wait_for_change(watcher, batch, filter, ChangeAction::Added, from_name);
+		for (uint64_t i = 0; i < iterations; i++)
+		{
+			rename(from.c_str(), to.c_str());
+			if (!wait_for_change(watcher, batch, filter, ChangeAction::RenamedNewName, to_name))
+				break;
+			std::swap(from, to);
+			std::swap(from_name, to_name);
+		}
+		unlink(from.c_str());
+		close_inotify_watcher(watcher);
+	}, 0, 1 });
+}
+
+static bool wait_for_change(FanotifyWatcher &watcher, ChangeBatch &batch, const PathFilter &filter, ChangeAction action, std::string_view name)
+{
+	while (wait_fanotify_events(watcher, 1000))
+	{
+		if (!read_fanotify_events(watcher, batch, filter))
+			return false;
+		for (auto &change : batch.changes)
+		{
+			if (change.action == action && batch.name(change) == name)
+			{
+				batch.reset();
+				return true;
+			}
+		}
+	}
+	fprintf(stderr, "Timed out waiting for %.*s\n", int(name.size()), name.data());
+	return false;
+}
+
+// The same changes through a fanotify mark on the whole filesystem. Every
+// event resolves its directory handle through the cache, and events from
+// the rest of the filesystem are dropped by the watcher. Needs root.
+static void add_fanotify_benchmarks(std::vector<Benchmark> &benchmarks)
+{
+	auto directory = std::make_shared<std::string>((std::filesystem::temp_directory_path() / "win_drop_bench_fanotify").string());
+	std::filesystem::remove_all(*directory);
+	std::filesystem::create_directories(*directory + "/a/b/c");
+
+	benchmarks.push_back({ "Fanotify/create_delete", [directory](uint64_t iterations) {
+		FanotifyWatcher watcher;
+		PathFilter filter;
+		ChangeBatch batch;
+		if (!open_fanotify_watcher(watcher, { *directory }))
+			return;
+		std::string path = *directory + "/a/b/c/file";
+		for (uint64_t i = 0; i < iterations; i++)
+		{
+			close(open(path.c_str(), O_WRONLY | O_CREAT, 0644));
+			if (!wait_for_change(watcher, batch, filter, ChangeAction::Added, "a\\b\\c\\file"))
+				break;
+			unlink(path.c_str());
+			if (!wait_for_change(watcher, batch, filter, ChangeAction::Removed, "a\\b\\c\\file"))
+				break;
+		}
+		close_fanotify_watcher(watcher);
+	}, 0, 2 });
+
+	benchmarks.push_back({ "Fanotify/rename", [directory](uint64_t iterations) {
+		FanotifyWatcher watcher;
+		PathFilter filter;
+		ChangeBatch batch;
+		if (!open_fanotify_watcher(watcher, { *directory }))
+			return;
+		std::string from = *directory + "/a/b/renamed";
+		std::string to = *directory + "/a/renamed";
+		std::string from_name = "a\\b\\renamed";
+		std::string to_name = "a\\renamed";
+		close(open(from.c_str(), O_WRONLY | O_CREAT, 0644));
+		wait_for_change(watcher, batch, filter, ChangeAction::Added, from_name);
+		for (uint64_t i = 0; i < iterations; i++)
+		{
+			rename(from.c_str(), to.c_str());
+			if (!wait_for_change(watcher, batch, filter, ChangeAction::RenamedNewName, to_name))
+				break;
+			std::swap(from, to);
+			std::swap(from_name, to_name);
+		}
+		unlink(from.c_str());
+		close_fanotify_watcher(watcher);
+	}, 0, 1 });
+}
+
+// Reading a large file cold, the way the client reads one to hash and send
+// it. Buffered reads leave the whole file in the page cache. fadvise asks
+// for sequential read-ahead plus an explicit window ahead of the cursor and
+// drops what is behind it. O_DIRECT reads 4MB aligned buffers on a second
+// thread while the last one is copied out, close to the overlapped reads
+// the client makes unbuffered on Windows. How much of the file is left in
+// the page cache is printed once per benchmark.
+static void add_large_read_benchmarks(std::vector<Benchmark> &benchmarks)
+{
+	const size_t file_size = 256 << 20;
+	const size_t buffer_size = 4 << 20;
+	std::string path = (std::filesystem::temp_directory_path() / "win_drop_bench_large_read").string();
+	auto created = std::make_shared<bool>(false);
+	// Written once on first use and flushed, so its pages are clean and can
+	// be dropped before every read.
+	auto open_cold = [path, created, file_size, buffer_size](int flags) {
+		if (!*created)
+		{
+			std::vector<uint8_t> data = make_data(buffer_size);
+			int file = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+			for (size_t offset = 0; file >= 0 && offset < file_size; offset += buffer_size)
+			{
+				ssize_t written = write(file, data.data(), buffer_size);
+				do_not_optimize(written);
+			}
+			if (file >= 0)
+			{
+				fdatasync(file);
+				close(file);
+			}
+			*created = true;
+		}
+		int file = open(path.c_str(), O_RDONLY | flags);
+		if (file >= 0)
+			posix_fadvise(file, 0, 0, POSIX_FADV_DONTNEED);
+		return file;
+	};
+	auto print_cached = [path, file_size](const char *name, bool &printed) {
+		if (!printed)
+			fprintf(stderr, "%s leaves %.0f%% of the file cached\n", name, cached_fraction(path, file_size) * 100);
+		printed = true;
+	};
+
+	auto buffered_printed = std::make_shared<bool>(false);
+	benchmarks.push_back({ "LargeRead/buffered", [open_cold, print_cached, buffered_printed, buffer_size](uint64_t iterations) {
+		std::vector<uint8_t> buffer(buffer_size);
+		for (uint64_t i = 0; i < iterations; i++)
+		{
+			int file = open_cold(0);
+			if (file < 0)
+				return;
+			while (read(file, buffer.data(), buffer.size()) > 0)
+				do_not_optimize(buffer[0]);
+			close(file);
+		}
+		print_cached("LargeRead/buffered", *buffered_printed);
+	}, file_size, 1 });
+
+	auto fadvise_printed = std::make_shared<bool>(false);
+	benchmarks.push_back({ "LargeRead/fadvise", [open_cold, print_cached, fadvise_printed, buffer_size](uint64_t iterations) {
+		const off_t window = 16 << 20;
+		std::vector<uint8_t> buffer(buffer_size);
+		for (uint64_t i = 0; i < iterations; i++)
+		{
+			int file = open_cold(0);
+			if (file < 0)
+				return;
+			posix_fadvise(file, 0, 0, POSIX_FADV_SEQUENTIAL);
+			posix_fadvise(file, 0, window, POSIX_FADV_WILLNEED);
+			off_t offset = 0;
+			ssize_t bytes_read;
+			while ((bytes_read = read(file, buffer.data(), buffer.size())) > 0)
+			{
+				do_not_optimize(buffer[0]);
+				posix_fadvise(file, offset + window, bytes_read, POSIX_FADV_WILLNEED);
+				posix_fadvise(file, offset, bytes_read, POSIX_FADV_DONTNEED);
+				offset += bytes_read;
+			}
+			close(file);
+		}
+		print_cached("LargeRead/fadvise", *fadvise_printed);
+	}, file_size, 1 });
+
+	int probe = open(path.c_str(), O_RDONLY | O_CREAT | O_DIRECT, 0644);
+	if (probe < 0)
+	{
+		fprintf(stderr, "O_DIRECT is not supported in %s, skipping LargeRead/direct\n", path.c_str());
+		return;
+	}
+	close(probe);
+
+	auto direct_printed = std::make_shared<bool>(false);
+	benchmarks.push_back({ "LargeRead/direct", [open_cold, print_cached, direct_printed, file_size, buffer_size](uint64_t iterations) {
+		const int buffer_count = 4;
+		std::vector<uint8_t *> buffers(buffer_count);
+		for (auto &buffer : buffers)
+		{
+			if (posix_memalign((void **)&buffer, 4096, buffer_size) != 0)
+				return;
+		}
+		std::vector<uint8_t> data(buffer_size);
+		for (uint64_t i = 0; i < iterations; i++)
+		{
+			int file = open_cold(O_DIRECT);
+			if (file < 0)
+				break;
+			// The reader thread keeps the next buffers in flight while this
+			// one is copied out.
+			SpscQueue<uint8_t *> filled(buffer_count);
+			SpscQueue<uint8_t *> returned(buffer_count);
+			for (auto buffer : buffers)
+				push_wait(returned, buffer);
+			std::thread reader([&filled, &returned, file, file_size, buffer_size] {
+				uint8_t *buffer;
+				for (off_t offset = 0; offset < off_t(file_size) && pop_wait(returned, buffer); offset += off_t(buffer_size))
+				{
+					ssize_t bytes_read = pread(file, buffer, buffer_size, offset);
+					do_not_optimize(bytes_read);
+					push_wait(filled, buffer);
+				}
+				filled.close();
+			});
+			uint8_t *buffer;
+			while (pop_wait(filled, buffer))
+			{
+				memcpy(data.data(), buffer, buffer_size);
+				do_not_optimize(data[0]);
+				push_wait(returned, buffer);
+			}
+			reader.join();
+			close(file);
+		}
+		for (auto buffer : buffers)
+			free(buffer);
+		print_cached("LargeRead/direct", *direct_printed);
+	}, file_size, 1 });
+}
+#endif
+
+int main(int argc, char **argv)
+{
+	BenchOptions options;
+	for (int i = 1; i < argc; i++)
+	{
+		std::string arg = argv[i];
+		if (arg == "--filter" && i + 1 < argc)
+			options.filter = argv[++i];
+		else if (arg == "--out" && i + 1 < argc)
+			options.out_file = argv[++i];
+		else if (arg == "--min-time" && i + 1 < argc)
+			options.min_time = atof(argv[++i]);
+		else if (arg == "--repetitions" && i + 1 < argc)
+			options.repetitions = std::max(1, atoi(argv[++i]));
+		else
+		{
+			fprintf(stderr, "usage: win_drop_bench [--filter substring] [--out file.json] [--min-time seconds] [--repetitions n]\n");
+			return 1;
+		}
+	}
+
+	std::vector<Benchmark> benchmarks;
+	add_serializer_benchmarks(benchmarks);
+	add_header_benchmarks(benchmarks);
+	add_sha1_benchmarks(benchmarks);
+	add_blake3_benchmarks(benchmarks);
+	add_hash_batch_benchmarks(benchmarks);
+	add_worker_pool_benchmarks(benchmarks);
+	add_file_index_benchmarks(benchmarks);
+	add_change_batch_benchmarks(benchmarks);
+	add_path_filter_benchmarks(benchmarks);
+	add_queue_benchmarks(benchmarks);
+	add_pacer_benchmarks(benchmarks);
+	add_stats_benchmarks(benchmarks);
+	add_durability_benchmarks(benchmarks);
+#ifdef __linux__
+	add_large_write_benchmarks(benchmarks);
+	add_large_read_benchmarks(benchmarks);
+	add_inotify_benchmarks(benchmarks);
+	add_fanotify_benchmarks(benchmarks);
+#endif
+	return run_benchmarks(benchmarks, options);
+}
@@ -0,0 +1,163 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <algorithm>
+#include <chrono>
+#include <ctime>
+#include <functional>
+#include <string>
+#include <thread>
+#include <vector>
+
+// A tiny benchmark runner. Every benchmark is called with an iteration
+// count and is calibrated until one run takes at least min_time seconds.
+// The reported time is the median over the repetitions. The JSON output
+// follows the layout written by google/benchmark so its compare.py can be
+// used to diff two builds.
+
+template<typename T>
+inline void do_not_optimize(const T &value)
+{
+#if defined(__GNUC__) || defined(__clang__)
+	asm volatile("" : : "r,m"(value) : "memory");
+#else
+	const volatile char *sink = reinterpret_cast<const volatile char *>(&value);
+	(void)*sink;
+#endif
+}
+
+struct Benchmark
+{
+	std::string name;
+	std::function<void(uint64_t iterations)> run;
+	uint64_t bytes_per_iteration;
+	uint64_t items_per_iteration;
+};
+
+struct BenchResult
+{
+	std::string name;
+	uint64_t iterations;
+	double real_time_ns;
+	double cpu_time_ns;
+	double bytes_per_second;
+	double items_per_second;
+};
+
+struct BenchOptions
+{
+	std::string filter;
+	std::string out_file;
+	double min_time = 0.2;
+	int repetitions = 5;
+};
+
+static double time_run(const Benchmark &benchmark, uint64_t iterations, double &cpu_seconds)
+{
+	std::clock_t cpu_start = std::clock();
+	auto start = std::chrono::steady_clock::now();
+	benchmark.run(iterations);
+	auto end = std::chrono::steady_clock::now();
+	cpu_seconds = double(std::clock() - cpu_start) / CLOCKS_PER_SEC;
+	return std::chrono::duration<double>(end - start).count();
+}
+
+static BenchResult run_benchmark(const Benchmark &benchmark, const BenchOptions &options)
+{
+	uint64_t iterations = 1;
+	double cpu_seconds;
+	double seconds = time_run(benchmark, iterations, cpu_seconds);
+	while (seconds < options.min_time && iterations < (uint64_t(1) << 40))
+	{
+		double scale = seconds > 0 ? options.min_time * 1.4 / seconds : 100;
+		iterations = std::max(iterations + 1, uint64_t(double(iterations) * std::min(scale, 100.0)));
+		seconds = time_run(benchmark, iterations, cpu_seconds);
+	}
+
+	std::vector<double> real_times;
+	std::vector<double> cpu_times;
+	for (int i = 0; i < options.repetitions; i++)
+	{
+		real_times.push_back(time_run(benchmark, iterations, cpu_seconds) * 1e9 / double(iterations));
+		cpu_times.push_back(cpu_seconds * 1e9 / double(iterations));
+	}
+	std::sort(real_times.begin(), real_times.end());
+	std::sort(cpu_times.begin(), cpu_times.end());
+
+	BenchResult result;
+	result.name = benchmark.name;
+	result.iterations = iterations;
+	result.real_time_ns = real_times[real_times.size() / 2];
+	result.cpu_time_ns = cpu_times[cpu_times.size() / 2];
+	result.bytes_per_second = result.real_time_ns > 0 ? double(benchmark.bytes_per_iteration) * 1e9 / result.real_time_ns : 0;
+	result.items_per_second = result.real_time_ns > 0 ? double(benchmark.items_per_iteration) * 1e9 / result.real_time_ns : 0;
+	return result;
+}
+
+static void write_json(FILE *out, const std::vector<BenchResult> &results)
+{
+	char date[64];
+	std::time_t now = std::time(nullptr);
+	std::strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S", std::localtime(&now));
+	fprintf(out, "{\n  \"context\": {\n");
+	fprintf(out, "    \"date\": \"%s\",\n", date);
+	fprintf(out, "    \"executable\": \"win_drop_bench\",\n");
+	fprintf(out, "    \"num_cpus\": %u,\n", std::thread::hardware_concurrency());
+#ifdef NDEBUG
+	fprintf(out, "    \"library_build_type\": \"release\"\n");
+#else
+	fprintf(out, "    \"library_build_type\": \"debug\"\n");
+#endif
+	fprintf(out, "  },\n  \"benchmarks\": [\n");
+	for (size_t i = 0; i < results.size(); i++)
+	{
+		const BenchResult &result = results[i];
+		fprintf(out, "    {\n");
+		fprintf(out, "      \"name\": \"%s\",\n", result.name.c_str());
+		fprintf(out, "      \"run_name\": \"%s\",\n", result.name.c_str());
+		fprintf(out, "      \"run_type\": \"iteration\",\n");
+		fprintf(out, "      \"iterations\": %llu,\n", (unsigned long long)result.iterations);
+		fprintf(out, "      \"real_time\": %.3f,\n", result.real_time_ns);
+		fprintf(out, "      \"cpu_time\": %.3f,\n", result.cpu_time_ns);
+		fprintf(out, "      \"time_unit\": \"ns\",\n");
+		fprintf(out, "      \"bytes_per_second\": %.1f,\n", result.bytes_per_second);
+		fprintf(out, "      \"items_per_second\": %.1f\n", result.items_per_second);
+		fprintf(out, "    }%s\n", i + 1 < results.size() ? "," : "");
+	}
+	fprintf(out, "  ]\n}\n");
+}
+
+static int run_benchmarks(const std::vector<Benchmark> &benchmarks, const BenchOptions &options)
+{
+	std::vector<BenchResult> results;
+	for (auto &benchmark : benchmarks)
+	{
+		if (!options.filter.empty() && benchmark.name.find(options.filter) == std::string::npos)
+			continue;
+		BenchResult result = run_benchmark(benchmark, options);
+		fprintf(stderr, "%-48s %14.1f ns %12llu", result.name.c_str(), result.real_time_ns, (unsigned long long)result.iterations);
+		if (result.bytes_per_second > 0)
+			fprintf(stderr, " %10.1f MB/s", result.bytes_per_second / (1024 * 1024));
+		if (result.items_per_second > 0)
+			fprintf(stderr, " %12.0f items/s", result.items_per_second);
+		fprintf(stderr, "\n");
+		results.push_back(result);
+	}
+
+	FILE *out = stdout;
+	if (!options.out_file.empty())
+	{
+		out = fopen(options.out_file.c_str(), "w");
+		if (!out)
+		{
+			fprintf(stderr, "Failed to open %s for writing\n", options.out_file.c_str());
+			return 1;
+		}
+	}
+	write_json(out, results);
+	if (out != stdout)
+		fclose(out);
+	return 0;
+}
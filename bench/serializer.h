@@ -1,5 +1,9 @@
 #pragma once
 
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
 struct Serializer
 {
 	Serializer(uint8_t *buffer, size_t buffer_size)
@@ -0,0 +1,163 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+
+#include <algorithm>
+#include <memory>
+#include <string_view>
+#include <vector>
+
+// What ReadDirectoryChangesW reported, before it is turned into a
+// protocol FileAction.
+enum class ChangeAction
+{
+	Added = 1,
+	Removed = 2,
+	Modified = 3,
+	RenamedOldName = 4,
+	RenamedNewName = 5
+};
+
+struct FileChange
+{
+	ChangeAction action;
+	uint32_t root;
+	uint32_t name_offset;
+	uint32_t name_size;
+};
+
+struct InternSlot
+{
+	uint32_t generation;
+	uint32_t hash;
+	uint32_t root;
+	uint32_t name_offset;
+	uint32_t name_size;
+};
+
+// All the changes collected during one debounce window, across all watched
+// roots. Names are relative to their root and are stored
+// back to back in one arena and interned, so a file that is written many
+// times in a batch only takes up space once. reset() keeps every buffer and
+// bumps the intern generation instead of clearing the table, so once the
+// buffers have grown to the size of a typical burst no more memory is
+// allocated.
+struct ChangeBatch
+{
+	std::vector<FileChange> changes;
+	std::unique_ptr<char[]> arena;
+	size_t arena_size = 0;
+	size_t arena_capacity = 0;
+	std::vector<InternSlot> intern;
+	uint32_t generation = 1;
+	uint32_t interned = 0;
+	uint64_t first_change_time = 0;
+
+	bool empty() const
+	{
+		return changes.empty();
+	}
+
+	std::string_view name(const FileChange &change) const
+	{
+		return std::string_view(arena.get() + change.name_offset, change.name_size);
+	}
+
+	// Returns space for a name of at most max_size bytes at the end of the
+	// arena. Finish with commit_name() with the number of bytes written.
+	char *reserve_name(size_t max_size)
+	{
+		if (arena_size + max_size > arena_capacity)
+		{
+			size_t capacity = std::max(arena_capacity * 2, arena_size + max_size + 4096);
+			std::unique_ptr<char[]> grown(new char[capacity]);
+			if (arena_size)
+				memcpy(grown.get(), arena.get(), arena_size);
+			arena.swap(grown);
+			arena_capacity = capacity;
+		}
+		return arena.get() + arena_size;
+	}
+
+	void commit_name(uint32_t root, ChangeAction action, size_t size)
+	{
+		uint32_t offset = uint32_t(arena_size);
+		const char *name = arena.get() + offset;
+		uint32_t hash = hash_name(name, size) ^ root;
+		if (interned * 2 >= intern.size())
+			grow_intern();
+		size_t mask = intern.size() - 1;
+		size_t slot = hash & mask;
+		while (intern[slot].generation == generation)
+		{
+			InternSlot &existing = intern[slot];
+			if (existing.hash == hash && existing.root == root && existing.name_size == size
+				&& memcmp(arena.get() + existing.name_offset, name, size) == 0)
+			{
+				changes.push_back({ action, root, existing.name_offset, existing.name_size });
+				return;
+			}
+			slot = (slot + 1) & mask;
+		}
+		intern[slot] = { generation, hash, root, offset, uint32_t(size) };
+		interned++;
+		arena_size += size;
+		changes.push_back({ action, root, offset, uint32_t(size) });
+	}
+
+	void add(uint32_t root, ChangeAction action, const char *name, size_t size)
+	{
+		memcpy(reserve_name(size), name, size);
+		commit_name(root, action, size);
+	}
+
+	void reset()
+	{
+		changes.clear();
+		arena_size = 0;
+		interned = 0;
+		first_change_time = 0;
+		if (++generation == 0)
+		{
+			for (auto &slot : intern)
+				slot.generation = 0;
+			generation = 1;
+		}
+	}
+
+private:
+	static uint32_t hash_name(const char *name, size_t size)
+	{
+		uint64_t hash = 0x9e3779b97f4a7c15ull ^ size;
+		size_t i = 0;
+		for (; i + 8 <= size; i += 8)
+		{
+			uint64_t word;
+			memcpy(&word, name + i, 8);
+			hash = (hash ^ word) * 0xff51afd7ed558ccdull;
+			hash ^= hash >> 32;
+		}
+		uint64_t tail = 0;
+		memcpy(&tail, name + i, size - i);
+		hash = (hash ^ tail) * 0xc4ceb9fe1a85ec53ull;
+		return uint32_t(hash ^ (hash >> 29));
+	}
+
+	void grow_intern()
+	{
+		std::vector<InternSlot> old;
+		old.swap(intern);
+		intern.resize(old.empty() ? 256 : old.size() * 2, InternSlot{ 0, 0, 0, 0, 0 });
+		size_t mask = intern.size() - 1;
+		for (auto &entry : old)
+		{
+			if (entry.generation != generation)
+				continue;
+			size_t slot = entry.hash & mask;
+			while (intern[slot].generation == generation)
+				slot = (slot + 1) & mask;
+			intern[slot] = entry;
+		}
+	}
+};
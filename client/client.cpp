@@ -1,47 +1,172 @@
 #include "client.h"
 
 #include "win_global.h"
+#include <winioctl.h>
 
 #include <vector>
+#include <unordered_map>
 #include <chrono>
+#include <thread>
 
 #include <algorithm>
+#include <assert.h>
 
 extern "C" {
 #include "sha1.h"
 }
 
-#include "serializer.h"
+#include "protocol.h"
+#include "blake3.h"
+#include "hash_batch.h"
+#include "queue.h"
+#include "shared_ring.h"
+#include "pacer.h"
+#include "file_index.h"
+#include "direct_reader.h"
+#include "worker_pool.h"
+#include "change_batch.h"
+#include "path_filter.h"
+#include "usn_journal.h"
+#include "stats.h"
+#include "trace.h"
 
 #define DEFAULT_PORT "41218"
 
-struct HashedFile
+// The watcher, the hasher and one sender per server each run on their own
+// thread. One watcher serves every root through a completion port. It
+// hands finished batches to the hasher over an SPSC queue and gets them
+// back over another once they are processed. The hasher reads and hashes
+// each file once and queues the same message to every target over an MPSC
+// queue.
+#define BATCH_QUEUE_SIZE 2
+#define BATCH_POOL_SIZE (BATCH_QUEUE_SIZE + 2)
+// The in-flight window of each target, in messages and in file data.
+#define MESSAGE_QUEUE_SIZE 256
+#define MAX_QUEUED_BYTES (uint64_t(64) << 20)
+#define BACKPRESSURE_RETRY_MS 50
+// Files at least this large keep their hash state, and when they only grow
+// only the new bytes are sent. APPEND_SAMPLE_SIZE bytes at each end of what
+// was sent are compared to tell an append from a rewrite.
+#define APPEND_MIN_SIZE (uint64_t(1) << 20)
+#define APPEND_SAMPLE_SIZE 4096
+// Files up to this size are read ahead of the rest of their batch and hashed
+// side by side, one per SIMD lane.
+#define BATCH_HASH_MAX_SIZE (64 << 10)
+// A batch is read and hashed on the worker pool this many changes at a time,
+// then walked in order. Larger files, and files past the byte budget of a
+// window, are read by the walk itself.
+#define PREPARE_WINDOW 256
+#define PREPARE_MAX_SIZE (uint64_t(16) << 20)
+#define PREPARE_MAX_BYTES (uint64_t(256) << 20)
+
+struct OutgoingMessage
 {
-	uint64_t frame_sent;
+	FileAction action;
+	Priority priority;
 	std::string path;
-	char sha1[21];
+	uint8_t digest[MAX_DIGEST_SIZE];
+	uint32_t digest_size;
+	std::vector<uint8_t> data;
+	uint64_t queued_time;
 };
 
-struct CommunicationState
+// Messages are immutable once queued and shared by all targets, so a file
+// is held in memory once however many servers it goes to.
+typedef std::shared_ptr<const OutgoingMessage> SharedMessage;
+
+struct Target
 {
-	SOCKET socket;
-	std::vector<HashedFile> files;
-	uint64_t frame = 0;
+	Target()
+		: messages(MESSAGE_QUEUE_SIZE)
+	{}
+
+	std::string server;
+	SOCKET socket = INVALID_SOCKET;
+	Pacer pacer;
+	MpscQueue<SharedMessage> messages;
+	std::atomic<uint64_t> queued_bytes{ 0 };
+	std::thread thread;
+	// Set when the server agreed to acknowledge what it has flushed.
+	bool acknowledged = false;
+	std::atomic<uint64_t> sent{ 0 };
+	std::atomic<uint64_t> durable{ 0 };
+	std::thread acknowledgement_thread;
+	// Set when messages go through shared memory to a server on this host.
+	bool shared = false;
+	SharedRing ring;
 };
 
-enum class FileAction
+struct Pipeline
 {
-	Added = 1,
-	Removed = 2,
-	Modified = 3,
-	RenamedOldName = 4,
-	RenamedNewName = 5
+	Pipeline()
+		: batches(BATCH_QUEUE_SIZE)
+		, free_batches(BATCH_POOL_SIZE)
+	{}
+
+	SpscQueue<ChangeBatch *> batches;
+	SpscQueue<ChangeBatch *> free_batches;
+	std::vector<std::unique_ptr<Target>> targets;
+	std::atomic<size_t> live_targets{ 0 };
+	HANDLE completion_port = NULL;
+	std::vector<WatchRoot> roots;
+	PathFilter filter;
+	HashAlgorithm hash = HashAlgorithm::None;
+	bool usn_journal = false;
+	DirectReadOptions direct_read;
 };
 
-struct FileChange
+// Completion key used to wake the watcher when the pipeline fails.
+#define STOP_KEY ULONG_PTR(-1)
+
+struct WatchedDirectory
 {
-	FileAction action;
+	HANDLE handle;
+	OVERLAPPED ol;
+	std::vector<uint8_t> notify_info;
+};
+
+// A file of the current window, read and hashed on the worker pool before
+// the window is walked.
+struct Prehashed
+{
+	size_t change;
+	DWORD attr;
+	uint64_t size;
+	bool ready;
+	std::vector<uint8_t> data;
+	uint8_t digest[MAX_DIGEST_SIZE];
+	std::unique_ptr<HashResume> resume;
+};
+
+// What each thread of the pool works with.
+struct WorkerScratch
+{
+	std::string full_path;
+	std::wstring wide_path;
+	// Never enabled; large files are left to the walk.
+	DirectReader direct_reader;
+};
+
+struct HashState
+{
+	FileIndex files;
+	uint64_t frame = 0;
+
+	WorkerPool workers;
+	std::vector<WorkerScratch> scratch;
+	std::vector<Prehashed> prehashed;
+	std::unordered_map<uint64_t, size_t> prehashed_index;
+	std::vector<size_t> small_files;
+	std::vector<size_t> large_files;
+	std::vector<const uint8_t *> batch_data;
+	std::vector<size_t> batch_sizes;
+	std::vector<uint8_t> batch_digests;
+
+	DirectReader direct_reader;
+	std::string full_path;
+	std::wstring wide_path;
 	std::string name;
+	std::string new_name;
 };
 
 struct FileCloser
@@ -58,9 +183,24 @@ struct FileCloser
 	HANDLE handle;
 };
 
-static bool read_file(std::string file, std::vector<uint8_t> &data)
+static bool read_file(const std::string &file, std::wstring &wide_file, DirectReader &direct_reader, std::vector<uint8_t> &data)
 {
-	HANDLE file_handle = CreateFileW(s2ws(file).c_str(),
+	StatsTimer timer(Stage::Read);
+	TraceScope trace("read_file");
+	trace.set_detail(file);
+	const wchar_t *wide = s2ws(file.data(), file.size(), wide_file);
+	if (direct_reader.options.enabled)
+	{
+		WIN32_FILE_ATTRIBUTE_DATA info;
+		if (GetFileAttributesExW(wide, GetFileExInfoStandard, &info)
+			&& use_direct_read(direct_reader, (uint64_t(info.nFileSizeHigh) << 32) | info.nFileSizeLow))
+		{
+			bool read = direct_read(direct_reader, file, wide, data);
+			trace.bytes = data.size();
+			return read;
+		}
+	}
+	HANDLE file_handle = CreateFileW(wide,
 		GENERIC_READ,
 		NULL,
 		NULL,
@@ -97,12 +237,166 @@ static bool read_file(std::string file, std::vector<uint8_t> &data)
 		large_file_read += bytes_read;
 	}
 	data.resize(large_file_read);
+	trace.bytes = uint64_t(large_file_read);
+	return true;
+}
+
+static bool read_range(HANDLE file_handle, const std::string &file, uint64_t offset, uint8_t *data, uint64_t size)
+{
+	uint64_t total_read = 0;
+	while (total_read < size)
+	{
+		OVERLAPPED ol = {};
+		ol.Offset = DWORD(offset + total_read);
+		ol.OffsetHigh = DWORD((offset + total_read) >> 32);
+		DWORD read_size = DWORD(std::min(uint64_t(1) << 30, size - total_read));
+		DWORD bytes_read;
+		if (!ReadFile(file_handle, data + total_read, read_size, &bytes_read, &ol))
+		{
+			fprintf(stderr, "Failed to read file: %s %s.\n", file.c_str(), error_to_string(GetLastError()).c_str());
+			return false;
+		}
+		if (!bytes_read)
+			return false;
+		total_read += bytes_read;
+	}
+	return true;
+}
+
+// Reads the data extents of a sparse file into a sparse payload. Returns
+// false, leaving the file to be read whole, if it has no holes worth
+// skipping or too many extents.
+static bool read_sparse_file(const std::string &file, std::wstring &wide_file, std::vector<uint8_t> &data)
+{
+	StatsTimer timer(Stage::Read);
+	TraceScope trace("read_sparse_file");
+	trace.set_detail(file);
+	HANDLE file_handle = CreateFileW(s2ws(file.data(), file.size(), wide_file),
+		GENERIC_READ,
+		NULL,
+		NULL,
+		OPEN_EXISTING,
+		NULL,
+		NULL);
+	if (file_handle == INVALID_HANDLE_VALUE)
+		return false;
+	FileCloser closer(file_handle);
+	LARGE_INTEGER f_size;
+	if (!GetFileSizeEx(file_handle, &f_size))
+		return false;
+	uint64_t file_size = uint64_t(f_size.QuadPart);
+
+	std::vector<FILE_ALLOCATED_RANGE_BUFFER> extents;
+	FILE_ALLOCATED_RANGE_BUFFER query;
+	query.FileOffset.QuadPart = 0;
+	query.Length.QuadPart = LONGLONG(file_size);
+	FILE_ALLOCATED_RANGE_BUFFER ranges[512];
+	while (true)
+	{
+		DWORD bytes_returned = 0;
+		BOOL done = DeviceIoControl(file_handle, FSCTL_QUERY_ALLOCATED_RANGES, &query, sizeof(query), ranges, sizeof(ranges), &bytes_returned, NULL);
+		if (!done && GetLastError() != ERROR_MORE_DATA)
+		{
+			fprintf(stderr, "Failed to query allocated ranges of %s: %s\n", file.c_str(), error_to_string(GetLastError()).c_str());
+			return false;
+		}
+		size_t count = bytes_returned / sizeof(ranges[0]);
+		extents.insert(extents.end(), ranges, ranges + count);
+		if (done || !count || extents.size() > MAX_SPARSE_EXTENTS)
+			break;
+		const FILE_ALLOCATED_RANGE_BUFFER &last = ranges[count - 1];
+		LONGLONG next = last.FileOffset.QuadPart + last.Length.QuadPart;
+		query.Length.QuadPart -= next - query.FileOffset.QuadPart;
+		query.FileOffset.QuadPart = next;
+	}
+
+	uint64_t allocated = 0;
+	for (auto &extent : extents)
+		allocated += uint64_t(extent.Length.QuadPart);
+	if (extents.size() > MAX_SPARSE_EXTENTS || allocated >= file_size)
+		return false;
+
+	size_t header_size = sparse_payload_size(extents.size());
+	data.resize(header_size + size_t(allocated));
+	SparsePayload::FileSize::store(data.data(), file_size);
+	SparsePayload::ExtentCount::store(data.data(), uint32_t(extents.size()));
+	uint8_t *extent_entry = data.data() + SparsePayload::size;
+	uint8_t *extent_data = data.data() + header_size;
+	for (auto &extent : extents)
+	{
+		uint64_t offset = uint64_t(extent.FileOffset.QuadPart);
+		uint64_t length = uint64_t(extent.Length.QuadPart);
+		SparseExtent::Offset::store(extent_entry, offset);
+		SparseExtent::Length::store(extent_entry, length);
+		if (!read_range(file_handle, file, offset, extent_data, length))
+			return false;
+		extent_entry += SparseExtent::size;
+		extent_data += length;
+	}
+	trace.bytes = allocated;
 	return true;
 }
 
-static bool add_dir_handle_to_ol(const std::string &directory, HANDLE dir_handle, std::vector<uint8_t> &notify_buf, OVERLAPPED &ol)
+static void prefix_fingerprint(const uint8_t *head, size_t head_size, const uint8_t *tail, size_t tail_size, uint8_t (&fingerprint)[BLAKE3_OUT_LEN])
 {
-	if (!ReadDirectoryChangesW(dir_handle, notify_buf.data(), DWORD(notify_buf.size()), TRUE, FILE_NOTIFY_CHANGE_DIR_NAME | FILE_NOTIFY_CHANGE_FILE_NAME | FILE_NOTIFY_CHANGE_LAST_WRITE, NULL, &ol, NULL))
+	Blake3Hasher hasher;
+	blake3_init(hasher);
+	blake3_update(hasher, head, head_size);
+	blake3_update(hasher, tail, tail_size);
+	blake3_final(hasher, fingerprint);
+}
+
+// Reads what was added to the file since it was last sent, after room for
+// the append offset, and the fingerprint of the grown file. Returns false
+// if the file did not just grow; then it has to be sent whole. Growing
+// files are usually still open in a writer, so unlike read_file() this
+// shares the file.
+static bool read_appended(const std::string &file, std::wstring &wide_file, const HashResume &resume, std::vector<uint8_t> &data, uint8_t (&fingerprint)[BLAKE3_OUT_LEN])
+{
+	StatsTimer timer(Stage::Read);
+	TraceScope trace("read_appended");
+	trace.set_detail(file);
+	HANDLE file_handle = CreateFileW(s2ws(file.data(), file.size(), wide_file),
+		GENERIC_READ,
+		FILE_SHARE_READ | FILE_SHARE_WRITE,
+		NULL,
+		OPEN_EXISTING,
+		NULL,
+		NULL);
+	if (file_handle == INVALID_HANDLE_VALUE)
+		return false;
+	FileCloser closer(file_handle);
+	LARGE_INTEGER f_size;
+	if (!GetFileSizeEx(file_handle, &f_size))
+		return false;
+	uint64_t size = uint64_t(f_size.QuadPart);
+	if (size <= resume.size)
+		return false;
+
+	uint8_t head[APPEND_SAMPLE_SIZE];
+	uint8_t tail[APPEND_SAMPLE_SIZE];
+	size_t sample_size = size_t(std::min(uint64_t(APPEND_SAMPLE_SIZE), resume.size));
+	if (!read_range(file_handle, file, 0, head, sample_size)
+		|| !read_range(file_handle, file, resume.size - sample_size, tail, sample_size))
+		return false;
+	prefix_fingerprint(head, sample_size, tail, sample_size, fingerprint);
+	if (memcmp(fingerprint, resume.fingerprint, sizeof(fingerprint)))
+		return false;
+
+	uint64_t appended = size - resume.size;
+	data.resize(AppendPayload::size + size_t(appended));
+	AppendPayload::Offset::store(data.data(), resume.size);
+	if (!read_range(file_handle, file, resume.size, data.data() + AppendPayload::size, appended)
+		|| !read_range(file_handle, file, size - sample_size, tail, sample_size))
+		return false;
+	prefix_fingerprint(head, sample_size, tail, sample_size, fingerprint);
+	trace.bytes = appended;
+	return true;
+}
+
+static bool add_dir_handle_to_ol(const std::string &directory, WatchedDirectory &watched)
+{
+	if (!ReadDirectoryChangesW(watched.handle, watched.notify_info.data(), DWORD(watched.notify_info.size()), TRUE, FILE_NOTIFY_CHANGE_DIR_NAME | FILE_NOTIFY_CHANGE_FILE_NAME | FILE_NOTIFY_CHANGE_LAST_WRITE, NULL, &watched.ol, NULL))
 	{
 		DWORD error = GetLastError();
 		if (error != ERROR_IO_PENDING)
@@ -124,257 +418,898 @@ static bool file_exist(DWORD attr)
 	return attr != INVALID_FILE_ATTRIBUTES;
 }
 
-static HashedFile *get_hased_file(CommunicationState &state, const std::string &name)
-{
-	auto it = std::find_if(state.files.begin(), state.files.end(), [&name](const HashedFile &a) { return a.path == name; });
-	if (it == state.files.end())
-		return nullptr;
-	return &(*it);
-}
-
-static void drop_hashed_file(CommunicationState &state, const std::string &name)
-{
-	auto it = std::find_if(state.files.begin(), state.files.end(), [&name](const HashedFile &a) { return a.path == name; });
-	if (it != state.files.end())
-		state.files.erase(it);
-}
-
-static bool send_data(CommunicationState &state, const void *data, int size)
+static bool send_data(SOCKET socket, Pacer &pacer, Priority priority, const void *data, int size)
 {
+	bool paced = pacer.buckets[int(priority)].rate;
 	int total_bytes_sent = 0;
 	
 	while (total_bytes_sent < size)
 	{
-		int bytes_sent = send(state.socket, (const char *)data + total_bytes_sent, size - total_bytes_sent, 0);
+		int send_size = size - total_bytes_sent;
+		if (paced)
+			send_size = std::min(send_size, PACING_CHUNK);
+		int bytes_sent = send(socket, (const char *)data + total_bytes_sent, send_size, 0);
 		if (bytes_sent == SOCKET_ERROR)
 		{
 			fprintf(stderr, "Failed to send %d\n", WSAGetLastError());
 			return false;
 		}
 		total_bytes_sent += bytes_sent;
+		if (paced)
+			pace(pacer, priority, uint64_t(bytes_sent));
 	}
 	return true;
 }
 
 
-static bool send_action(CommunicationState &state, HashedFile *file, FileAction action, const void *data, size_t data_size)
+// Lets the kernel smooth out each chunk as well, where it supports it.
+static void set_socket_pacing(SOCKET socket, uint64_t bytes_per_second)
 {
-	uint8_t header_buffer[4096];
-	Serializer s(header_buffer, sizeof(header_buffer));
+#ifdef SO_MAX_PACING_RATE
+	if (!bytes_per_second)
+		return;
+	uint64_t rate = bytes_per_second;
+	if (setsockopt(socket, SOL_SOCKET, SO_MAX_PACING_RATE, (const char *)&rate, sizeof(rate)) == SOCKET_ERROR)
+		fprintf(stderr, "Failed to set socket pacing rate: %d\n", WSAGetLastError());
+#else
+	(void)socket;
+	(void)bytes_per_second;
+#endif
+}
 
-	char magic[] = { 'P', 'I', 'D', '0' };
-	uint32_t header_size = uint32_t(4 + 8 + 4 + 4 + 20 + 4 + file->path.size());
-	uint64_t message_size = header_size + data_size;
-	s.add_data(magic, 4);
-	s.add_typed_data(message_size);
-	s.add_typed_data(header_size);
-	s.add_typed_data(action);
-	s.add_data(file->sha1, 20);
-	s.add_typed_data(uint32_t(file->path.size()));
-	if (!s.add_data(file->path.data(), file->path.size()))
+// Same-host targets take the shared ring instead of the socket.
+static bool send_to_target(Target &target, Priority priority, const void *data, size_t size)
+{
+	if (!target.shared)
+		return send_data(target.socket, target.pacer, priority, data, int(size));
+	bool paced = target.pacer.buckets[int(priority)].rate;
+	const uint8_t *bytes = static_cast<const uint8_t *>(data);
+	while (size)
+	{
+		size_t write_size = paced ? std::min(size, size_t(PACING_CHUNK)) : size;
+		if (!shared_ring_write(target.ring, bytes, write_size))
+		{
+			fprintf(stderr, "%s left the shared ring\n", target.server.c_str());
+			return false;
+		}
+		if (paced)
+			pace(target.pacer, priority, write_size);
+		bytes += write_size;
+		size -= write_size;
+	}
+	return true;
+}
+
+static bool send_action(Target &target, const OutgoingMessage &message)
+{
+	StatsTimer timer(Stage::Send);
+	TraceScope trace("send_action");
+	trace.set_detail(message.path);
+	trace.bytes = message.data.size();
+	uint8_t header_buffer[MessageHeader::size + MAX_PATH_SIZE];
+	size_t header_size = encode_header(header_buffer, sizeof(header_buffer), message.action, message.digest, message.digest_size, message.path, message.data.size());
+	if (!header_size)
 		return false;
 
-	if (!send_data(state, s.buffer, int(s.offset)))
+	if (!send_to_target(target, message.priority, header_buffer, header_size))
 		return false;
 
-	if (!send_data(state, data, int(data_size)))
+	if (!send_to_target(target, message.priority, message.data.data(), message.data.size()))
 		return false;
+	stats_add(Counter::BytesSent, header_size + message.data.size());
+	stats_add(Counter::FilesSent, 1);
 	return true;
 }
 
-static bool process_changed_paths(const std::string parent_dir, std::vector<FileChange> &changes, CommunicationState &state)
+static void fail_pipeline(Pipeline &pipeline)
+{
+	pipeline.batches.close();
+	for (auto &target : pipeline.targets)
+		target->messages.close();
+	PostQueuedCompletionStatus(pipeline.completion_port, 0, STOP_KEY, NULL);
+}
+
+// Waits while a target is behind, both on the number of queued messages and
+// on the file data they hold. Targets only hold each other up once one of
+// them has used up its whole window. Returns false if no target is left.
+static bool queue_message(Pipeline &pipeline, FileAction action, const HashedFile &file, std::vector<uint8_t> &&data)
+{
+	std::shared_ptr<OutgoingMessage> message(new OutgoingMessage());
+	message->action = action;
+	message->path = file.path;
+	memcpy(message->digest, file.digest, sizeof(message->digest));
+	message->digest_size = hash_digest_size(pipeline.hash);
+	message->data = std::move(data);
+	uint64_t size = message->data.size();
+	message->priority = size >= BULK_THRESHOLD ? Priority::Bulk : Priority::Interactive;
+	message->queued_time = stats_now();
+
+	uint64_t start = stats_now();
+	bool queued = false;
+	for (auto &target_pointer : pipeline.targets)
+	{
+		Target &target = *target_pointer;
+		auto has_room = [&target, size] {
+			uint64_t queued = target.queued_bytes.load();
+			return !queued || queued + size <= MAX_QUEUED_BYTES || target.messages.closed.load();
+		};
+		while (!has_room())
+			target.messages.not_full.wait(has_room);
+		if (target.messages.closed.load())
+			continue;
+		target.queued_bytes.fetch_add(size);
+		SharedMessage shared = message;
+		if (!push_wait(target.messages, shared))
+			continue;
+		queued = true;
+	}
+	stats_record(Stage::Backpressure, stats_now() - start);
+	return queued;
+}
+
+// BLAKE3 hashes large files on this many threads, 0 for every core; SHA-1
+// is sequential.
+static void hash_data(HashAlgorithm algorithm, const std::vector<uint8_t> &data, uint8_t (&digest)[MAX_DIGEST_SIZE], unsigned threads)
+{
+	if (algorithm == HashAlgorithm::Blake3)
+	{
+		blake3_hash(data.data(), data.size(), digest, threads);
+		return;
+	}
+	// SHA1() writes a terminating zero after the 20 byte digest.
+	char sha1[21];
+	SHA1(sha1, reinterpret_cast<const char *>(data.data()), int(data.size()));
+	memcpy(digest, sha1, 20);
+}
+
+static void sha1_update(SHA1_CTX &context, const uint8_t *data, size_t size)
+{
+	while (size)
+	{
+		uint32_t update_size = uint32_t(std::min(size, size_t(1) << 30));
+		SHA1Update(&context, data, update_size);
+		data += update_size;
+		size -= update_size;
+	}
+}
+
+static void finish_hash(HashAlgorithm algorithm, const HashResume &resume, uint8_t (&digest)[MAX_DIGEST_SIZE])
+{
+	if (algorithm == HashAlgorithm::Blake3)
+	{
+		blake3_final(resume.blake3, digest);
+		return;
+	}
+	SHA1_CTX context = resume.sha1;
+	SHA1Final(digest, &context);
+}
+
+// Hashes the whole file, keeping the hash state for large files.
+static void hash_file(HashAlgorithm algorithm, HashedFile &file, const std::vector<uint8_t> &data, unsigned threads)
+{
+	if (data.size() < APPEND_MIN_SIZE)
+	{
+		file.resume.reset();
+		hash_data(algorithm, data, file.digest, threads);
+		return;
+	}
+	if (!file.resume)
+		file.resume.reset(new HashResume());
+	HashResume &resume = *file.resume;
+	if (algorithm == HashAlgorithm::Blake3)
+	{
+		blake3_init(resume.blake3);
+		blake3_update_parallel(resume.blake3, data.data(), data.size(), threads);
+	}
+	else
+	{
+		SHA1Init(&resume.sha1);
+		sha1_update(resume.sha1, data.data(), data.size());
+	}
+	resume.size = data.size();
+	prefix_fingerprint(data.data(), APPEND_SAMPLE_SIZE, data.data() + data.size() - APPEND_SAMPLE_SIZE, APPEND_SAMPLE_SIZE, resume.fingerprint);
+	finish_hash(algorithm, resume, file.digest);
+}
+
+// Continues the hash of a file that grew with the bytes that were added.
+static void resume_hash(HashAlgorithm algorithm, HashedFile &file, const uint8_t *data, size_t size, const uint8_t (&fingerprint)[BLAKE3_OUT_LEN])
+{
+	HashResume &resume = *file.resume;
+	if (algorithm == HashAlgorithm::Blake3)
+		blake3_update(resume.blake3, data, size);
+	else
+		sha1_update(resume.sha1, data, size);
+	resume.size += size;
+	memcpy(resume.fingerprint, fingerprint, sizeof(resume.fingerprint));
+	finish_hash(algorithm, resume, file.digest);
+}
+
+// Interned names share their offset, so this identifies a path in a batch.
+static uint64_t change_key(const FileChange &change)
+{
+	return (uint64_t(change.root) << 32) | change.name_offset;
+}
+
+static void full_path_of(const WatchRoot &root, std::string_view relative, std::string &full_path)
 {
+	full_path.assign(root.directory);
+	full_path.append("\\");
+	full_path.append(relative.data(), relative.size());
+}
+
+// Hashes the small files together with hash_batch.h, a slice per worker.
+static void hash_small_files(HashAlgorithm algorithm, HashState &state, size_t begin, size_t end)
+{
+	size_t count = end - begin;
+	// A few files are not worth filling the other lanes with padding.
+	unsigned lanes = count < 4 ? 1 : 0;
+	size_t digest_size = algorithm == HashAlgorithm::Blake3 ? BLAKE3_OUT_LEN : SHA1_DIGEST_LEN;
+	if (algorithm == HashAlgorithm::Blake3)
+		blake3_hash_many(state.batch_data.data() + begin, state.batch_sizes.data() + begin, count,
+			reinterpret_cast<uint8_t (*)[BLAKE3_OUT_LEN]>(state.batch_digests.data() + begin * digest_size), lanes);
+	else
+		sha1_hash_many(state.batch_data.data() + begin, state.batch_sizes.data() + begin, count,
+			reinterpret_cast<uint8_t (*)[SHA1_DIGEST_LEN]>(state.batch_digests.data() + begin * digest_size), lanes);
+	for (size_t i = begin; i < end; i++)
+		memcpy(state.prehashed[state.small_files[i]].digest, state.batch_digests.data() + i * digest_size, digest_size);
+}
+
+// Reads and hashes the files added or modified in changes [begin, end) on
+// the worker pool, ahead of the walk that sends them in batch order. Files
+// that may only have grown are left to the walk, which sends just the new
+// bytes, as are sparse files, directories and files past the size limits.
+static void prepare_changes(Pipeline &pipeline, ChangeBatch &batch, HashState &state, size_t begin, size_t end)
+{
+	state.prehashed.clear();
+	state.prehashed_index.clear();
+	for (size_t i = begin; i < end; i++)
+	{
+		const FileChange &change = batch.changes[i];
+		if ((change.action != ChangeAction::Added && change.action != ChangeAction::Modified)
+			|| state.prehashed_index.count(change_key(change)))
+			continue;
+		std::string_view relative = batch.name(change);
+		state.name.assign(pipeline.roots[change.root].prefix);
+		state.name.append(relative.data(), relative.size());
+		HashedFile *hashed_file = get_hashed_file(state.files, state.name);
+		if (hashed_file && (hashed_file->frame_sent == state.frame || (hashed_file->resume && change.action == ChangeAction::Modified)))
+			continue;
+		state.prehashed_index[change_key(change)] = state.prehashed.size();
+		state.prehashed.emplace_back();
+		state.prehashed.back().change = i;
+	}
+	if (state.prehashed.empty())
+		return;
+
+	TraceScope trace("prepare_changes");
+	run_parallel(state.workers, state.prehashed.size(), [&](size_t index, unsigned worker) {
+		Prehashed &prehashed = state.prehashed[index];
+		WorkerScratch &scratch = state.scratch[worker];
+		const FileChange &change = batch.changes[prehashed.change];
+		full_path_of(pipeline.roots[change.root], batch.name(change), scratch.full_path);
+		WIN32_FILE_ATTRIBUTE_DATA info;
+		prehashed.ready = false;
+		if (!GetFileAttributesExW(s2ws(scratch.full_path.data(), scratch.full_path.size(), scratch.wide_path), GetFileExInfoStandard, &info))
+			return;
+		prehashed.attr = info.dwFileAttributes;
+		prehashed.size = (uint64_t(info.nFileSizeHigh) << 32) | info.nFileSizeLow;
+		prehashed.ready = !path_is_dir(prehashed.attr) && !(prehashed.attr & FILE_ATTRIBUTE_SPARSE_FILE);
+	});
+
+	// Taken in batch order until the window's data would not fit.
+	uint64_t budget = PREPARE_MAX_BYTES;
+	state.small_files.clear();
+	state.large_files.clear();
+	for (size_t i = 0; i < state.prehashed.size(); i++)
+	{
+		Prehashed &prehashed = state.prehashed[i];
+		if (!prehashed.ready)
+			continue;
+		// Files to be read unbuffered stay with the walk too.
+		if (prehashed.size > PREPARE_MAX_SIZE || prehashed.size > budget || use_direct_read(state.direct_reader, prehashed.size))
+		{
+			prehashed.ready = false;
+			continue;
+		}
+		budget -= prehashed.size;
+		if (prehashed.size <= BATCH_HASH_MAX_SIZE)
+			state.small_files.push_back(i);
+		else
+			state.large_files.push_back(i);
+	}
+
+	run_parallel(state.workers, state.small_files.size() + state.large_files.size(), [&](size_t index, unsigned worker) {
+		size_t slot = index < state.small_files.size() ? state.small_files[index] : state.large_files[index - state.small_files.size()];
+		Prehashed &prehashed = state.prehashed[slot];
+		WorkerScratch &scratch = state.scratch[worker];
+		const FileChange &change = batch.changes[prehashed.change];
+		full_path_of(pipeline.roots[change.root], batch.name(change), scratch.full_path);
+		prehashed.ready = read_file(scratch.full_path, scratch.wide_path, scratch.direct_reader, prehashed.data);
+	});
+
+	// A file that failed to read drops out of the hash.
+	auto unread = [&](size_t slot) { return !state.prehashed[slot].ready; };
+	state.small_files.erase(std::remove_if(state.small_files.begin(), state.small_files.end(), unread), state.small_files.end());
+	state.large_files.erase(std::remove_if(state.large_files.begin(), state.large_files.end(), unread), state.large_files.end());
+
+	StatsTimer timer(Stage::Hash);
+	state.batch_data.clear();
+	state.batch_sizes.clear();
+	for (size_t slot : state.small_files)
+	{
+		state.batch_data.push_back(state.prehashed[slot].data.data());
+		state.batch_sizes.push_back(state.prehashed[slot].data.size());
+		trace.bytes += state.prehashed[slot].data.size();
+	}
+	state.batch_digests.resize(state.small_files.size() * MAX_DIGEST_SIZE);
+	// Slices of a few SIMD batches each, so the lanes stay full.
+	size_t slice = std::max(size_t(64), (state.small_files.size() + worker_pool_size(state.workers) - 1) / worker_pool_size(state.workers));
+	size_t slices = (state.small_files.size() + slice - 1) / slice;
+	run_parallel(state.workers, slices + state.large_files.size(), [&](size_t index, unsigned) {
+		if (index < slices)
+		{
+			hash_small_files(pipeline.hash, state, index * slice, std::min(state.small_files.size(), (index + 1) * slice));
+			return;
+		}
+		Prehashed &prehashed = state.prehashed[state.large_files[index - slices]];
+		TraceScope trace("hash");
+		trace.bytes = prehashed.data.size();
+		// Every worker is busy already.
+		HashedFile hashed = {};
+		hash_file(pipeline.hash, hashed, prehashed.data, 1);
+		memcpy(prehashed.digest, hashed.digest, sizeof(prehashed.digest));
+		prehashed.resume = std::move(hashed.resume);
+	});
+	for (size_t slot : state.large_files)
+		trace.bytes += state.prehashed[slot].data.size();
+}
+
+static Prehashed *find_prehashed(HashState &state, const FileChange &change)
+{
+	if (change.action != ChangeAction::Added && change.action != ChangeAction::Modified)
+		return nullptr;
+	auto found = state.prehashed_index.find(change_key(change));
+	if (found == state.prehashed_index.end() || !state.prehashed[found->second].ready)
+		return nullptr;
+	return &state.prehashed[found->second];
+}
+
+static bool process_changed_paths(Pipeline &pipeline, ChangeBatch &batch, HashState &state)
+{
+	stats_record(Stage::EventToBatch, stats_now() - batch.first_change_time);
+	TraceScope trace("process_changed_paths");
 	state.frame++;
+	auto &changes = batch.changes;
+	size_t prepared = 0;
 	for (int i = 0; i < changes.size(); i++)
 	{
+		// Everything before the window has been sent, so the index is up
+		// to date for it.
+		if (size_t(i) >= prepared)
+		{
+			prepared = std::min(changes.size(), size_t(i) + PREPARE_WINDOW);
+			prepare_changes(pipeline, batch, state, size_t(i), prepared);
+		}
 		auto &change = changes[i];
-		DWORD attr = GetFileAttributesW(s2ws(parent_dir + change.name).c_str());
+		const WatchRoot &root = pipeline.roots[change.root];
+		std::string_view relative = batch.name(change);
+		state.full_path.assign(root.directory);
+		state.full_path.append("\\");
+		state.full_path.append(relative.data(), relative.size());
+		state.name.assign(root.prefix);
+		state.name.append(relative.data(), relative.size());
+		std::string_view name = state.name;
+		Prehashed *prehashed = find_prehashed(state, change);
+		DWORD attr = prehashed ? prehashed->attr : GetFileAttributesW(s2ws(state.full_path.data(), state.full_path.size(), state.wide_path));
 		if (file_exist(attr) && path_is_dir(attr))
+		{
+			// A directory's own modifications are changes to its children,
+			// which are reported separately.
+			if (change.action != ChangeAction::Added)
+				continue;
+			HashedFile &directory = add_hashed_file(state.files, name);
+			directory.directory = true;
+			fprintf(stderr, "New directory %.*s\n", int(name.size()), name.data());
+			if (!queue_message(pipeline, FileAction::DirectoryAdded, directory, std::vector<uint8_t>()))
+				return false;
 			continue;
-		if (change.action == FileAction::Added
-			|| change.action == FileAction::Modified)
+		}
+		if (change.action == ChangeAction::Added
+			|| change.action == ChangeAction::Modified)
 		{
 			if (!file_exist(attr))	
 				continue;
-			auto hashed_file = get_hased_file(state, change.name);
+			auto hashed_file = get_hashed_file(state.files, name);
 			if (hashed_file && hashed_file->frame_sent == state.frame)
 				continue;
 			std::vector<uint8_t> file_data;
-			if (!read_file(parent_dir + change.name, file_data))
+			uint8_t fingerprint[BLAKE3_OUT_LEN];
+			if (!prehashed && hashed_file && hashed_file->resume && change.action == ChangeAction::Modified
+				&& read_appended(state.full_path, state.wide_path, *hashed_file->resume, file_data, fingerprint))
+			{
+				hashed_file->frame_sent = state.frame;
+				size_t appended = file_data.size() - AppendPayload::size;
+				{
+					StatsTimer timer(Stage::Hash);
+					TraceScope trace("hash");
+					trace.set_detail(hashed_file->path);
+					trace.bytes = appended;
+					resume_hash(pipeline.hash, *hashed_file, file_data.data() + AppendPayload::size, appended, fingerprint);
+				}
+				fprintf(stderr, "File grew. Sending %zu new bytes of %s\n", appended, hashed_file->path.c_str());
+				trace.bytes += appended;
+				if (!queue_message(pipeline, FileAction::Appended, *hashed_file, std::move(file_data)))
+					return false;
 				continue;
-			if (!hashed_file)
+			}
+			bool sparse = false;
+			if (prehashed)
+			{
+				// Taken, so a later change to the same name in this window
+				// reads the file again.
+				file_data.swap(prehashed->data);
+				prehashed->ready = false;
+			}
+			else
 			{
-				state.files.push_back({});
-				hashed_file = &state.files.back();
-				memset(hashed_file->sha1, 0, sizeof(hashed_file->sha1));
-				hashed_file->path = change.name;
+				sparse = (attr & FILE_ATTRIBUTE_SPARSE_FILE) && read_sparse_file(state.full_path, state.wide_path, file_data);
+				if (!sparse && !read_file(state.full_path, state.wide_path, state.direct_reader, file_data))
+					continue;
 			}
+			if (!hashed_file)
+				hashed_file = &add_hashed_file(state.files, name);
 			hashed_file->frame_sent = state.frame;
-			char old_hash[21];
-			memcpy(old_hash, hashed_file->sha1, sizeof(old_hash));
-			SHA1(hashed_file->sha1, reinterpret_cast<const char *>(file_data.data()), int(file_data.size()));
-			if (memcmp(hashed_file->sha1, old_hash, sizeof(old_hash)))
+			uint8_t old_digest[MAX_DIGEST_SIZE];
+			memcpy(old_digest, hashed_file->digest, sizeof(old_digest));
+			if (prehashed)
+			{
+				hashed_file->resume = std::move(prehashed->resume);
+				memcpy(hashed_file->digest, prehashed->digest, sizeof(hashed_file->digest));
+			}
+			else
+			{
+				StatsTimer timer(Stage::Hash);
+				TraceScope trace("hash");
+				trace.set_detail(hashed_file->path);
+				trace.bytes = file_data.size();
+				if (sparse)
+				{
+					hashed_file->resume.reset();
+					hash_data(pipeline.hash, file_data, hashed_file->digest, 0);
+				}
+				else
+				{
+					hash_file(pipeline.hash, *hashed_file, file_data, 0);
+				}
+			}
+			if (memcmp(hashed_file->digest, old_digest, sizeof(old_digest)))
 			{
 				fprintf(stderr, "New hash on file. Sending %s\n", hashed_file->path.c_str());
-				if (!send_action(state, hashed_file, change.action, file_data.data(), file_data.size()))
+				FileAction action = change.action == ChangeAction::Added ? FileAction::Added : FileAction::Modified;
+				if (sparse)
+					action = FileAction::Sparse;
+				trace.bytes += file_data.size();
+				if (!queue_message(pipeline, action, *hashed_file, std::move(file_data)))
 					return false;
 			}
 		}
-		else if (change.action == FileAction::Removed)
+		else if (change.action == ChangeAction::Removed)
 		{
 			if (file_exist(attr))
 				continue;
-			HashedFile *hashed_file = get_hased_file(state, change.name);
+			// The path is gone, so only the index can tell whether it was a
+			// directory. Removing one removes the whole tree on the server.
+			HashedFile *hashed_file = get_hashed_file(state.files, name);
+			bool directory = (hashed_file && hashed_file->directory) || has_entries_below(state.files, name);
+			if (directory)
+			{
+				fprintf(stderr, "Found deletion of directory: %.*s\n", int(name.size()), name.data());
+				HashedFile removed = {};
+				removed.path.assign(name.data(), name.size());
+				if (!queue_message(pipeline, FileAction::DirectoryRemoved, removed, std::vector<uint8_t>()))
+					return false;
+				drop_hashed_directory(state.files, name);
+				continue;
+			}
 			if (!hashed_file)
 				continue;
-			fprintf(stderr, "Found deletion of hashed file: %s\n", change.name.c_str());
-			if (!send_action(state, hashed_file, change.action, nullptr, 0))
+			fprintf(stderr, "Found deletion of hashed file: %.*s\n", int(name.size()), name.data());
+			if (!queue_message(pipeline, FileAction::Removed, *hashed_file, std::vector<uint8_t>()))
 				return false;
-			drop_hashed_file(state, change.name);
+			drop_hashed_file(state.files, name);
 		}
-		else if (change.action == FileAction::RenamedOldName)
+		else if (change.action == ChangeAction::RenamedOldName)
 		{
-			HashedFile *hashed_file = get_hased_file(state, change.name);
-			if (!hashed_file)
+			if (i + 1 >= changes.size())
+				continue;
+			std::string_view new_relative = batch.name(changes[i + 1]);
+			state.new_name.assign(root.prefix);
+			state.new_name.append(new_relative.data(), new_relative.size());
+			std::string_view new_name = state.new_name;
+			i++;
+
+			// A directory is renamed as one operation whether or not we have
+			// seen anything below it; the server moves the whole tree.
+			state.full_path.assign(root.directory);
+			state.full_path.append("\\");
+			state.full_path.append(new_relative.data(), new_relative.size());
+			DWORD new_attr = GetFileAttributesW(s2ws(state.full_path.data(), state.full_path.size(), state.wide_path));
+			HashedFile *hashed_file = get_hashed_file(state.files, name);
+			if (file_exist(new_attr) && path_is_dir(new_attr))
 			{
-				i++;
+				fprintf(stderr, "Moved directory from %.*s to %.*s\n", int(name.size()), name.data(), int(new_name.size()), new_name.data());
+				HashedFile moved = {};
+				moved.path.assign(name.data(), name.size());
+				if (!queue_message(pipeline, FileAction::DirectoryRenamed, moved, std::vector<uint8_t>(new_name.begin(), new_name.end())))
+					return false;
+				rename_hashed_path(state.files, name, new_name);
+				HashedFile &directory = add_hashed_file(state.files, new_name);
+				directory.directory = true;
 				continue;
 			}
+			if (!hashed_file)
+				continue;
 
-			fprintf(stderr, "Moved from %s to %s\n", change.name.c_str(), changes[i + 1].name.c_str());
-			const std::string &new_name = changes[i + 1].name;
-			if (!send_action(state, hashed_file, change.action, new_name.data(), new_name.size()))
+			fprintf(stderr, "Moved from %.*s to %.*s\n", int(name.size()), name.data(), int(new_name.size()), new_name.data());
+			if (!queue_message(pipeline, FileAction::Renamed, *hashed_file, std::vector<uint8_t>(new_name.begin(), new_name.end())))
 				return false;
-			hashed_file->path = new_name;
-			i++;
+			rename_hashed_path(state.files, name, new_name);
 		}
 	}
 
 	return true;
 }
 
-static bool watch_directory(const std::string &directory, CommunicationState &state)
+// Excluded paths are dropped here, before they cost a lookup, a read or a
+// hash further down the pipeline.
+static void add_change(ChangeBatch &batch, const PathFilter &filter, uint32_t root, ChangeAction action, const FILE_NOTIFY_INFORMATION *info)
 {
-	const int seconds_fs_timeout = 1;
-	HANDLE dir_handle = CreateFile(
-		s2ws(directory).c_str(),
-		FILE_LIST_DIRECTORY,
-		FILE_SHARE_WRITE | FILE_SHARE_READ | FILE_SHARE_DELETE,
-		NULL,
-		OPEN_EXISTING,
-		FILE_FLAG_BACKUP_SEMANTICS|FILE_FLAG_OVERLAPPED,
-		NULL);
+	int chars = int(info->FileNameLength / sizeof(wchar_t));
+	char *name = batch.reserve_name(size_t(chars) * 3);
+	int size = WideCharToMultiByte(CP_UTF8, 0, info->FileName, chars, name, chars * 3, NULL, NULL);
+	if (path_excluded(filter, std::string_view(name, size_t(size))))
+	{
+		stats_add(Counter::ChangesFiltered, 1);
+		return;
+	}
+	batch.commit_name(root, action, size_t(size));
+}
 
-	std::string dir_slash = directory + "\\";
-	std::vector<uint8_t> notify_info;
-	notify_info.resize(4096);
+static bool change_excluded(const PathFilter &filter, const FILE_NOTIFY_INFORMATION *info, std::string &name)
+{
+	int chars = int(info->FileNameLength / sizeof(wchar_t));
+	name.resize(size_t(chars) * 3);
+	int size = WideCharToMultiByte(CP_UTF8, 0, info->FileName, chars, &name[0], chars * 3, NULL, NULL);
+	return path_excluded(filter, std::string_view(name.data(), size_t(size)));
+}
 
-	OVERLAPPED ol;
-	memset(&ol, 0, sizeof(ol));
-	ol.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
-	if (!ol.hEvent)
+static void hasher_thread(Pipeline &pipeline)
+{
+	HashState state;
+	state.direct_reader.options = pipeline.direct_read;
+	if (state.direct_reader.options.enabled)
+		direct_reader_start(state.direct_reader);
+	worker_pool_start(state.workers, 0);
+	state.scratch.resize(worker_pool_size(state.workers));
+	ChangeBatch *batch;
+	while (pop_wait(pipeline.batches, batch))
 	{
-		fprintf(stderr, "Failed to create OVERLAPPED event %s\n", error_to_string(GetLastError()).c_str());
-		return false;
+		bool success = process_changed_paths(pipeline, *batch, state);
+		batch->reset();
+		bool returned = pipeline.free_batches.try_push(batch);
+		assert(returned);
+		if (!success)
+		{
+			fail_pipeline(pipeline);
+			break;
+		}
 	}
+	worker_pool_stop(state.workers);
+	direct_reader_stop(state.direct_reader);
+}
 
-	if (!add_dir_handle_to_ol(directory, dir_handle, notify_info, ol))
-		return false;
+// A target that fails is dropped; the others keep going.
+static void sender_thread(Pipeline &pipeline, Target &target)
+{
+	SharedMessage message;
+	while (pop_wait(target.messages, message))
+	{
+		stats_record(Stage::QueueWait, stats_now() - message->queued_time);
+		bool success = send_action(target, *message);
+		if (success)
+			target.sent++;
+		target.queued_bytes.fetch_sub(message->data.size());
+		target.messages.not_full.notify();
+		message.reset();
+		if (!success)
+		{
+			fprintf(stderr, "Lost connection to %s\n", target.server.c_str());
+			target.messages.close();
+			while (target.messages.try_pop(message))
+				message.reset();
+			if (pipeline.live_targets.fetch_sub(1) == 1)
+				fail_pipeline(pipeline);
+			return;
+		}
+	}
+}
 
-	std::vector<FileChange> files_changed;
-	auto time_at_empty = std::chrono::system_clock::now();
+// Each acknowledgement carries the number of messages the server has
+// flushed to disk so far. Runs until the server closes the connection.
+static void acknowledgement_thread(Target &target)
+{
+	uint8_t buffer[Acknowledgement::size];
+	int received = 0;
 	while (true)
 	{
-		DWORD wait_for;
-		if (files_changed.empty())
+		int bytes_received = recv(target.socket, (char *)buffer + received, int(sizeof(buffer)) - received, 0);
+		if (bytes_received <= 0)
+			return;
+		received += bytes_received;
+		if (received < int(sizeof(buffer)))
+			continue;
+		received = 0;
+		uint64_t count;
+		if (!decode_acknowledgement(buffer, count))
+		{
+			fprintf(stderr, "Invalid acknowledgement from %s\n", target.server.c_str());
+			return;
+		}
+		uint64_t previous = target.durable.exchange(count);
+		if (count > previous)
+			stats_add(Counter::MessagesAcknowledged, count - previous);
+	}
+}
+
+// Never blocks. While the hasher is still busy with earlier batches the
+// watcher keeps collecting into the current one, which also coalesces
+// repeated changes to the same file.
+static bool hand_off_batch(Pipeline &pipeline, ChangeBatch *&batch, bool &deferred)
+{
+	if (!pipeline.batches.try_push(batch))
+	{
+		if (!deferred)
 		{
-			wait_for = INFINITE;
+			fprintf(stderr, "Hashing is behind, holding %zu changes in the watcher\n", batch->changes.size());
+			stats_add(Counter::BatchesDeferred, 1);
+		}
+		deferred = true;
+		return false;
+	}
+	if (deferred)
+		fprintf(stderr, "Hashing caught up\n");
+	deferred = false;
+	// The pool holds one batch more than can be queued or processed.
+	bool got_batch = pipeline.free_batches.try_pop(batch);
+	assert(got_batch);
+	return true;
+}
+
+static void add_changes(ChangeBatch &batch, const PathFilter &filter, uint32_t root, const uint8_t *notify_info, DWORD bytes_read)
+{
+	std::string name;
+	uint32_t offset = 0;
+	while (offset < bytes_read)
+	{
+		const FILE_NOTIFY_INFORMATION *current = reinterpret_cast<const FILE_NOTIFY_INFORMATION *>(notify_info + offset);
+		ChangeAction action = ChangeAction(current->Action);
+		if (action == ChangeAction::RenamedOldName)
+		{
+			const FILE_NOTIFY_INFORMATION *next = nullptr;
+			if (current->NextEntryOffset)
+				next = reinterpret_cast<const FILE_NOTIFY_INFORMATION *>(notify_info + offset + current->NextEntryOffset);
+			if (next && ChangeAction(next->Action) == ChangeAction::RenamedNewName)
+			{
+				// Renaming into or out of an excluded path is a create or
+				// a delete as far as the server can tell.
+				bool from_excluded = change_excluded(filter, current, name);
+				bool to_excluded = change_excluded(filter, next, name);
+				if (!from_excluded && !to_excluded)
+				{
+					add_change(batch, filter, root, ChangeAction(current->Action), current);
+					add_change(batch, filter, root, ChangeAction(next->Action), next);
+				}
+				else if (!from_excluded)
+				{
+					add_change(batch, filter, root, ChangeAction::Removed, current);
+				}
+				else if (!to_excluded)
+				{
+					add_change(batch, filter, root, ChangeAction::Added, next);
+				}
+				else
+				{
+					stats_add(Counter::ChangesFiltered, 2);
+				}
+				offset += current->NextEntryOffset;
+				current = next;
+			}
+			else
+			{
+				add_change(batch, filter, root, ChangeAction::Removed, current);
+			}
+		}
+		else if (action == ChangeAction::RenamedNewName)
+		{
+			add_change(batch, filter, root, ChangeAction::Added, current);
 		}
 		else
+		{
+			add_change(batch, filter, root, action, current);
+		}
+		if (current->NextEntryOffset)
+			offset += current->NextEntryOffset;
+		else
+			break;
+	}
+}
+
+static bool watch_directories(Pipeline &pipeline)
+{
+	const int seconds_fs_timeout = 1;
+	// Completion keys index watched, or volumes with --usn-journal.
+	std::vector<WatchedDirectory> watched;
+	std::vector<UsnVolume> volumes;
+	if (pipeline.usn_journal)
+	{
+		std::vector<std::string> directories;
+		for (auto &root : pipeline.roots)
+			directories.push_back(root.directory);
+		if (!open_usn_volumes(directories, volumes))
+			return false;
+		for (size_t i = 0; i < volumes.size(); i++)
+		{
+			if (!CreateIoCompletionPort(volumes[i].handle, pipeline.completion_port, ULONG_PTR(i), 0))
+			{
+				fprintf(stderr, "Failed to add volume %s to the completion port: %s\n", sw2s(volumes[i].name).c_str(), error_to_string(GetLastError()).c_str());
+				return false;
+			}
+			if (!read_usn_journal(volumes[i]))
+				return false;
+		}
+	}
+	else
+	{
+		watched.resize(pipeline.roots.size());
+	}
+	for (size_t i = 0; i < watched.size(); i++)
+	{
+		const std::string &directory = pipeline.roots[i].directory;
+		watched[i].handle = CreateFile(
+			s2ws(directory).c_str(),
+			FILE_LIST_DIRECTORY,
+			FILE_SHARE_WRITE | FILE_SHARE_READ | FILE_SHARE_DELETE,
+			NULL,
+			OPEN_EXISTING,
+			FILE_FLAG_BACKUP_SEMANTICS|FILE_FLAG_OVERLAPPED,
+			NULL);
+		if (watched[i].handle == INVALID_HANDLE_VALUE)
+		{
+			fprintf(stderr, "Failed to open directory %s: %s\n", directory.c_str(), error_to_string(GetLastError()).c_str());
+			return false;
+		}
+		if (!CreateIoCompletionPort(watched[i].handle, pipeline.completion_port, ULONG_PTR(i), 0))
+		{
+			fprintf(stderr, "Failed to add directory %s to the completion port: %s\n", directory.c_str(), error_to_string(GetLastError()).c_str());
+			return false;
+		}
+		// 64KB is the most ReadDirectoryChangesW accepts for network shares.
+		watched[i].notify_info.resize(1 << 16);
+		memset(&watched[i].ol, 0, sizeof(watched[i].ol));
+		if (!add_dir_handle_to_ol(directory, watched[i]))
+			return false;
+	}
+	size_t active = pipeline.usn_journal ? volumes.size() : watched.size();
+
+	std::vector<std::unique_ptr<ChangeBatch>> batch_pool;
+	for (int i = 0; i < BATCH_POOL_SIZE; i++)
+		batch_pool.emplace_back(new ChangeBatch());
+	for (int i = 1; i < BATCH_POOL_SIZE; i++)
+	{
+		ChangeBatch *batch = batch_pool[i].get();
+		pipeline.free_batches.try_push(batch);
+	}
+
+	std::thread hasher(hasher_thread, std::ref(pipeline));
+	for (auto &target : pipeline.targets)
+		target->thread = std::thread(sender_thread, std::ref(pipeline), std::ref(*target));
+	auto stop_pipeline = [&]() {
+		fail_pipeline(pipeline);
+		hasher.join();
+		for (auto &target : pipeline.targets)
+			target->thread.join();
+		return false;
+	};
+
+	ChangeBatch *files_changed = batch_pool[0].get();
+	bool deferred = false;
+	auto time_at_empty = std::chrono::system_clock::now();
+	while (true)
+	{
+		DWORD wait_for = INFINITE;
+		if (!files_changed->empty())
 		{
 			auto elapsed = std::chrono::system_clock::now() - time_at_empty;
 			if (elapsed >= std::chrono::seconds(seconds_fs_timeout))
 			{
-				if (!process_changed_paths(dir_slash, files_changed, state))
-					return false;
-				files_changed.clear();
-				wait_for = INFINITE;
+				if (!hand_off_batch(pipeline, files_changed, deferred))
+					wait_for = BACKPRESSURE_RETRY_MS;
 			}
 			else
 			{
 				wait_for = DWORD(std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::seconds(seconds_fs_timeout) - elapsed).count());
 			}
 		}
-		DWORD result = WaitForSingleObject(ol.hEvent, wait_for);
-		if (result == WAIT_TIMEOUT)
+		DWORD bytes_read = 0;
+		ULONG_PTR key = 0;
+		OVERLAPPED *ol = nullptr;
+		BOOL completed = GetQueuedCompletionStatus(pipeline.completion_port, &bytes_read, &key, &ol, wait_for);
+		if (!ol)
 		{
-			if (!process_changed_paths(dir_slash, files_changed, state))
-				return false;
-			files_changed.clear();
+			if (!completed && GetLastError() == WAIT_TIMEOUT)
+				continue;
+			if (key != STOP_KEY)
+				fprintf(stderr, "Failed to wait for file system events: %s\n", error_to_string(GetLastError()).c_str());
+			return stop_pipeline();
 		}
-		else if (result == WAIT_OBJECT_0)
+
+		bool was_empty = files_changed->empty();
+		if (pipeline.usn_journal)
 		{
-			DWORD bytes_read = 0;
-			if (!GetOverlappedResult(dir_handle, &ol, &bytes_read, false))
+			UsnVolume &volume = volumes[key];
+			if (!completed && GetLastError() == ERROR_JOURNAL_ENTRY_DELETED)
 			{
-				DWORD error = GetLastError();
-				if (error != ERROR_IO_PENDING)
-				{
-					fprintf(stderr, "Failed to retrieve file system events in directory %s: %s\n", directory.c_str(), error_to_string(error).c_str());
-					return false;
-				}
+				// The journal wrapped around before it was read.
+				skip_lost_usn_records(volume);
 			}
-			uint32_t offset = 0;
-			while (offset < bytes_read)
+			else if (!completed)
 			{
-				if (files_changed.empty())
-					time_at_empty = std::chrono::system_clock::now();
-				FILE_NOTIFY_INFORMATION *current = reinterpret_cast<FILE_NOTIFY_INFORMATION *>(notify_info.data() + offset);
-				FileAction action = FileAction(current->Action);
-				std::wstring file_name(current->FileName, current->FileNameLength / sizeof(wchar_t));
-				if (action == FileAction::RenamedOldName)
-				{
-					FILE_NOTIFY_INFORMATION *next = nullptr;
-					if (current->NextEntryOffset)
-						next = reinterpret_cast<FILE_NOTIFY_INFORMATION *>(notify_info.data() + offset + current->NextEntryOffset);
-					if (next && FileAction(next->Action) == FileAction::RenamedNewName)
-					{
-						std::wstring next_file_name(next->FileName, next->FileNameLength / sizeof(wchar_t));
-						files_changed.push_back({ FileAction(current->Action), sw2s(file_name) });
-						files_changed.push_back({ FileAction(next->Action), sw2s(next_file_name) });
-						offset += current->NextEntryOffset;
-						current = next;
-					}
-					else
-					{
-						files_changed.push_back({ FileAction::Removed, sw2s(file_name) });
-					}
-				}
-				else if (action == FileAction::RenamedNewName)
-				{
-					files_changed.push_back({ FileAction::Added, sw2s(file_name) });
-				}
-				else
-				{
-					files_changed.push_back({ action, sw2s(file_name) });
-				}
-				if (current->NextEntryOffset)
-					offset += current->NextEntryOffset;
-				else
-					break;
+				fprintf(stderr, "Stopped reading the change journal of %s: %s\n", sw2s(volume.name).c_str(), error_to_string(GetLastError()).c_str());
+				CloseHandle(volume.handle);
+				if (!--active)
+					return stop_pipeline();
+				continue;
 			}
+			else
+			{
+				add_usn_records(volume, *files_changed, pipeline.filter, bytes_read);
+			}
+			if (!read_usn_journal(volume))
+				return stop_pipeline();
 		}
+		else
+		{
+			uint32_t root = uint32_t(key);
+			const std::string &directory = pipeline.roots[root].directory;
+			if (!completed)
+			{
+				// The directory is gone or no longer accessible. Keep serving
+				// the other roots.
+				fprintf(stderr, "Stopped watching %s: %s\n", directory.c_str(), error_to_string(GetLastError()).c_str());
+				CloseHandle(watched[root].handle);
+				if (!--active)
+					return stop_pipeline();
+				continue;
+			}
+			if (bytes_read == 0)
+				fprintf(stderr, "Change notifications for %s overflowed, events were lost\n", directory.c_str());
+			add_changes(*files_changed, pipeline.filter, root, watched[root].notify_info.data(), bytes_read);
 
-		ResetEvent(ol.hEvent);
-		if (!add_dir_handle_to_ol(directory, dir_handle, notify_info, ol))
-			return false;
+			if (!add_dir_handle_to_ol(directory, watched[root]))
+				return stop_pipeline();
+		}
+		// Changes are handed off a second after the first one of a batch.
+		if (was_empty && !files_changed->empty())
+		{
+			time_at_empty = std::chrono::system_clock::now();
+			files_changed->first_change_time = stats_now();
+		}
 	}
 	return true;
 }
 
-bool run_client(const std::string &server_string, const std::string &watch_directory_name)
+static SOCKET connect_to_server(const std::string &server_string)
 {
-	CommunicationState state;
 	struct addrinfo *result = NULL,
 		*ptr = NULL,
 		hints;
@@ -388,27 +1323,26 @@ bool run_client(const std::string &server_string, const std::string &watch_direc
 	if (failed)
 	{
 		fprintf(stderr, "getaddrinfo failed with error: %d\n", failed);
-		WSACleanup();
-		return false;
+		return INVALID_SOCKET;
 	}
 
+	SOCKET connected = INVALID_SOCKET;
 	for (ptr = result; ptr != NULL; ptr = ptr->ai_next)
 	{
 
-		state.socket = socket(ptr->ai_family, ptr->ai_socktype,
+		connected = socket(ptr->ai_family, ptr->ai_socktype,
 			ptr->ai_protocol);
-		if (state.socket == INVALID_SOCKET)
+		if (connected == INVALID_SOCKET)
 		{
 			fprintf(stderr, "socket failed with error: %ld\n", WSAGetLastError());
-			WSACleanup();
-			return false;
+			break;
 		}
 
-		int success = connect(state.socket, ptr->ai_addr, (int)ptr->ai_addrlen);
+		int success = connect(connected, ptr->ai_addr, (int)ptr->ai_addrlen);
 		if (success == SOCKET_ERROR)
 		{
-			closesocket(state.socket);
-			state.socket = INVALID_SOCKET;
+			closesocket(connected);
+			connected = INVALID_SOCKET;
 			continue;
 		}
 		break;
@@ -416,33 +1350,175 @@ bool run_client(const std::string &server_string, const std::string &watch_direc
 
 	freeaddrinfo(result);
 
-	if (state.socket == INVALID_SOCKET)
+	if (connected == INVALID_SOCKET)
+		fprintf(stderr, "Unable to connect to server %s!\n", server_string.c_str());
+	return connected;
+}
+
+static bool receive_data(SOCKET socket, void *data, int size)
+{
+	int total_bytes_received = 0;
+	while (total_bytes_received < size)
 	{
-		fprintf(stderr, "Unable to connect to server!\n");
-		WSACleanup();
+		int bytes_received = recv(socket, (char *)data + total_bytes_received, size - total_bytes_received, 0);
+		if (bytes_received <= 0)
+		{
+			fprintf(stderr, "Failed to receive %d\n", WSAGetLastError());
+			return false;
+		}
+		total_bytes_received += bytes_received;
+	}
+	return true;
+}
+
+// Offers the hashes we can produce and returns the one the server picked,
+// None if there is no common one or the exchange failed.
+static HashAlgorithm negotiate_hash(SOCKET socket, const std::vector<HashAlgorithm> &offered, uint32_t flags, uint32_t &granted)
+{
+	uint8_t request[HelloRequest::size];
+	encode_hello_request(request, offered.data(), offered.size(), flags);
+	if (send(socket, (const char *)request, sizeof(request), 0) != sizeof(request))
+	{
+		fprintf(stderr, "Failed to send hello %d\n", WSAGetLastError());
+		return HashAlgorithm::None;
+	}
+	uint8_t reply[HelloReply::size];
+	if (!receive_data(socket, reply, sizeof(reply)))
+		return HashAlgorithm::None;
+	HashAlgorithm chosen = decode_hello_reply(reply);
+	if (std::find(offered.begin(), offered.end(), chosen) == offered.end())
+		return HashAlgorithm::None;
+	granted = HelloReply::Flags::load(reply) & flags;
+	return chosen;
+}
+
+// Opens the ring the server created for this connection and tells it
+// whether that worked, which it only does on the server's host.
+static bool attach_shared_ring(Target &target)
+{
+	uint8_t offer[SharedRingOffer::size];
+	uint32_t process_id;
+	uint32_t ring_id;
+	if (!receive_data(target.socket, offer, sizeof(offer)) || !decode_shared_ring_offer(offer, process_id, ring_id))
+	{
+		fprintf(stderr, "Invalid shared ring offer from %s\n", target.server.c_str());
+		return false;
+	}
+	bool attached = shared_ring_open(target.ring, process_id, ring_id) && shared_ring_watch_peer(target.ring, process_id);
+	uint8_t attach[SharedRingAttach::size];
+	encode_shared_ring_attach(attach, attached ? GetCurrentProcessId() : 0);
+	if (send(target.socket, (const char *)attach, sizeof(attach), 0) != sizeof(attach))
+	{
+		fprintf(stderr, "Failed to attach to the shared ring %d\n", WSAGetLastError());
+		attached = false;
+	}
+	if (!attached)
+	{
+		shared_ring_close(target.ring, true);
+		fprintf(stderr, "Can not share memory with %s, it has to run on this host\n", target.server.c_str());
 		return false;
 	}
+	target.shared = true;
+	return true;
+}
+
+static void close_targets(Pipeline &pipeline)
+{
+	for (auto &target : pipeline.targets)
+	{
+		if (target->socket == INVALID_SOCKET)
+			continue;
+		// The server takes the end of the ring as the end of the stream.
+		if (target->shared)
+			shared_ring_close(target->ring, true);
+		if (shutdown(target->socket, SD_SEND) == SOCKET_ERROR)
+			fprintf(stderr, "shutdown failed with error: %d\n", WSAGetLastError());
+		// The server flushes and acknowledges the rest before it closes.
+		if (target->acknowledgement_thread.joinable())
+			target->acknowledgement_thread.join();
+		if (target->acknowledged && target->durable < target->sent)
+			fprintf(stderr, "%llu messages to %s were not acknowledged\n", (unsigned long long)(target->sent - target->durable), target->server.c_str());
+		closesocket(target->socket);
+	}
+}
 
-	fprintf(stderr, "Connected. Watching directory %s\n", watch_directory_name.c_str());
-	if (!watch_directory(watch_directory_name, state))
+bool run_client(const ClientOptions &options)
+{
+	Pipeline pipeline;
+	for (auto &server : options.servers)
 	{
-		fprintf(stderr, "shutdown failed with error: %d\n", WSAGetLastError());
-		closesocket(state.socket);
+		std::unique_ptr<Target> target(new Target());
+		target->server = server;
+		target->socket = connect_to_server(server);
+		if (target->socket == INVALID_SOCKET)
+		{
+			close_targets(pipeline);
+			WSACleanup();
+			return false;
+		}
+		// Messages are shared by all targets, so after the first server
+		// the rest have to accept the same hash.
+		std::vector<HashAlgorithm> offered = options.hashes;
+		if (pipeline.hash != HashAlgorithm::None)
+			offered.assign(1, pipeline.hash);
+		uint32_t flags = (options.durable ? HELLO_ACKNOWLEDGE : 0) | (options.shared_memory ? HELLO_SHARED_MEMORY : 0);
+		uint32_t granted = 0;
+		pipeline.hash = negotiate_hash(target->socket, offered, flags, granted);
+		if (pipeline.hash == HashAlgorithm::None)
+		{
+			fprintf(stderr, "No common content hash with %s\n", server.c_str());
+			closesocket(target->socket);
+			close_targets(pipeline);
+			WSACleanup();
+			return false;
+		}
+		target->acknowledged = (granted & HELLO_ACKNOWLEDGE) != 0;
+		if ((granted & HELLO_SHARED_MEMORY) && !attach_shared_ring(*target))
+		{
+			closesocket(target->socket);
+			close_targets(pipeline);
+			WSACleanup();
+			return false;
+		}
+		set_rate(target->pacer.buckets[int(Priority::Bulk)], options.bulk_rate);
+		set_rate(target->pacer.buckets[int(Priority::Interactive)], options.interactive_rate);
+		set_socket_pacing(target->socket, pacer_ceiling(target->pacer));
+		fprintf(stderr, "Connected to %s using %s%s\n", server.c_str(), hash_name(pipeline.hash), target->shared ? " through shared memory" : "");
+		if (options.durable && !target->acknowledged)
+			fprintf(stderr, "%s does not acknowledge durable writes\n", server.c_str());
+		if (target->acknowledged)
+			target->acknowledgement_thread = std::thread(acknowledgement_thread, std::ref(*target));
+		pipeline.targets.push_back(std::move(target));
+	}
+	pipeline.live_targets.store(pipeline.targets.size());
+
+	pipeline.completion_port = CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0, 1);
+	if (!pipeline.completion_port)
+	{
+		fprintf(stderr, "Failed to create completion port %s\n", error_to_string(GetLastError()).c_str());
+		close_targets(pipeline);
 		WSACleanup();
 		return false;
 	}
-
-	int success = shutdown(state.socket, SD_SEND);
-	if (success == SOCKET_ERROR)
+	pipeline.roots = options.roots;
+	if (!compile_path_filter(pipeline.filter, options.filters))
 	{
-		fprintf(stderr, "shutdown failed with error: %d\n", WSAGetLastError());
-		closesocket(state.socket);
+		close_targets(pipeline);
 		WSACleanup();
 		return false;
 	}
+	for (auto &root : pipeline.roots)
+	{
+		if (!root.prefix.empty() && root.prefix.back() != '\\')
+			root.prefix += '\\';
+	}
 
-	closesocket(state.socket);
+	for (auto &root : pipeline.roots)
+		fprintf(stderr, "Watching directory %s as '%s'\n", root.directory.c_str(), root.prefix.c_str());
+	pipeline.usn_journal = options.usn_journal;
+	pipeline.direct_read = options.direct_read;
+	bool success = watch_directories(pipeline);
+	close_targets(pipeline);
 	WSACleanup();
-
-	return true;
+	return success;
 }
@@ -1,3 +1,43 @@
 #include <string>
+#include <vector>
 
-bool run_client(const std::string &connect_to, const std::string &watch_dir);
+#include <stdint.h>
+
+#include "protocol.h"
+#include "path_filter.h"
+#include "direct_reader.h"
+
+// A local directory and the path prefix its files get on the server. An
+// empty prefix puts them in the server's target directory.
+struct WatchRoot
+{
+	std::string directory;
+	std::string prefix;
+};
+
+struct ClientOptions
+{
+	// Every file is read and hashed once and sent to all servers.
+	std::vector<std::string> servers;
+	std::vector<WatchRoot> roots;
+	// Bytes per second, 0 is unlimited.
+	uint64_t bulk_rate = 0;
+	uint64_t interactive_rate = 0;
+	// Offered to the servers in order of preference.
+	std::vector<HashAlgorithm> hashes = { HashAlgorithm::Blake3, HashAlgorithm::Sha1 };
+	// Checked in order against paths relative to their root; see
+	// path_filter.h.
+	std::vector<FilterRule> filters;
+	// Asks the servers to acknowledge messages once they are on disk.
+	bool durable = false;
+	// Sends messages to servers on this host through shared memory rather
+	// than loopback TCP.
+	bool shared_memory = false;
+	// Reads the NTFS change journal of the roots' volumes instead of
+	// watching each root. Needs administrator rights.
+	bool usn_journal = false;
+	// Reads large files without going through the file cache.
+	DirectReadOptions direct_read;
+};
+
+bool run_client(const ClientOptions &options);
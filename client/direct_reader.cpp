@@ -0,0 +1,140 @@
+#include "direct_reader.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+
+bool direct_reader_start(DirectReader &reader)
+{
+	// Pages are aligned well beyond any sector size.
+	reader.memory = (uint8_t *)VirtualAlloc(NULL, size_t(DIRECT_READ_SIZE) * DIRECT_READ_DEPTH, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+	if (!reader.memory)
+	{
+		fprintf(stderr, "Failed to allocate direct read buffers: %s\n", error_to_string(GetLastError()).c_str());
+		reader.options.enabled = false;
+		return false;
+	}
+	for (auto &event : reader.events)
+		event = CreateEventW(NULL, TRUE, FALSE, NULL);
+	fprintf(stderr, "Reading files of %llu MB and more without buffering\n", (unsigned long long)(reader.options.min_size >> 20));
+	return true;
+}
+
+void direct_reader_stop(DirectReader &reader)
+{
+	if (!reader.memory)
+		return;
+	VirtualFree(reader.memory, 0, MEM_RELEASE);
+	reader.memory = nullptr;
+	for (auto &event : reader.events)
+	{
+		if (event)
+			CloseHandle(event);
+		event = NULL;
+	}
+}
+
+bool use_direct_read(const DirectReader &reader, uint64_t size)
+{
+	return reader.options.enabled && reader.memory && size >= reader.options.min_size;
+}
+
+struct DirectRead
+{
+	OVERLAPPED ol;
+	uint64_t offset;
+	bool pending;
+};
+
+// Whole buffers are always asked for. That is a multiple of any sector
+// size, and the read at the end of the file returns what is left.
+static bool start_read(HANDLE file_handle, uint8_t *buffer, HANDLE event, DirectRead &read, uint64_t offset)
+{
+	memset(&read.ol, 0, sizeof(read.ol));
+	read.ol.Offset = DWORD(offset);
+	read.ol.OffsetHigh = DWORD(offset >> 32);
+	read.ol.hEvent = event;
+	read.offset = offset;
+	if (!ReadFile(file_handle, buffer, DIRECT_READ_SIZE, NULL, &read.ol) && GetLastError() != ERROR_IO_PENDING)
+		return false;
+	read.pending = true;
+	return true;
+}
+
+bool direct_read(DirectReader &reader, const std::string &file, const wchar_t *wide_file, std::vector<uint8_t> &data)
+{
+	HANDLE file_handle = CreateFileW(wide_file,
+		GENERIC_READ,
+		NULL,
+		NULL,
+		OPEN_EXISTING,
+		FILE_FLAG_NO_BUFFERING | FILE_FLAG_OVERLAPPED | FILE_FLAG_SEQUENTIAL_SCAN,
+		NULL);
+	if (file_handle == INVALID_HANDLE_VALUE)
+		return false;
+	LARGE_INTEGER f_size;
+	if (!GetFileSizeEx(file_handle, &f_size))
+	{
+		fprintf(stderr, "Failed to read file %s size: %s\n", file.c_str(), error_to_string(GetLastError()).c_str());
+		CloseHandle(file_handle);
+		return false;
+	}
+	uint64_t size = uint64_t(f_size.QuadPart);
+	data.resize(size_t(size));
+
+	DirectRead reads[DIRECT_READ_DEPTH] = {};
+	DWORD error = ERROR_SUCCESS;
+	uint64_t next = 0;
+	for (int i = 0; i < DIRECT_READ_DEPTH && next < size; i++, next += DIRECT_READ_SIZE)
+	{
+		if (!start_read(file_handle, reader.memory + size_t(i) * DIRECT_READ_SIZE, reader.events[i], reads[i], next))
+		{
+			error = GetLastError();
+			break;
+		}
+	}
+	// Completions are taken in the order the reads were issued, each slot
+	// going on to the next unread buffer of the file.
+	uint64_t total = 0;
+	for (int i = 0; error == ERROR_SUCCESS && reads[i].pending; i = (i + 1) % DIRECT_READ_DEPTH)
+	{
+		DirectRead &read = reads[i];
+		uint8_t *buffer = reader.memory + size_t(i) * DIRECT_READ_SIZE;
+		DWORD bytes_read = 0;
+		read.pending = false;
+		if (!GetOverlappedResult(file_handle, &read.ol, &bytes_read, TRUE) && GetLastError() != ERROR_HANDLE_EOF)
+		{
+			error = GetLastError();
+			break;
+		}
+		size_t copied = size_t(std::min(uint64_t(bytes_read), size - read.offset));
+		memcpy(data.data() + read.offset, buffer, copied);
+		total += copied;
+		// The file shrank while it was read.
+		if (copied < std::min(uint64_t(DIRECT_READ_SIZE), size - read.offset))
+			break;
+		if (next < size)
+		{
+			if (!start_read(file_handle, buffer, reader.events[i], read, next))
+				error = GetLastError();
+			next += DIRECT_READ_SIZE;
+		}
+	}
+	for (int i = 0; i < DIRECT_READ_DEPTH; i++)
+	{
+		if (!reads[i].pending)
+			continue;
+		DWORD bytes_read;
+		CancelIoEx(file_handle, &reads[i].ol);
+		GetOverlappedResult(file_handle, &reads[i].ol, &bytes_read, TRUE);
+	}
+	CloseHandle(file_handle);
+	if (error != ERROR_SUCCESS)
+	{
+		fprintf(stderr, "Failed to read file: %s %s.\n", file.c_str(), error_to_string(error).c_str());
+		return false;
+	}
+	data.resize(size_t(total));
+	return true;
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+#include "win_global.h"
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+// Large files are read with FILE_FLAG_NO_BUFFERING, so uploading a big tree
+// does not push the working set of everything else on the host out of the
+// file cache. Reads go into sector-aligned buffers, several in flight at
+// once to make up for the read-ahead the cache no longer does, and are
+// copied out in order.
+
+#define DIRECT_READ_SIZE (4 << 20)
+#define DIRECT_READ_DEPTH 4
+#define DIRECT_READ_MIN (uint64_t(16) << 20)
+
+struct DirectReadOptions
+{
+	bool enabled = false;
+	// Smaller files are read through the cache as before.
+	uint64_t min_size = DIRECT_READ_MIN;
+};
+
+struct DirectReader
+{
+	DirectReadOptions options;
+	uint8_t *memory = nullptr;
+	HANDLE events[DIRECT_READ_DEPTH] = {};
+};
+
+// Allocates the buffers. On failure large files are read through the cache.
+bool direct_reader_start(DirectReader &reader);
+void direct_reader_stop(DirectReader &reader);
+
+bool use_direct_read(const DirectReader &reader, uint64_t size);
+
+// Reads the whole file into data. Every read has finished when it returns.
+bool direct_read(DirectReader &reader, const std::string &file, const wchar_t *wide_file, std::vector<uint8_t> &data);
@@ -0,0 +1,370 @@
+#pragma once
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/fanotify.h>
+#include <sys/stat.h>
+#include <sys/statfs.h>
+#include <unistd.h>
+
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "change_batch.h"
+#include "path_filter.h"
+#include "stats.h"
+
+// Watches whole filesystems with fanotify, for trees with more directories
+// than inotify can watch one by one. Each filesystem a root is on is marked
+// once, so starting costs the same however many directories there are and
+// nothing is walked. Like the inotify watcher, only the bench uses it for
+// now, as the client itself only builds on Windows.
+//
+// With FAN_REPORT_DFID_NAME an event names its directory by file handle and
+// gives the entry's name. Handles are opened with open_by_handle_at() and
+// resolved to paths once, then cached, and events outside every root are
+// dropped here. Renaming or deleting a directory clears the cache, since
+// every path cached below it is stale. fanotify merges queued events on the
+// same name, so whether a merged create and delete ended with the entry
+// there is read from the file system. A rename is one FAN_RENAME event
+// with both names, which needs Linux 5.17. Marking a filesystem needs
+// CAP_SYS_ADMIN and opening handles CAP_DAC_READ_SEARCH.
+
+#define FANOTIFY_BUFFER_SIZE (1 << 18)
+#define FANOTIFY_CACHE_MAX (1 << 20)
+#define FANOTIFY_MASK (FAN_CREATE | FAN_DELETE | FAN_MODIFY | FAN_RENAME | FAN_ONDIR)
+
+// A directory's place below the roots; root is -1 outside all of them.
+struct FanotifyDirectory
+{
+	int32_t root;
+	std::string relative;
+	std::string path;
+};
+
+struct FanotifyRoot
+{
+	std::string path;
+	// Any file on the filesystem will do for open_by_handle_at(), as long as
+	// it is not opened with O_PATH.
+	int fd = -1;
+	uint64_t fsid = 0;
+};
+
+struct FanotifyWatcher
+{
+	int fd = -1;
+	std::vector<FanotifyRoot> roots;
+	std::vector<uint64_t> buffer;
+	// Keyed by the filesystem id and the handle bytes.
+	std::unordered_map<std::string, FanotifyDirectory> directories;
+	std::string key_buffer;
+	std::string name_buffer;
+	std::string new_name_buffer;
+	std::string path_buffer;
+};
+
+static uint64_t fanotify_fsid(const void *fsid)
+{
+	uint64_t id;
+	memcpy(&id, fsid, sizeof(id));
+	return id;
+}
+
+// The root and relative path below it, if path is a root or inside one.
+// Both are real paths, so they agree on form.
+static int32_t fanotify_root_of(const FanotifyWatcher &watcher, std::string_view path, std::string &relative)
+{
+	int32_t best = -1;
+	for (size_t i = 0; i < watcher.roots.size(); i++)
+	{
+		std::string_view root = watcher.roots[i].path;
+		if (path.size() < root.size() || path.compare(0, root.size(), root) != 0)
+			continue;
+		if (path.size() != root.size() && path[root.size()] != '/' && root != "/")
+			continue;
+		// Nested roots go to the innermost one.
+		if (best >= 0 && watcher.roots[best].path.size() > root.size())
+			continue;
+		best = int32_t(i);
+	}
+	if (best < 0)
+		return -1;
+	size_t start = watcher.roots[best].path.size();
+	if (start < path.size() && path[start] == '/')
+		start++;
+	relative.assign(path.substr(start));
+	for (char &c : relative)
+	{
+		if (c == '/')
+			c = '\\';
+	}
+	return best;
+}
+
+static const FanotifyDirectory &resolve_fanotify_directory(FanotifyWatcher &watcher, const struct fanotify_event_info_fid *info)
+{
+	struct file_handle *handle = (struct file_handle *)info->handle;
+	std::string &key = watcher.key_buffer;
+	key.assign(reinterpret_cast<const char *>(&info->fsid), sizeof(info->fsid));
+	key.append(reinterpret_cast<const char *>(handle), sizeof(*handle) + handle->handle_bytes);
+	auto found = watcher.directories.find(key);
+	if (found != watcher.directories.end())
+		return found->second;
+	if (watcher.directories.size() >= FANOTIFY_CACHE_MAX)
+		watcher.directories.clear();
+
+	FanotifyDirectory &directory = watcher.directories[key];
+	directory.root = -1;
+	uint64_t fsid = fanotify_fsid(&info->fsid);
+	int mount_fd = -1;
+	for (auto &root : watcher.roots)
+	{
+		if (root.fsid == fsid)
+			mount_fd = root.fd;
+	}
+	if (mount_fd < 0)
+		return directory;
+	// A directory that is gone stays unresolved; a new one gets a new
+	// handle.
+	int fd = open_by_handle_at(mount_fd, handle, O_PATH | O_DIRECTORY);
+	if (fd < 0)
+		return directory;
+	char link[32];
+	snprintf(link, sizeof(link), "/proc/self/fd/%d", fd);
+	std::string &path = watcher.path_buffer;
+	path.resize(PATH_MAX);
+	ssize_t size = readlink(link, &path[0], path.size());
+	close(fd);
+	if (size <= 0 || size_t(size) >= path.size())
+		return directory;
+	path.resize(size_t(size));
+	directory.root = fanotify_root_of(watcher, path, directory.relative);
+	if (directory.root >= 0)
+		directory.path = path;
+	return directory;
+}
+
+// The entry's path relative to its root into name; -1 if it is outside
+// every root.
+static int32_t fanotify_entry_path(FanotifyWatcher &watcher, const struct fanotify_event_info_fid *info, std::string &name, std::string *path)
+{
+	const FanotifyDirectory &parent = resolve_fanotify_directory(watcher, info);
+	if (parent.root < 0)
+		return -1;
+	const struct file_handle *handle = (const struct file_handle *)info->handle;
+	const char *entry = reinterpret_cast<const char *>(handle->f_handle + handle->handle_bytes);
+	// Events on the directory itself, rather than an entry in it.
+	if (!*entry || strcmp(entry, ".") == 0)
+		return -1;
+	name.assign(parent.relative);
+	if (!name.empty())
+		name += '\\';
+	name += entry;
+	if (path)
+	{
+		path->assign(parent.path);
+		*path += '/';
+		*path += entry;
+	}
+	return parent.root;
+}
+
+static void add_fanotify_change(ChangeBatch &batch, const PathFilter &filter, int32_t root, ChangeAction action, const std::string &name)
+{
+	if (root < 0)
+		return;
+	if (path_excluded(filter, name))
+	{
+		stats_add(Counter::ChangesFiltered, 1);
+		return;
+	}
+	batch.add(uint32_t(root), action, name.data(), name.size());
+}
+
+static void add_fanotify_event(FanotifyWatcher &watcher, ChangeBatch &batch, const PathFilter &filter, const struct fanotify_event_metadata *event)
+{
+	if (event->mask & FAN_Q_OVERFLOW)
+	{
+		fprintf(stderr, "Change notifications overflowed, events were lost\n");
+		return;
+	}
+	const struct fanotify_event_info_fid *entry = nullptr;
+	const struct fanotify_event_info_fid *old_entry = nullptr;
+	const struct fanotify_event_info_fid *new_entry = nullptr;
+	for (uint32_t offset = event->metadata_len; offset + sizeof(struct fanotify_event_info_header) <= event->event_len;)
+	{
+		const struct fanotify_event_info_header *header = reinterpret_cast<const struct fanotify_event_info_header *>(reinterpret_cast<const uint8_t *>(event) + offset);
+		if (!header->len)
+			break;
+		const struct fanotify_event_info_fid *info = reinterpret_cast<const struct fanotify_event_info_fid *>(header);
+		if (header->info_type == FAN_EVENT_INFO_TYPE_DFID_NAME)
+			entry = info;
+		else if (header->info_type == FAN_EVENT_INFO_TYPE_OLD_DFID_NAME)
+			old_entry = info;
+		else if (header->info_type == FAN_EVENT_INFO_TYPE_NEW_DFID_NAME)
+			new_entry = info;
+		offset += header->len;
+	}
+	bool directory = (event->mask & FAN_ONDIR) != 0;
+
+	if ((event->mask & FAN_RENAME) && old_entry && new_entry)
+	{
+		std::string &from_name = watcher.name_buffer;
+		std::string &to_name = watcher.new_name_buffer;
+		int32_t from_root = fanotify_entry_path(watcher, old_entry, from_name, nullptr);
+		int32_t to_root = fanotify_entry_path(watcher, new_entry, to_name, nullptr);
+		if (directory)
+			watcher.directories.clear();
+		// A rename across roots, or into or out of an excluded path, is a
+		// delete and a create as far as the server can tell.
+		bool from = from_root >= 0 && !path_excluded(filter, from_name);
+		bool to = to_root >= 0 && !path_excluded(filter, to_name);
+		if (from && to && from_root == to_root)
+		{
+			batch.add(uint32_t(from_root), ChangeAction::RenamedOldName, from_name.data(), from_name.size());
+			batch.add(uint32_t(to_root), ChangeAction::RenamedNewName, to_name.data(), to_name.size());
+			return;
+		}
+		add_fanotify_change(batch, filter, from_root, ChangeAction::Removed, from_name);
+		add_fanotify_change(batch, filter, to_root, ChangeAction::Added, to_name);
+		return;
+	}
+	if (!entry)
+		return;
+
+	std::string &name = watcher.name_buffer;
+	std::string &path = watcher.new_name_buffer;
+	int32_t root = fanotify_entry_path(watcher, entry, name, &path);
+	if (root < 0)
+		return;
+	if (event->mask & (FAN_CREATE | FAN_DELETE))
+	{
+		struct stat info;
+		if (lstat(path.c_str(), &info) == 0)
+		{
+			add_fanotify_change(batch, filter, root, ChangeAction::Added, name);
+			return;
+		}
+		if (directory)
+			watcher.directories.clear();
+		add_fanotify_change(batch, filter, root, ChangeAction::Removed, name);
+	}
+	else if ((event->mask & FAN_MODIFY) && !directory)
+	{
+		add_fanotify_change(batch, filter, root, ChangeAction::Modified, name);
+	}
+}
+
+static void close_fanotify_watcher(FanotifyWatcher &watcher)
+{
+	if (watcher.fd >= 0)
+		close(watcher.fd);
+	watcher.fd = -1;
+	for (auto &root : watcher.roots)
+	{
+		if (root.fd >= 0)
+			close(root.fd);
+		root.fd = -1;
+	}
+	watcher.directories.clear();
+}
+
+static bool open_fanotify_watcher(FanotifyWatcher &watcher, const std::vector<std::string> &directories)
+{
+	watcher.fd = fanotify_init(FAN_CLASS_NOTIF | FAN_REPORT_DFID_NAME | FAN_NONBLOCK | FAN_CLOEXEC, O_RDONLY | O_LARGEFILE);
+	if (watcher.fd < 0)
+	{
+		fprintf(stderr, "Failed to create a fanotify instance: %s\n", strerror(errno));
+		if (errno == EPERM)
+			fprintf(stderr, "Watching whole filesystems needs CAP_SYS_ADMIN\n");
+		return false;
+	}
+	watcher.buffer.resize(FANOTIFY_BUFFER_SIZE / sizeof(uint64_t));
+	watcher.roots.resize(directories.size());
+	for (size_t i = 0; i < directories.size(); i++)
+	{
+		FanotifyRoot &root = watcher.roots[i];
+		char *real = realpath(directories[i].c_str(), nullptr);
+		if (!real)
+		{
+			fprintf(stderr, "Failed to resolve %s: %s\n", directories[i].c_str(), strerror(errno));
+			close_fanotify_watcher(watcher);
+			return false;
+		}
+		root.path = real;
+		free(real);
+		root.fd = open(root.path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		struct statfs info;
+		if (root.fd < 0 || fstatfs(root.fd, &info) != 0)
+		{
+			fprintf(stderr, "Failed to open %s: %s\n", root.path.c_str(), strerror(errno));
+			close_fanotify_watcher(watcher);
+			return false;
+		}
+		root.fsid = fanotify_fsid(&info.f_fsid);
+		// Roots on the same filesystem share the mark; adding it again is
+		// harmless.
+		if (fanotify_mark(watcher.fd, FAN_MARK_ADD | FAN_MARK_FILESYSTEM, FANOTIFY_MASK, AT_FDCWD, root.path.c_str()) != 0)
+		{
+			fprintf(stderr, "Failed to watch the filesystem of %s: %s\n", root.path.c_str(), strerror(errno));
+			if (errno == EXDEV || errno == EOPNOTSUPP)
+				fprintf(stderr, "The filesystem does not support file handles\n");
+			close_fanotify_watcher(watcher);
+			return false;
+		}
+	}
+	return true;
+}
+
+// Reads everything queued so far, a buffer full per read(). Returns false
+// if the watcher broke.
+static bool read_fanotify_events(FanotifyWatcher &watcher, ChangeBatch &batch, const PathFilter &filter)
+{
+	uint8_t *buffer = reinterpret_cast<uint8_t *>(watcher.buffer.data());
+	size_t buffer_size = watcher.buffer.size() * sizeof(uint64_t);
+	while (true)
+	{
+		ssize_t bytes_read = read(watcher.fd, buffer, buffer_size);
+		if (bytes_read < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN)
+				break;
+			fprintf(stderr, "Reading change notifications failed: %s\n", strerror(errno));
+			return false;
+		}
+		const struct fanotify_event_metadata *event = reinterpret_cast<const struct fanotify_event_metadata *>(buffer);
+		for (int size = int(bytes_read); FAN_EVENT_OK(event, size); event = FAN_EVENT_NEXT(event, size))
+		{
+			if (event->vers != FANOTIFY_METADATA_VERSION)
+			{
+				fprintf(stderr, "Unexpected fanotify metadata version %u\n", event->vers);
+				return false;
+			}
+			add_fanotify_event(watcher, batch, filter, event);
+		}
+	}
+	return true;
+}
+
+// Waits up to timeout_ms, -1 for ever, for events to read. False on a
+// timeout.
+static bool wait_fanotify_events(FanotifyWatcher &watcher, int timeout_ms)
+{
+	struct pollfd ready = { watcher.fd, POLLIN, 0 };
+	int result;
+	do
+		result = poll(&ready, 1, timeout_ms);
+	while (result < 0 && errno == EINTR);
+	return result > 0;
+}
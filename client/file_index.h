@@ -0,0 +1,128 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+
+#include <algorithm>
+#include <map>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "protocol.h"
+#include "blake3.h"
+extern "C" {
+#include "sha1.h"
+}
+
+// The hash state at the end of what was last sent, so a file that has only
+// grown since can be hashed and sent from there. The fingerprint covers the
+// start and the end of the sent bytes and is what tells an append from a
+// rewrite without reading the whole file.
+struct HashResume
+{
+	uint64_t size;
+	uint8_t fingerprint[BLAKE3_OUT_LEN];
+	SHA1_CTX sha1;
+	Blake3Hasher blake3;
+};
+
+struct HashedFile
+{
+	uint64_t frame_sent;
+	std::string path;
+	uint8_t digest[MAX_DIGEST_SIZE];
+	// Directories are kept so their removal can be told from a file's.
+	bool directory;
+	// Only kept for files large enough to be worth it.
+	std::unique_ptr<HashResume> resume;
+};
+
+// Ordered by path, so everything below a directory is one range that
+// starts right after the directory itself.
+typedef std::map<std::string, HashedFile, std::less<>> FileIndex;
+
+static inline HashedFile *get_hashed_file(FileIndex &files, std::string_view name)
+{
+	auto it = files.find(name);
+	if (it == files.end())
+		return nullptr;
+	return &it->second;
+}
+
+static inline HashedFile &add_hashed_file(FileIndex &files, std::string_view name)
+{
+	auto inserted = files.emplace(std::string(name), HashedFile());
+	HashedFile &file = inserted.first->second;
+	if (inserted.second)
+	{
+		file.frame_sent = 0;
+		file.path = inserted.first->first;
+		memset(file.digest, 0, sizeof(file.digest));
+		file.directory = false;
+	}
+	return file;
+}
+
+static inline void drop_hashed_file(FileIndex &files, std::string_view name)
+{
+	auto it = files.find(name);
+	if (it != files.end())
+		files.erase(it);
+}
+
+static inline bool is_below(std::string_view path, std::string_view directory)
+{
+	return path.size() > directory.size()
+		&& path.compare(0, directory.size(), directory) == 0
+		&& path[directory.size()] == '\\';
+}
+
+// The entries below directory, not including the directory itself.
+static inline FileIndex::iterator directory_begin(FileIndex &files, std::string_view directory)
+{
+	std::string first(directory);
+	first += '\\';
+	return files.lower_bound(first);
+}
+
+static inline bool has_entries_below(FileIndex &files, std::string_view directory)
+{
+	auto it = directory_begin(files, directory);
+	return it != files.end() && is_below(it->first, directory);
+}
+
+static inline void drop_hashed_directory(FileIndex &files, std::string_view directory)
+{
+	drop_hashed_file(files, directory);
+	auto begin = directory_begin(files, directory);
+	auto end = begin;
+	while (end != files.end() && is_below(end->first, directory))
+		++end;
+	files.erase(begin, end);
+}
+
+// Moves the entry and, for a directory, everything below it to the new
+// name. The entries are re-keyed in place, nothing is copied or rehashed.
+// Whatever was at the new name was replaced, as when an editor renames a
+// temporary file over the original, so its entries go.
+static inline void rename_hashed_path(FileIndex &files, std::string_view from, std::string_view to)
+{
+	std::vector<FileIndex::node_type> moved;
+	auto directory = files.find(from);
+	if (directory != files.end())
+		moved.push_back(files.extract(directory));
+	auto it = directory_begin(files, from);
+	while (it != files.end() && is_below(it->first, from))
+		moved.push_back(files.extract(it++));
+	drop_hashed_directory(files, to);
+	for (auto &node : moved)
+	{
+		std::string path(to);
+		path.append(node.key(), from.size(), std::string::npos);
+		node.key() = path;
+		node.mapped().path = std::move(path);
+		files.insert(std::move(node));
+	}
+}
@@ -0,0 +1,351 @@
+#pragma once
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "change_batch.h"
+#include "path_filter.h"
+#include "stats.h"
+
+// Watches the roots with inotify, the Linux counterpart of the recursive
+// ReadDirectoryChangesW the client uses on Windows, and produces the same
+// changes: names relative to their root with backslash separators. The
+// client itself only builds on Windows, so for now only the bench uses it.
+//
+// inotify is not recursive, so every directory below a root gets a watch of
+// its own. A directory that is created or moved in is walked and watched,
+// and whatever is already in it is reported as added, since its events
+// happened before the watch existed. Excluded directories are neither
+// walked nor watched, so a large excluded tree does not use up
+// fs.inotify.max_user_watches. A rename arrives as IN_MOVED_FROM and
+// IN_MOVED_TO with the same cookie; the kernel queues both together, so an
+// old name still unpaired once the queue is drained was moved out of every
+// watched directory.
+
+#define INOTIFY_BUFFER_SIZE (1 << 18)
+#define INOTIFY_MASK (IN_CREATE | IN_DELETE | IN_MODIFY | IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR | IN_DONT_FOLLOW | IN_EXCL_UNLINK)
+
+struct InotifyDirectory
+{
+	uint32_t root;
+	std::string relative;
+};
+
+struct InotifyWatcher
+{
+	int fd = -1;
+	std::vector<std::string> roots;
+	std::unordered_map<int, InotifyDirectory> directories;
+	std::vector<uint64_t> buffer;
+	// The old name of a rename, until the event with the new name.
+	uint32_t moved_cookie = 0;
+	uint32_t moved_root = 0;
+	bool moved_directory = false;
+	std::string moved_name;
+	// The last modification, as writes come in one event per write().
+	int modified_wd = -1;
+	std::string modified_name;
+	std::string name_buffer;
+	std::string path_buffer;
+};
+
+static void inotify_full_path(const InotifyWatcher &watcher, uint32_t root, std::string_view relative, std::string &path)
+{
+	path.assign(watcher.roots[root]);
+	if (relative.empty())
+		return;
+	size_t start = path.size() + 1;
+	path += '/';
+	path.append(relative);
+	for (size_t i = start; i < path.size(); i++)
+	{
+		if (path[i] == '\\')
+			path[i] = '/';
+	}
+}
+
+static void join_relative(std::string &name, std::string_view directory, const char *entry)
+{
+	name.assign(directory);
+	if (!name.empty())
+		name += '\\';
+	name += entry;
+}
+
+static void add_inotify_change(ChangeBatch &batch, const PathFilter &filter, uint32_t root, ChangeAction action, const std::string &name)
+{
+	if (path_excluded(filter, name))
+	{
+		stats_add(Counter::ChangesFiltered, 1);
+		return;
+	}
+	batch.add(root, action, name.data(), name.size());
+}
+
+// Watches the directory and every directory below it that is not excluded.
+// With a batch, also reports everything found in them as added.
+static bool add_inotify_watches(InotifyWatcher &watcher, uint32_t root, const std::string &relative, ChangeBatch *batch, const PathFilter &filter)
+{
+	if (path_excluded(filter, relative))
+		return true;
+	std::vector<std::string> pending(1, relative);
+	std::string name;
+	while (!pending.empty())
+	{
+		std::string directory = std::move(pending.back());
+		pending.pop_back();
+		inotify_full_path(watcher, root, directory, watcher.path_buffer);
+		int wd = inotify_add_watch(watcher.fd, watcher.path_buffer.c_str(), INOTIFY_MASK);
+		if (wd < 0)
+		{
+			// Gone again before it could be watched.
+			if (errno == ENOENT || errno == ENOTDIR)
+				continue;
+			fprintf(stderr, "Failed to watch %s: %s\n", watcher.path_buffer.c_str(), strerror(errno));
+			if (errno == ENOSPC)
+				fprintf(stderr, "Raise fs.inotify.max_user_watches to watch more directories\n");
+			return false;
+		}
+		watcher.directories[wd] = { root, directory };
+
+		DIR *listing = opendir(watcher.path_buffer.c_str());
+		if (!listing)
+			continue;
+		while (struct dirent *entry = readdir(listing))
+		{
+			if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+				continue;
+			bool is_directory = entry->d_type == DT_DIR;
+			if (entry->d_type == DT_UNKNOWN)
+			{
+				struct stat info;
+				is_directory = fstatat(dirfd(listing), entry->d_name, &info, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(info.st_mode);
+			}
+			join_relative(name, directory, entry->d_name);
+			if (batch)
+				add_inotify_change(*batch, filter, root, ChangeAction::Added, name);
+			if (is_directory && !path_excluded(filter, name))
+				pending.push_back(name);
+		}
+		closedir(listing);
+	}
+	return true;
+}
+
+static bool below(std::string_view path, std::string_view directory)
+{
+	return path.size() > directory.size() && path.compare(0, directory.size(), directory) == 0 && path[directory.size()] == '\\';
+}
+
+// Keeps the watches of a moved directory and everything below it, under
+// their new names.
+static void move_inotify_watches(InotifyWatcher &watcher, uint32_t from_root, const std::string &from, uint32_t to_root, const std::string &to)
+{
+	for (auto &watched : watcher.directories)
+	{
+		InotifyDirectory &directory = watched.second;
+		if (directory.root != from_root || (directory.relative != from && !below(directory.relative, from)))
+			continue;
+		directory.root = to_root;
+		directory.relative.replace(0, from.size(), to);
+	}
+}
+
+static void remove_inotify_watches(InotifyWatcher &watcher, uint32_t root, const std::string &relative)
+{
+	for (auto watched = watcher.directories.begin(); watched != watcher.directories.end();)
+	{
+		const InotifyDirectory &directory = watched->second;
+		if (directory.root == root && (directory.relative == relative || below(directory.relative, relative)))
+		{
+			inotify_rm_watch(watcher.fd, watched->first);
+			watched = watcher.directories.erase(watched);
+		}
+		else
+		{
+			++watched;
+		}
+	}
+}
+
+static bool open_inotify_watcher(InotifyWatcher &watcher, const std::vector<std::string> &directories, const PathFilter &filter)
+{
+	watcher.fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (watcher.fd < 0)
+	{
+		fprintf(stderr, "Failed to create an inotify instance: %s\n", strerror(errno));
+		return false;
+	}
+	watcher.buffer.resize(INOTIFY_BUFFER_SIZE / sizeof(uint64_t));
+	watcher.roots = directories;
+	for (auto &root : watcher.roots)
+	{
+		if (root.size() > 1 && root.back() == '/')
+			root.pop_back();
+	}
+	for (uint32_t root = 0; root < watcher.roots.size(); root++)
+	{
+		if (!add_inotify_watches(watcher, root, std::string(), nullptr, filter))
+			return false;
+	}
+	return true;
+}
+
+static void close_inotify_watcher(InotifyWatcher &watcher)
+{
+	if (watcher.fd >= 0)
+		close(watcher.fd);
+	watcher.fd = -1;
+	watcher.directories.clear();
+}
+
+// An old name without a new one was moved out of every watched directory.
+static void flush_inotify_move(InotifyWatcher &watcher, ChangeBatch &batch, const PathFilter &filter)
+{
+	if (!watcher.moved_cookie)
+		return;
+	if (watcher.moved_directory)
+		remove_inotify_watches(watcher, watcher.moved_root, watcher.moved_name);
+	add_inotify_change(batch, filter, watcher.moved_root, ChangeAction::Removed, watcher.moved_name);
+	watcher.moved_cookie = 0;
+}
+
+static bool add_inotify_event(InotifyWatcher &watcher, ChangeBatch &batch, const PathFilter &filter, const struct inotify_event *event)
+{
+	if (event->mask & IN_Q_OVERFLOW)
+	{
+		fprintf(stderr, "Change notifications overflowed, events were lost\n");
+		return true;
+	}
+	auto found = watcher.directories.find(event->wd);
+	if (found == watcher.directories.end())
+		return true;
+	if (event->mask & IN_IGNORED)
+	{
+		if (found->second.relative.empty())
+			fprintf(stderr, "Stopped watching %s\n", watcher.roots[found->second.root].c_str());
+		watcher.directories.erase(found);
+		return true;
+	}
+	if (!event->len)
+		return true;
+	uint32_t root = found->second.root;
+	std::string &name = watcher.name_buffer;
+	join_relative(name, found->second.relative, event->name);
+	bool directory = (event->mask & IN_ISDIR) != 0;
+
+	if (event->mask & IN_MODIFY)
+	{
+		if (event->wd == watcher.modified_wd && name == watcher.modified_name)
+			return true;
+		watcher.modified_wd = event->wd;
+		watcher.modified_name = name;
+		add_inotify_change(batch, filter, root, ChangeAction::Modified, name);
+		return true;
+	}
+	watcher.modified_wd = -1;
+
+	if (event->mask & IN_MOVED_FROM)
+	{
+		flush_inotify_move(watcher, batch, filter);
+		watcher.moved_cookie = event->cookie;
+		watcher.moved_root = root;
+		watcher.moved_directory = directory;
+		watcher.moved_name = name;
+		return true;
+	}
+	if ((event->mask & IN_MOVED_TO) && watcher.moved_cookie && watcher.moved_cookie == event->cookie)
+	{
+		watcher.moved_cookie = 0;
+		bool from_excluded = path_excluded(filter, watcher.moved_name);
+		bool to_excluded = path_excluded(filter, name);
+		// An excluded directory has no watches to move.
+		if (directory && !from_excluded && !to_excluded)
+			move_inotify_watches(watcher, watcher.moved_root, watcher.moved_name, root, name);
+		else if (directory && !from_excluded)
+			remove_inotify_watches(watcher, watcher.moved_root, watcher.moved_name);
+		// A rename across roots, or into or out of an excluded path, is a
+		// delete and a create as far as the server can tell.
+		if (watcher.moved_root == root && !from_excluded && !to_excluded)
+		{
+			batch.add(root, ChangeAction::RenamedOldName, watcher.moved_name.data(), watcher.moved_name.size());
+			batch.add(root, ChangeAction::RenamedNewName, name.data(), name.size());
+			return true;
+		}
+		add_inotify_change(batch, filter, watcher.moved_root, ChangeAction::Removed, watcher.moved_name);
+		add_inotify_change(batch, filter, root, ChangeAction::Added, name);
+		if (directory && from_excluded && !to_excluded)
+			return add_inotify_watches(watcher, root, name, &batch, filter);
+		return true;
+	}
+	flush_inotify_move(watcher, batch, filter);
+
+	if (event->mask & IN_DELETE)
+	{
+		add_inotify_change(batch, filter, root, ChangeAction::Removed, name);
+	}
+	else if (event->mask & (IN_CREATE | IN_MOVED_TO))
+	{
+		add_inotify_change(batch, filter, root, ChangeAction::Added, name);
+		if (directory)
+			return add_inotify_watches(watcher, root, name, &batch, filter);
+	}
+	return true;
+}
+
+// Reads everything queued so far, a buffer full per read(). Returns false
+// if the watcher broke.
+static bool read_inotify_events(InotifyWatcher &watcher, ChangeBatch &batch, const PathFilter &filter)
+{
+	uint8_t *buffer = reinterpret_cast<uint8_t *>(watcher.buffer.data());
+	size_t buffer_size = watcher.buffer.size() * sizeof(uint64_t);
+	while (true)
+	{
+		ssize_t bytes_read = read(watcher.fd, buffer, buffer_size);
+		if (bytes_read < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN)
+				break;
+			fprintf(stderr, "Reading change notifications failed: %s\n", strerror(errno));
+			return false;
+		}
+		size_t offset = 0;
+		while (offset + sizeof(struct inotify_event) <= size_t(bytes_read))
+		{
+			const struct inotify_event *event = reinterpret_cast<const struct inotify_event *>(buffer + offset);
+			offset += sizeof(struct inotify_event) + event->len;
+			if (!add_inotify_event(watcher, batch, filter, event))
+				return false;
+		}
+	}
+	flush_inotify_move(watcher, batch, filter);
+	watcher.modified_wd = -1;
+	return true;
+}
+
+// Waits up to timeout_ms, -1 for ever, for events to read. False on a
+// timeout.
+static bool wait_inotify_events(InotifyWatcher &watcher, int timeout_ms)
+{
+	struct pollfd ready = { watcher.fd, POLLIN, 0 };
+	int result;
+	do
+		result = poll(&ready, 1, timeout_ms);
+	while (result < 0 && errno == EINTR);
+	return result > 0;
+}
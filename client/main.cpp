@@ -3,6 +3,63 @@
 #include <stdio.h>
 
 #include "client.h"
+#include "stats.h"
+#include "trace.h"
+
+static bool resolve_directory(const std::string &directory, std::string &resolved)
+{
+	HANDLE dir_handle = CreateFile(
+		s2ws(directory).c_str(),
+		FILE_LIST_DIRECTORY,
+		FILE_SHARE_WRITE | FILE_SHARE_READ | FILE_SHARE_DELETE,
+		NULL,
+		OPEN_EXISTING,
+		FILE_FLAG_BACKUP_SEMANTICS,
+		NULL);
+	if (dir_handle == INVALID_HANDLE_VALUE)
+	{
+		fprintf(stderr, "Failed to open directory %s\n", directory.c_str());
+		return false;
+	}
+	std::wstring real_sub_w;
+	real_sub_w.resize(4096);
+	DWORD size = GetFinalPathNameByHandle(dir_handle, &real_sub_w[0], DWORD(real_sub_w.size()), NULL);
+	real_sub_w.resize(size);
+	resolved = sw2s(real_sub_w);
+	CloseHandle(dir_handle);
+	return true;
+}
+
+// Prefixes are relative paths on the server and have to be distinct, or
+// two roots would write over each other.
+static bool valid_prefixes(const std::vector<WatchRoot> &roots)
+{
+	for (size_t i = 0; i < roots.size(); i++)
+	{
+		const std::string &prefix = roots[i].prefix;
+		if (prefix.find("..") != std::string::npos || prefix.find(':') != std::string::npos
+			|| (!prefix.empty() && (prefix[0] == '\\' || prefix[0] == '/')))
+		{
+			fprintf(stderr, "Invalid prefix '%s' for %s\n", prefix.c_str(), roots[i].directory.c_str());
+			return false;
+		}
+		for (size_t j = 0; j < i; j++)
+		{
+			if (roots[j].prefix == prefix)
+			{
+				fprintf(stderr, "%s and %s both use the prefix '%s'\n", roots[j].directory.c_str(), roots[i].directory.c_str(), prefix.c_str());
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+static BOOL WINAPI write_trace_on_exit(DWORD ctrl_type)
+{
+	write_trace();
+	return FALSE;
+}
 
 int __cdecl main(int argc, char **argv) 
 {
@@ -14,47 +71,154 @@ int __cdecl main(int argc, char **argv)
 		return 1;
 	}
 
-	if (argc < 2 || argc > 3) {
-		printf("usage: pexip_dropbox [directory] server-name\n");
+	int stats_interval = 0;
+	std::string trace_file;
+	ClientOptions options;
+	int arg = 1;
+	while (arg < argc && strncmp(argv[arg], "--", 2) == 0)
+	{
+		if (strcmp(argv[arg], "--stats") == 0 && arg + 1 < argc)
+		{
+			stats_interval = atoi(argv[arg + 1]);
+			arg += 2;
+		}
+		else if (strcmp(argv[arg], "--trace") == 0 && arg + 1 < argc)
+		{
+			trace_file = argv[arg + 1];
+			arg += 2;
+		}
+		else if (strcmp(argv[arg], "--rate") == 0 && arg + 1 < argc)
+		{
+			options.bulk_rate = uint64_t(atof(argv[arg + 1]) * 1024 * 1024);
+			arg += 2;
+		}
+		else if (strcmp(argv[arg], "--interactive-rate") == 0 && arg + 1 < argc)
+		{
+			options.interactive_rate = uint64_t(atof(argv[arg + 1]) * 1024 * 1024);
+			arg += 2;
+		}
+		else if (strcmp(argv[arg], "--hash") == 0 && arg + 1 < argc
+			&& (strcmp(argv[arg + 1], "blake3") == 0 || strcmp(argv[arg + 1], "sha1") == 0))
+		{
+			// Only the named hash is offered. By default BLAKE3 is preferred
+			// with SHA-1 as the fallback.
+			options.hashes.assign(1, strcmp(argv[arg + 1], "blake3") == 0 ? HashAlgorithm::Blake3 : HashAlgorithm::Sha1);
+			arg += 2;
+		}
+		else if (strcmp(argv[arg], "--durable") == 0)
+		{
+			options.durable = true;
+			arg += 1;
+		}
+		else if (strcmp(argv[arg], "--shared-memory") == 0)
+		{
+			options.shared_memory = true;
+			arg += 1;
+		}
+		else if (strcmp(argv[arg], "--direct-io") == 0)
+		{
+			options.direct_read.enabled = true;
+			arg += 1;
+		}
+		else if (strcmp(argv[arg], "--direct-io-min") == 0 && arg + 1 < argc)
+		{
+			options.direct_read.min_size = uint64_t(atof(argv[arg + 1]) * 1024 * 1024);
+			arg += 2;
+		}
+		else if (strcmp(argv[arg], "--usn-journal") == 0)
+		{
+			options.usn_journal = true;
+			arg += 1;
+		}
+		else if ((strcmp(argv[arg], "--exclude") == 0 || strcmp(argv[arg], "--include") == 0) && arg + 1 < argc)
+		{
+			options.filters.push_back({ strcmp(argv[arg], "--exclude") == 0, argv[arg + 1] });
+			arg += 2;
+		}
+		else if (strcmp(argv[arg], "--mirror") == 0 && arg + 1 < argc)
+		{
+			options.servers.push_back(argv[arg + 1]);
+			arg += 2;
+		}
+		else if (strcmp(argv[arg], "--root") == 0 && arg + 1 < argc)
+		{
+			// Without an explicit prefix the directory's own name is used.
+			std::string root = argv[arg + 1];
+			size_t equals = root.rfind('=');
+			WatchRoot watch_root;
+			if (equals != std::string::npos)
+			{
+				watch_root.directory = root.substr(0, equals);
+				watch_root.prefix = root.substr(equals + 1);
+			}
+			else
+			{
+				watch_root.directory = root;
+				while (root.size() > 1 && (root.back() == '\\' || root.back() == '/'))
+					root.pop_back();
+				size_t slash = root.find_last_of("\\/:");
+				watch_root.prefix = slash == std::string::npos ? root : root.substr(slash + 1);
+			}
+			options.roots.push_back(watch_root);
+			arg += 2;
+		}
+		else
+		{
+			printf("usage: pexip_dropbox [--stats seconds] [--trace file.json] [--rate MB/s] [--interactive-rate MB/s] [--hash blake3|sha1] [--durable] [--shared-memory] [--usn-journal] [--direct-io] [--direct-io-min MB] [--exclude pattern]... [--include pattern]... [--root directory[=prefix]]... [--mirror server-name]... [directory] server-name\n");
+			return 1;
+		}
+	}
+	argc -= arg - 1;
+	argv += arg - 1;
+
+	if (!trace_file.empty())
+	{
+		if (!enable_trace(trace_file, "pexip_drop_client"))
+			return -1;
+		SetConsoleCtrlHandler(write_trace_on_exit, TRUE);
+	}
+
+	if (argc < 2 || argc > (options.roots.empty() ? 3 : 2)) {
+		printf("usage: pexip_dropbox [--stats seconds] [--trace file.json] [--rate MB/s] [--interactive-rate MB/s] [--hash blake3|sha1] [--durable] [--shared-memory] [--usn-journal] [--direct-io] [--direct-io-min MB] [--exclude pattern]... [--include pattern]... [--root directory[=prefix]]... [--mirror server-name]... [directory] server-name\n");
 		return 1;
 	}
 
-	std::string dir_name;
-	std::string server_name;
-	if (argc == 2)
+	options.servers.insert(options.servers.begin(), argv[argc - 1]);
+	if (options.roots.empty())
 	{
-		std::wstring buffer;
-		buffer.resize(1024);
-		GetCurrentDirectoryW(DWORD(buffer.size()), &buffer[0]);
-		dir_name = sw2s(buffer);
-		server_name = argv[1];
+		WatchRoot root;
+		if (argc == 2)
+		{
+			std::wstring buffer;
+			buffer.resize(1024);
+			DWORD size = GetCurrentDirectoryW(DWORD(buffer.size()), &buffer[0]);
+			buffer.resize(size);
+			root.directory = sw2s(buffer);
+		}
+		else
+		{
+			root.directory = argv[1];
+		}
+		options.roots.push_back(root);
 	}
-	else
+	for (auto &root : options.roots)
 	{
-		HANDLE dir_handle = CreateFile(
-			s2ws(argv[1]).c_str(),
-			FILE_LIST_DIRECTORY,
-			FILE_SHARE_WRITE | FILE_SHARE_READ | FILE_SHARE_DELETE,
-			NULL,
-			OPEN_EXISTING,
-			FILE_FLAG_BACKUP_SEMANTICS,
-			NULL);
-		if (dir_handle == INVALID_HANDLE_VALUE)
-		{
-			fprintf(stderr, "Failed to open directory %s\n", argv[1]);
+		if (!resolve_directory(root.directory, root.directory))
 			return -1;
-		}
-		std::wstring real_sub_w;
-		real_sub_w.resize(4096);
-		GetFinalPathNameByHandle(dir_handle, &real_sub_w[0], DWORD(real_sub_w.size()), NULL);
-		dir_name = sw2s(real_sub_w);
-		CloseHandle(dir_handle);
-		server_name = argv[2];
 	}
-	if (!run_client(server_name, dir_name))
+	if (!valid_prefixes(options.roots))
+		return -1;
+
+	// The dump thread has to be joined before static destruction.
+	start_stats_dump(stats_interval);
+	if (!run_client(options))
 	{
+		stop_stats_dump();
+		write_trace();
 		return -1;
 	}
 
-    return 0;
+	stop_stats_dump();
+	write_trace();
+	return 0;
 }
@@ -0,0 +1,243 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <algorithm>
+#include <map>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Include and exclude rules for paths relative to a watched root, checked
+// before a change is queued. The syntax follows .gitignore:
+//
+//   *.tmp         any file or directory named *.tmp, at any depth
+//   build/        the same; the trailing separator is ignored
+//   /out          only directly below the root
+//   src/**/gen    a pattern with a separator is anchored to the root
+//
+// Components may use * and ?, and ** on its own matches any number of
+// components. Both / and \ separate components, and matching ignores ASCII
+// case as Windows does. The last rule that matches wins. An excluded
+// directory excludes everything below it; an include rule cannot bring
+// back a path whose parent is excluded.
+struct FilterRule
+{
+	bool exclude;
+	std::string pattern;
+};
+
+// All rules are compiled into one trie over path components, so a path is
+// matched against every rule in a single walk. Walking keeps the set of
+// trie nodes that match the components seen so far.
+struct FilterNode
+{
+	std::map<std::string, uint32_t, std::less<>> literals;
+	std::vector<std::pair<std::string, uint32_t>> globs;
+	// The child for a ** component, 0 if there is none.
+	uint32_t globstar = 0;
+	// This node is a ** and matches any number of further components.
+	bool repeats = false;
+	// The last rule ending here, or -1.
+	int32_t rule = -1;
+	bool exclude = false;
+};
+
+struct PathFilter
+{
+	std::vector<FilterNode> nodes;
+	// Scratch for path_excluded(). Only the watcher thread matches paths.
+	mutable std::vector<uint32_t> active;
+	mutable std::vector<uint32_t> next;
+	mutable std::string lowered;
+};
+
+static bool is_path_separator(char c)
+{
+	return c == '/' || c == '\\';
+}
+
+static char lower_ascii(char c)
+{
+	return c >= 'A' && c <= 'Z' ? char(c - 'A' + 'a') : c;
+}
+
+static bool glob_match(std::string_view pattern, std::string_view name)
+{
+	size_t p = 0;
+	size_t n = 0;
+	size_t star = std::string_view::npos;
+	size_t star_name = 0;
+	while (n < name.size())
+	{
+		if (p < pattern.size() && (pattern[p] == '?' || pattern[p] == name[n]))
+		{
+			p++;
+			n++;
+		}
+		else if (p < pattern.size() && pattern[p] == '*')
+		{
+			star = p++;
+			star_name = n;
+		}
+		else if (star != std::string_view::npos)
+		{
+			p = star + 1;
+			n = ++star_name;
+		}
+		else
+		{
+			return false;
+		}
+	}
+	while (p < pattern.size() && pattern[p] == '*')
+		p++;
+	return p == pattern.size();
+}
+
+static uint32_t filter_child(PathFilter &filter, uint32_t node, const std::string &component)
+{
+	if (component == "**")
+	{
+		if (!filter.nodes[node].globstar)
+		{
+			filter.nodes.emplace_back();
+			filter.nodes.back().repeats = true;
+			filter.nodes[node].globstar = uint32_t(filter.nodes.size() - 1);
+		}
+		return filter.nodes[node].globstar;
+	}
+	bool glob = component.find_first_of("*?") != std::string::npos;
+	if (glob)
+	{
+		for (auto &child : filter.nodes[node].globs)
+		{
+			if (child.first == component)
+				return child.second;
+		}
+	}
+	else
+	{
+		auto it = filter.nodes[node].literals.find(component);
+		if (it != filter.nodes[node].literals.end())
+			return it->second;
+	}
+	uint32_t child = uint32_t(filter.nodes.size());
+	filter.nodes.emplace_back();
+	if (glob)
+		filter.nodes[node].globs.emplace_back(component, child);
+	else
+		filter.nodes[node].literals.emplace(component, child);
+	return child;
+}
+
+static bool compile_path_filter(PathFilter &filter, const std::vector<FilterRule> &rules)
+{
+	filter.nodes.assign(1, FilterNode());
+	for (size_t i = 0; i < rules.size(); i++)
+	{
+		std::vector<std::string> components;
+		std::string component;
+		bool anchored = false;
+		const std::string &pattern = rules[i].pattern;
+		for (size_t c = 0; c <= pattern.size(); c++)
+		{
+			if (c == pattern.size() || is_path_separator(pattern[c]))
+			{
+				// Only a separator before the end anchors the pattern.
+				if (c < pattern.size() && c + 1 < pattern.size())
+					anchored = true;
+				if (!component.empty())
+					components.push_back(component);
+				component.clear();
+			}
+			else
+			{
+				component += lower_ascii(pattern[c]);
+			}
+		}
+		if (components.empty())
+		{
+			fprintf(stderr, "Empty filter pattern '%s'\n", pattern.c_str());
+			return false;
+		}
+		if (!anchored && components.front() != "**")
+			components.insert(components.begin(), "**");
+
+		uint32_t node = 0;
+		for (auto &part : components)
+			node = filter_child(filter, node, part);
+		filter.nodes[node].rule = int32_t(i);
+		filter.nodes[node].exclude = rules[i].exclude;
+	}
+	return true;
+}
+
+static void add_filter_node(const PathFilter &filter, std::vector<uint32_t> &set, uint32_t node)
+{
+	if (std::find(set.begin(), set.end(), node) != set.end())
+		return;
+	set.push_back(node);
+	// A ** can also match no components at all.
+	if (filter.nodes[node].globstar)
+		add_filter_node(filter, set, filter.nodes[node].globstar);
+}
+
+static bool path_excluded(const PathFilter &filter, std::string_view path)
+{
+	if (filter.nodes.size() <= 1)
+		return false;
+	std::vector<uint32_t> &active = filter.active;
+	std::vector<uint32_t> &next = filter.next;
+	active.clear();
+	add_filter_node(filter, active, 0);
+	size_t begin = 0;
+	while (begin < path.size())
+	{
+		size_t end = begin;
+		while (end < path.size() && !is_path_separator(path[end]))
+			end++;
+		filter.lowered.assign(path.data() + begin, end - begin);
+		for (char &c : filter.lowered)
+			c = lower_ascii(c);
+		std::string_view component = filter.lowered;
+		begin = end + 1;
+		if (component.empty())
+			continue;
+
+		next.clear();
+		for (uint32_t index : active)
+		{
+			const FilterNode &node = filter.nodes[index];
+			if (node.repeats)
+				add_filter_node(filter, next, index);
+			auto it = node.literals.find(component);
+			if (it != node.literals.end())
+				add_filter_node(filter, next, it->second);
+			for (auto &glob : node.globs)
+			{
+				if (glob_match(glob.first, component))
+					add_filter_node(filter, next, glob.second);
+			}
+		}
+		if (next.empty())
+			return false;
+
+		// The prefix so far names this path or one of its parents.
+		int32_t rule = -1;
+		bool exclude = false;
+		for (uint32_t index : next)
+		{
+			if (filter.nodes[index].rule > rule)
+			{
+				rule = filter.nodes[index].rule;
+				exclude = filter.nodes[index].exclude;
+			}
+		}
+		if (exclude)
+			return true;
+		active.swap(next);
+	}
+	return false;
+}
@@ -0,0 +1,388 @@
+#pragma once
+
+#include "win_global.h"
+#include <winioctl.h>
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "change_batch.h"
+#include "path_filter.h"
+#include "stats.h"
+
+// Watches whole NTFS volumes through their change journal instead of one
+// ReadDirectoryChangesW per root. Starting costs the same however many
+// directories there are: reading begins at the journal's next USN and
+// nothing is walked. Reading the journal needs administrator rights.
+//
+// A record names a file by its reference number and gives its name and its
+// parent directory's reference number. Directories are resolved to paths
+// with OpenFileById and cached, and records outside every root are dropped
+// here. Renaming or deleting a directory clears the cache, since every
+// path cached below it is stale.
+
+#define USN_BUFFER_SIZE (1 << 16)
+#define USN_CACHE_MAX (1 << 20)
+#define USN_REASONS (USN_REASON_DATA_OVERWRITE | USN_REASON_DATA_EXTEND | USN_REASON_DATA_TRUNCATION \
+	| USN_REASON_FILE_CREATE | USN_REASON_FILE_DELETE | USN_REASON_RENAME_OLD_NAME | USN_REASON_RENAME_NEW_NAME)
+
+// A directory's place below the roots; root is -1 outside all of them.
+struct UsnDirectory
+{
+	int32_t root;
+	std::string relative;
+};
+
+struct UsnVolume
+{
+	std::wstring name;
+	// The final path of each root on this volume, empty for roots on
+	// other volumes.
+	std::vector<std::string> root_paths;
+	HANDLE handle = INVALID_HANDLE_VALUE;
+	OVERLAPPED ol;
+	READ_USN_JOURNAL_DATA_V0 read;
+	std::vector<uint64_t> records;
+	std::unordered_map<uint64_t, UsnDirectory> directories;
+	// The old name of a rename, until the record with the new name.
+	uint64_t renamed_file = 0;
+	int32_t renamed_root = -1;
+	std::string renamed_name;
+	std::string name_buffer;
+	std::wstring path_buffer;
+};
+
+// The path GetFinalPathNameByHandle gives for an open file, which is what
+// paths of resolved directories are compared against.
+static bool final_path(HANDLE handle, std::wstring &path)
+{
+	path.resize(4096);
+	DWORD size = GetFinalPathNameByHandleW(handle, &path[0], DWORD(path.size()), 0);
+	if (!size || size >= path.size())
+		return false;
+	path.resize(size);
+	return true;
+}
+
+// The volume a directory is on, as a name CreateFile opens the volume by,
+// and the directory's final path.
+static bool locate_root(const std::string &directory, std::wstring &volume, std::string &path)
+{
+	std::wstring wide = s2ws(directory);
+	wchar_t mount_point[MAX_PATH];
+	wchar_t name[MAX_PATH];
+	if (!GetVolumePathNameW(wide.c_str(), mount_point, MAX_PATH)
+		|| !GetVolumeNameForVolumeMountPointW(mount_point, name, MAX_PATH))
+	{
+		fprintf(stderr, "Failed to find the volume of %s: %s\n", directory.c_str(), error_to_string(GetLastError()).c_str());
+		return false;
+	}
+	volume = name;
+	// \\?\Volume{guid}\ opens the root directory, without the separator
+	// the volume itself.
+	if (!volume.empty() && volume.back() == L'\\')
+		volume.pop_back();
+
+	HANDLE handle = CreateFileW(wide.c_str(), FILE_READ_ATTRIBUTES,
+		FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, NULL);
+	if (handle == INVALID_HANDLE_VALUE)
+	{
+		fprintf(stderr, "Failed to open directory %s: %s\n", directory.c_str(), error_to_string(GetLastError()).c_str());
+		return false;
+	}
+	bool found = final_path(handle, wide);
+	CloseHandle(handle);
+	if (!found)
+	{
+		fprintf(stderr, "Failed to find the path of %s\n", directory.c_str());
+		return false;
+	}
+	path = sw2s(wide);
+	if (!path.empty() && path.back() == '\\')
+		path.pop_back();
+	return true;
+}
+
+// The handle is overlapped, so even this quick query needs an event. The
+// low bit of the event keeps the completion off the completion port.
+static bool query_usn_journal(UsnVolume &volume, USN_JOURNAL_DATA_V0 &journal)
+{
+	OVERLAPPED ol;
+	memset(&ol, 0, sizeof(ol));
+	HANDLE event = CreateEventW(NULL, TRUE, FALSE, NULL);
+	ol.hEvent = HANDLE(ULONG_PTR(event) | 1);
+	DWORD bytes;
+	bool queried = DeviceIoControl(volume.handle, FSCTL_QUERY_USN_JOURNAL, NULL, 0, &journal, sizeof(journal), &bytes, &ol)
+		|| (GetLastError() == ERROR_IO_PENDING && GetOverlappedResult(volume.handle, &ol, &bytes, TRUE));
+	DWORD error = GetLastError();
+	CloseHandle(event);
+	SetLastError(error);
+	return queried;
+}
+
+// Starts reading at the end of the journal, so only changes from now on
+// are seen.
+static bool open_usn_volume(UsnVolume &volume)
+{
+	volume.handle = CreateFileW(volume.name.c_str(),
+		GENERIC_READ,
+		FILE_SHARE_READ | FILE_SHARE_WRITE,
+		NULL,
+		OPEN_EXISTING,
+		FILE_FLAG_OVERLAPPED,
+		NULL);
+	std::string name = sw2s(volume.name);
+	if (volume.handle == INVALID_HANDLE_VALUE)
+	{
+		fprintf(stderr, "Failed to open volume %s: %s\n", name.c_str(), error_to_string(GetLastError()).c_str());
+		return false;
+	}
+	USN_JOURNAL_DATA_V0 journal;
+	if (!query_usn_journal(volume, journal))
+	{
+		DWORD error = GetLastError();
+		if (error == ERROR_JOURNAL_NOT_ACTIVE)
+			fprintf(stderr, "Volume %s has no change journal; create one with fsutil usn createjournal\n", name.c_str());
+		else
+			fprintf(stderr, "Failed to query the change journal of %s: %s\n", name.c_str(), error_to_string(error).c_str());
+		return false;
+	}
+	memset(&volume.read, 0, sizeof(volume.read));
+	volume.read.StartUsn = journal.NextUsn;
+	volume.read.ReasonMask = USN_REASONS;
+	volume.read.ReturnOnlyOnClose = FALSE;
+	volume.read.Timeout = 0;
+	volume.read.BytesToWaitFor = 1;
+	volume.read.UsnJournalID = journal.UsnJournalID;
+	volume.records.resize(USN_BUFFER_SIZE / sizeof(uint64_t));
+	memset(&volume.ol, 0, sizeof(volume.ol));
+	return true;
+}
+
+// One volume per distinct volume the roots are on.
+static bool open_usn_volumes(const std::vector<std::string> &directories, std::vector<UsnVolume> &volumes)
+{
+	for (size_t i = 0; i < directories.size(); i++)
+	{
+		std::wstring name;
+		std::string path;
+		if (!locate_root(directories[i], name, path))
+			return false;
+		auto volume = std::find_if(volumes.begin(), volumes.end(), [&](const UsnVolume &v) { return v.name == name; });
+		if (volume == volumes.end())
+		{
+			volumes.emplace_back();
+			volume = volumes.end() - 1;
+			volume->name = name;
+			volume->root_paths.resize(directories.size());
+			if (!open_usn_volume(*volume))
+				return false;
+		}
+		volume->root_paths[i] = path;
+	}
+	return true;
+}
+
+// Skips the records that were overwritten before they could be read.
+static void skip_lost_usn_records(UsnVolume &volume)
+{
+	fprintf(stderr, "The change journal of %s overflowed, events were lost\n", sw2s(volume.name).c_str());
+	USN_JOURNAL_DATA_V0 journal;
+	if (query_usn_journal(volume, journal))
+		volume.read.StartUsn = journal.NextUsn;
+	volume.directories.clear();
+	volume.renamed_file = 0;
+}
+
+// Completes once there is at least one record after StartUsn.
+static bool read_usn_journal(UsnVolume &volume)
+{
+	while (!DeviceIoControl(volume.handle, FSCTL_READ_USN_JOURNAL, &volume.read, sizeof(volume.read),
+		volume.records.data(), DWORD(volume.records.size() * sizeof(uint64_t)), NULL, &volume.ol))
+	{
+		DWORD error = GetLastError();
+		if (error == ERROR_IO_PENDING)
+			break;
+		if (error == ERROR_JOURNAL_ENTRY_DELETED)
+		{
+			skip_lost_usn_records(volume);
+		}
+		else
+		{
+			fprintf(stderr, "Reading the change journal of %s failed: %s\n", sw2s(volume.name).c_str(), error_to_string(error).c_str());
+			return false;
+		}
+	}
+	return true;
+}
+
+// The root and relative path below it, if path is a root or inside one.
+// Both come from GetFinalPathNameByHandle, so they agree on case and form.
+static int32_t root_of(const UsnVolume &volume, std::string_view path, std::string &relative)
+{
+	for (size_t i = 0; i < volume.root_paths.size(); i++)
+	{
+		std::string_view root = volume.root_paths[i];
+		if (root.empty() || path.size() < root.size() || path.compare(0, root.size(), root) != 0)
+			continue;
+		if (path.size() == root.size())
+		{
+			relative.clear();
+			return int32_t(i);
+		}
+		if (path[root.size()] == '\\')
+		{
+			relative.assign(path.substr(root.size() + 1));
+			return int32_t(i);
+		}
+	}
+	return -1;
+}
+
+static const UsnDirectory &resolve_usn_directory(UsnVolume &volume, uint64_t reference)
+{
+	auto found = volume.directories.find(reference);
+	if (found != volume.directories.end())
+		return found->second;
+	if (volume.directories.size() >= USN_CACHE_MAX)
+		volume.directories.clear();
+
+	UsnDirectory &directory = volume.directories[reference];
+	directory.root = -1;
+	FILE_ID_DESCRIPTOR id;
+	memset(&id, 0, sizeof(id));
+	id.dwSize = sizeof(id);
+	id.Type = FileIdType;
+	id.FileId.QuadPart = LONGLONG(reference);
+	// A directory that is gone stays unresolved; a new one gets a new
+	// reference number.
+	HANDLE handle = OpenFileById(volume.handle, &id, FILE_READ_ATTRIBUTES,
+		FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, FILE_FLAG_BACKUP_SEMANTICS);
+	if (handle == INVALID_HANDLE_VALUE)
+		return directory;
+	if (final_path(handle, volume.path_buffer))
+		directory.root = root_of(volume, sw2s(volume.path_buffer), directory.relative);
+	CloseHandle(handle);
+	return directory;
+}
+
+// The record's path relative to its root into name; -1 if it is outside
+// every root.
+static int32_t usn_record_path(UsnVolume &volume, const USN_RECORD_V2 *record, std::string &name)
+{
+	const UsnDirectory &parent = resolve_usn_directory(volume, record->ParentFileReferenceNumber);
+	if (parent.root < 0)
+		return -1;
+	const wchar_t *file_name = reinterpret_cast<const wchar_t *>(reinterpret_cast<const uint8_t *>(record) + record->FileNameOffset);
+	int chars = int(record->FileNameLength / sizeof(wchar_t));
+	name.assign(parent.relative);
+	if (!name.empty())
+		name += '\\';
+	size_t start = name.size();
+	name.resize(start + size_t(chars) * 3);
+	int size = WideCharToMultiByte(CP_UTF8, 0, file_name, chars, &name[start], chars * 3, NULL, NULL);
+	name.resize(start + size_t(size));
+	return parent.root;
+}
+
+static bool add_usn_change(ChangeBatch &batch, const PathFilter &filter, int32_t root, ChangeAction action, const std::string &name)
+{
+	if (root < 0)
+		return false;
+	if (path_excluded(filter, name))
+	{
+		stats_add(Counter::ChangesFiltered, 1);
+		return false;
+	}
+	batch.add(uint32_t(root), action, name.data(), name.size());
+	return true;
+}
+
+// An old name without a new one is as good as a delete.
+static void flush_usn_rename(UsnVolume &volume, ChangeBatch &batch, const PathFilter &filter)
+{
+	if (!volume.renamed_file)
+		return;
+	add_usn_change(batch, filter, volume.renamed_root, ChangeAction::Removed, volume.renamed_name);
+	volume.renamed_file = 0;
+}
+
+static void add_usn_record(UsnVolume &volume, ChangeBatch &batch, const PathFilter &filter, const USN_RECORD_V2 *record)
+{
+	DWORD reason = record->Reason;
+	bool directory = (record->FileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0;
+	if (reason & USN_REASON_RENAME_OLD_NAME)
+	{
+		flush_usn_rename(volume, batch, filter);
+		volume.renamed_file = record->FileReferenceNumber;
+		volume.renamed_root = usn_record_path(volume, record, volume.renamed_name);
+		return;
+	}
+
+	int32_t root = usn_record_path(volume, record, volume.name_buffer);
+	const std::string &name = volume.name_buffer;
+	if ((reason & USN_REASON_RENAME_NEW_NAME) && volume.renamed_file == record->FileReferenceNumber)
+	{
+		volume.renamed_file = 0;
+		if (directory)
+			volume.directories.clear();
+		// A rename across roots, or into or out of an excluded path, is a
+		// delete and a create as far as the server can tell.
+		bool from = volume.renamed_root >= 0 && !path_excluded(filter, volume.renamed_name);
+		bool to = root >= 0 && !path_excluded(filter, name);
+		if (from && to && volume.renamed_root == root)
+		{
+			batch.add(uint32_t(root), ChangeAction::RenamedOldName, volume.renamed_name.data(), volume.renamed_name.size());
+			batch.add(uint32_t(root), ChangeAction::RenamedNewName, name.data(), name.size());
+			return;
+		}
+		add_usn_change(batch, filter, volume.renamed_root, ChangeAction::Removed, volume.renamed_name);
+		add_usn_change(batch, filter, root, ChangeAction::Added, name);
+		return;
+	}
+	flush_usn_rename(volume, batch, filter);
+
+	if (reason & USN_REASON_FILE_DELETE)
+	{
+		if (directory)
+			volume.directories.clear();
+		add_usn_change(batch, filter, root, ChangeAction::Removed, name);
+	}
+	else if (reason & USN_REASON_FILE_CREATE)
+	{
+		add_usn_change(batch, filter, root, ChangeAction::Added, name);
+	}
+	else if (!directory)
+	{
+		// Reasons add up until the file is closed, so a file renamed
+		// earlier shows up here once it is written to.
+		add_usn_change(batch, filter, root, ChangeAction::Modified, name);
+	}
+}
+
+// The buffer holds the USN to continue from, then whole records.
+static void add_usn_records(UsnVolume &volume, ChangeBatch &batch, const PathFilter &filter, DWORD bytes_read)
+{
+	if (bytes_read < sizeof(USN))
+		return;
+	const uint8_t *buffer = reinterpret_cast<const uint8_t *>(volume.records.data());
+	memcpy(&volume.read.StartUsn, buffer, sizeof(USN));
+	DWORD offset = sizeof(USN);
+	while (offset + offsetof(USN_RECORD_V2, FileName) <= bytes_read)
+	{
+		const USN_RECORD_V2 *record = reinterpret_cast<const USN_RECORD_V2 *>(buffer + offset);
+		if (record->RecordLength == 0 || offset + record->RecordLength > bytes_read)
+			break;
+		offset += record->RecordLength;
+		if (record->MajorVersion == 2)
+			add_usn_record(volume, batch, filter, record);
+	}
+}
@@ -1,3 +1,5 @@
+#pragma once
+
 #define WIN32_LEAN_AND_MEAN
 #define NOMINMAX
 #include <windows.h>
@@ -17,6 +19,16 @@ static std::wstring s2ws(const std::string& s)
 	return r;
 }
 
+// Converts into a buffer owned by the caller, so repeated calls do not
+// allocate once the buffer is large enough.
+static const wchar_t *s2ws(const char *s, size_t size, std::wstring &target)
+{
+	int len = MultiByteToWideChar(CP_UTF8, 0, s, int(size), 0, 0);
+	target.resize(size_t(len));
+	MultiByteToWideChar(CP_UTF8, 0, s, int(size), &target[0], len);
+	return target.c_str();
+}
+
 static std::string sw2s(const std::wstring &s)
 {
 	int len;
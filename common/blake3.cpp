@@ -0,0 +1,368 @@
+#include "blake3.h"
+
+#include <string.h>
+
+#include <algorithm>
+#include <thread>
+
+#define CHUNK_START (1 << 0)
+#define CHUNK_END (1 << 1)
+#define PARENT (1 << 2)
+#define ROOT (1 << 3)
+
+// Subtrees smaller than this are not worth a thread.
+#define BLAKE3_PARALLEL_MIN (uint64_t(1) << 20)
+
+static const uint32_t blake3_iv[8] = {
+	0x6A09E667, 0xBB67AE85, 0x3C6EF372, 0xA54FF53A,
+	0x510E527F, 0x9B05688C, 0x1F83D9AB, 0x5BE0CD19,
+};
+
+static const uint8_t message_schedule[7][16] = {
+	{ 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 },
+	{ 2, 6, 3, 10, 7, 0, 4, 13, 1, 11, 12, 5, 9, 14, 15, 8 },
+	{ 3, 4, 10, 12, 13, 2, 7, 14, 6, 5, 9, 0, 11, 15, 8, 1 },
+	{ 10, 7, 12, 9, 14, 3, 13, 15, 4, 0, 11, 2, 5, 8, 1, 6 },
+	{ 12, 13, 9, 11, 15, 10, 14, 8, 7, 2, 5, 3, 0, 1, 6, 4 },
+	{ 9, 14, 11, 5, 8, 12, 15, 1, 13, 3, 0, 10, 2, 6, 4, 7 },
+	{ 11, 15, 5, 0, 1, 9, 8, 6, 14, 10, 2, 12, 3, 4, 7, 13 },
+};
+
+// The output of a chunk or parent node before its final compression, so the
+// caller can still decide whether it is the root.
+struct Blake3Output
+{
+	uint32_t input_cv[8];
+	uint32_t block_words[16];
+	uint64_t counter;
+	uint32_t block_len;
+	uint32_t flags;
+};
+
+static inline uint32_t rotate_right(uint32_t value, int bits)
+{
+	return (value >> bits) | (value << (32 - bits));
+}
+
+static inline uint32_t load32(const uint8_t *bytes)
+{
+	return uint32_t(bytes[0]) | (uint32_t(bytes[1]) << 8) | (uint32_t(bytes[2]) << 16) | (uint32_t(bytes[3]) << 24);
+}
+
+static inline void store32(uint8_t *bytes, uint32_t value)
+{
+	bytes[0] = uint8_t(value);
+	bytes[1] = uint8_t(value >> 8);
+	bytes[2] = uint8_t(value >> 16);
+	bytes[3] = uint8_t(value >> 24);
+}
+
+static inline void g(uint32_t *state, int a, int b, int c, int d, uint32_t x, uint32_t y)
+{
+	state[a] = state[a] + state[b] + x;
+	state[d] = rotate_right(state[d] ^ state[a], 16);
+	state[c] = state[c] + state[d];
+	state[b] = rotate_right(state[b] ^ state[c], 12);
+	state[a] = state[a] + state[b] + y;
+	state[d] = rotate_right(state[d] ^ state[a], 8);
+	state[c] = state[c] + state[d];
+	state[b] = rotate_right(state[b] ^ state[c], 7);
+}
+
+static void compress(const uint32_t cv[8], const uint32_t block_words[16], uint64_t counter, uint32_t block_len, uint32_t flags, uint32_t out[16])
+{
+	uint32_t state[16] = {
+		cv[0], cv[1], cv[2], cv[3], cv[4], cv[5], cv[6], cv[7],
+		blake3_iv[0], blake3_iv[1], blake3_iv[2], blake3_iv[3],
+		uint32_t(counter), uint32_t(counter >> 32), block_len, flags,
+	};
+	for (int round = 0; round < 7; round++)
+	{
+		const uint8_t *schedule = message_schedule[round];
+		g(state, 0, 4, 8, 12, block_words[schedule[0]], block_words[schedule[1]]);
+		g(state, 1, 5, 9, 13, block_words[schedule[2]], block_words[schedule[3]]);
+		g(state, 2, 6, 10, 14, block_words[schedule[4]], block_words[schedule[5]]);
+		g(state, 3, 7, 11, 15, block_words[schedule[6]], block_words[schedule[7]]);
+		g(state, 0, 5, 10, 15, block_words[schedule[8]], block_words[schedule[9]]);
+		g(state, 1, 6, 11, 12, block_words[schedule[10]], block_words[schedule[11]]);
+		g(state, 2, 7, 8, 13, block_words[schedule[12]], block_words[schedule[13]]);
+		g(state, 3, 4, 9, 14, block_words[schedule[14]], block_words[schedule[15]]);
+	}
+	for (int i = 0; i < 8; i++)
+	{
+		out[i] = state[i] ^ state[i + 8];
+		out[i + 8] = state[i + 8] ^ cv[i];
+	}
+}
+
+static void block_to_words(const uint8_t *block, uint32_t words[16])
+{
+	for (int i = 0; i < 16; i++)
+		words[i] = load32(block + 4 * i);
+}
+
+static void output_chaining_value(const Blake3Output &output, uint32_t cv[8])
+{
+	uint32_t out[16];
+	compress(output.input_cv, output.block_words, output.counter, output.block_len, output.flags, out);
+	memcpy(cv, out, 8 * sizeof(uint32_t));
+}
+
+static void output_root_bytes(const Blake3Output &output, uint8_t out[BLAKE3_OUT_LEN])
+{
+	uint32_t words[16];
+	compress(output.input_cv, output.block_words, 0, output.block_len, output.flags | ROOT, words);
+	for (int i = 0; i < BLAKE3_OUT_LEN / 4; i++)
+		store32(out + 4 * i, words[i]);
+}
+
+static Blake3Output parent_output(const uint32_t left_cv[8], const uint32_t right_cv[8])
+{
+	Blake3Output output;
+	memcpy(output.input_cv, blake3_iv, sizeof(output.input_cv));
+	memcpy(output.block_words, left_cv, 8 * sizeof(uint32_t));
+	memcpy(output.block_words + 8, right_cv, 8 * sizeof(uint32_t));
+	output.counter = 0;
+	output.block_len = BLAKE3_BLOCK_LEN;
+	output.flags = PARENT;
+	return output;
+}
+
+static void chunk_init(Blake3ChunkState &chunk, uint64_t chunk_counter)
+{
+	memcpy(chunk.chaining_value, blake3_iv, sizeof(chunk.chaining_value));
+	chunk.chunk_counter = chunk_counter;
+	memset(chunk.block, 0, sizeof(chunk.block));
+	chunk.block_len = 0;
+	chunk.blocks_compressed = 0;
+}
+
+static size_t chunk_len(const Blake3ChunkState &chunk)
+{
+	return BLAKE3_BLOCK_LEN * size_t(chunk.blocks_compressed) + chunk.block_len;
+}
+
+static uint32_t chunk_start_flag(const Blake3ChunkState &chunk)
+{
+	return chunk.blocks_compressed == 0 ? CHUNK_START : 0;
+}
+
+static void chunk_update(Blake3ChunkState &chunk, const uint8_t *data, size_t size)
+{
+	while (size)
+	{
+		if (chunk.block_len == BLAKE3_BLOCK_LEN)
+		{
+			uint32_t words[16];
+			uint32_t out[16];
+			block_to_words(chunk.block, words);
+			compress(chunk.chaining_value, words, chunk.chunk_counter, BLAKE3_BLOCK_LEN, chunk_start_flag(chunk), out);
+			memcpy(chunk.chaining_value, out, sizeof(chunk.chaining_value));
+			chunk.blocks_compressed++;
+			memset(chunk.block, 0, sizeof(chunk.block));
+			chunk.block_len = 0;
+		}
+		size_t take = std::min(size_t(BLAKE3_BLOCK_LEN - chunk.block_len), size);
+		memcpy(chunk.block + chunk.block_len, data, take);
+		chunk.block_len += uint8_t(take);
+		data += take;
+		size -= take;
+	}
+}
+
+static Blake3Output chunk_output(const Blake3ChunkState &chunk)
+{
+	Blake3Output output;
+	memcpy(output.input_cv, chunk.chaining_value, sizeof(output.input_cv));
+	block_to_words(chunk.block, output.block_words);
+	output.counter = chunk.chunk_counter;
+	output.block_len = chunk.block_len;
+	output.flags = chunk_start_flag(chunk) | CHUNK_END;
+	return output;
+}
+
+void blake3_init(Blake3Hasher &hasher)
+{
+	chunk_init(hasher.chunk, 0);
+	hasher.cv_stack_len = 0;
+}
+
+// Merges completed subtrees: after total_chunks chunks there is one stack
+// entry per set bit of total_chunks.
+static void add_chunk_chaining_value(Blake3Hasher &hasher, uint32_t cv[8], uint64_t total_chunks)
+{
+	while ((total_chunks & 1) == 0)
+	{
+		hasher.cv_stack_len--;
+		output_chaining_value(parent_output(hasher.cv_stack[hasher.cv_stack_len], cv), cv);
+		total_chunks >>= 1;
+	}
+	memcpy(hasher.cv_stack[hasher.cv_stack_len], cv, 8 * sizeof(uint32_t));
+	hasher.cv_stack_len++;
+}
+
+void blake3_update(Blake3Hasher &hasher, const void *data, size_t size)
+{
+	const uint8_t *bytes = static_cast<const uint8_t *>(data);
+	while (size)
+	{
+		if (chunk_len(hasher.chunk) == BLAKE3_CHUNK_LEN)
+		{
+			uint32_t cv[8];
+			output_chaining_value(chunk_output(hasher.chunk), cv);
+			uint64_t total_chunks = hasher.chunk.chunk_counter + 1;
+			add_chunk_chaining_value(hasher, cv, total_chunks);
+			chunk_init(hasher.chunk, total_chunks);
+		}
+		size_t take = std::min(BLAKE3_CHUNK_LEN - chunk_len(hasher.chunk), size);
+		chunk_update(hasher.chunk, bytes, take);
+		bytes += take;
+		size -= take;
+	}
+}
+
+void blake3_final(const Blake3Hasher &hasher, uint8_t out[BLAKE3_OUT_LEN])
+{
+	Blake3Output output = chunk_output(hasher.chunk);
+	for (int remaining = hasher.cv_stack_len; remaining > 0; remaining--)
+	{
+		uint32_t cv[8];
+		output_chaining_value(output, cv);
+		output = parent_output(hasher.cv_stack[remaining - 1], cv);
+	}
+	output_root_bytes(output, out);
+}
+
+void blake3_root_from_chunks(const uint32_t (*chunk_cvs)[8], size_t count, uint8_t out[BLAKE3_OUT_LEN])
+{
+	Blake3Hasher hasher;
+	hasher.cv_stack_len = 0;
+	for (size_t i = 0; i + 1 < count; i++)
+	{
+		uint32_t cv[8];
+		memcpy(cv, chunk_cvs[i], sizeof(cv));
+		add_chunk_chaining_value(hasher, cv, i + 1);
+	}
+	Blake3Output output = parent_output(hasher.cv_stack[hasher.cv_stack_len - 1], chunk_cvs[count - 1]);
+	for (int remaining = hasher.cv_stack_len - 1; remaining > 0; remaining--)
+	{
+		uint32_t cv[8];
+		output_chaining_value(output, cv);
+		output = parent_output(hasher.cv_stack[remaining - 1], cv);
+	}
+	output_root_bytes(output, out);
+}
+
+// The left subtree holds the largest power of two number of chunks that
+// still leaves at least one byte for the right.
+static size_t left_subtree_len(size_t size)
+{
+	size_t chunks = (size - 1) / BLAKE3_CHUNK_LEN;
+	size_t left = 1;
+	while (left * 2 <= chunks)
+		left *= 2;
+	return left * BLAKE3_CHUNK_LEN;
+}
+
+static Blake3Output subtree_output(const uint8_t *data, size_t size, uint64_t chunk_counter, unsigned threads);
+
+static void subtree_chaining_value(const uint8_t *data, size_t size, uint64_t chunk_counter, unsigned threads, uint32_t cv[8])
+{
+	output_chaining_value(subtree_output(data, size, chunk_counter, threads), cv);
+}
+
+static Blake3Output subtree_output(const uint8_t *data, size_t size, uint64_t chunk_counter, unsigned threads)
+{
+	if (size <= BLAKE3_CHUNK_LEN)
+	{
+		Blake3ChunkState chunk;
+		chunk_init(chunk, chunk_counter);
+		chunk_update(chunk, data, size);
+		return chunk_output(chunk);
+	}
+
+	size_t left_size = left_subtree_len(size);
+	uint64_t right_counter = chunk_counter + left_size / BLAKE3_CHUNK_LEN;
+	uint32_t left_cv[8];
+	uint32_t right_cv[8];
+	if (threads > 1 && size >= 2 * BLAKE3_PARALLEL_MIN)
+	{
+		unsigned left_threads = threads / 2;
+		std::thread left([=, &left_cv] {
+			subtree_chaining_value(data, left_size, chunk_counter, left_threads, left_cv);
+		});
+		subtree_chaining_value(data + left_size, size - left_size, right_counter, threads - left_threads, right_cv);
+		left.join();
+	}
+	else if (size >= BLAKE3_PARALLEL_MIN)
+	{
+		subtree_chaining_value(data, left_size, chunk_counter, 1, left_cv);
+		subtree_chaining_value(data + left_size, size - left_size, right_counter, 1, right_cv);
+	}
+	else
+	{
+		// Small enough that the incremental stack is cheaper than recursion.
+		Blake3Hasher hasher;
+		blake3_init(hasher);
+		hasher.chunk.chunk_counter = chunk_counter;
+		for (size_t offset = 0; offset < size; offset += BLAKE3_CHUNK_LEN)
+		{
+			Blake3ChunkState chunk;
+			chunk_init(chunk, chunk_counter + offset / BLAKE3_CHUNK_LEN);
+			chunk_update(chunk, data + offset, std::min(size_t(BLAKE3_CHUNK_LEN), size - offset));
+			if (offset + BLAKE3_CHUNK_LEN >= size)
+			{
+				hasher.chunk = chunk;
+				break;
+			}
+			uint32_t cv[8];
+			output_chaining_value(chunk_output(chunk), cv);
+			add_chunk_chaining_value(hasher, cv, offset / BLAKE3_CHUNK_LEN + 1);
+		}
+		Blake3Output output = chunk_output(hasher.chunk);
+		for (int remaining = hasher.cv_stack_len; remaining > 0; remaining--)
+		{
+			uint32_t cv[8];
+			output_chaining_value(output, cv);
+			output = parent_output(hasher.cv_stack[remaining - 1], cv);
+		}
+		return output;
+	}
+	return parent_output(left_cv, right_cv);
+}
+
+// The incremental hasher holds one complete subtree per set bit of the
+// number of finished chunks, largest first, and keeps the last chunk open
+// even when it is full. Each of those subtrees is hashed with the threaded
+// tree code.
+void blake3_update_parallel(Blake3Hasher &hasher, const void *data, size_t size, unsigned threads)
+{
+	if (!threads)
+		threads = std::max(1u, std::thread::hardware_concurrency());
+	const uint8_t *bytes = static_cast<const uint8_t *>(data);
+	if (!size)
+		return;
+	uint64_t finished_chunks = (size - 1) / BLAKE3_CHUNK_LEN;
+	uint64_t chunk_counter = 0;
+	for (int bit = 63; bit >= 0; bit--)
+	{
+		uint64_t chunks = uint64_t(1) << bit;
+		if (!(finished_chunks & chunks))
+			continue;
+		size_t subtree_size = size_t(chunks * BLAKE3_CHUNK_LEN);
+		subtree_chaining_value(bytes, subtree_size, chunk_counter, threads, hasher.cv_stack[hasher.cv_stack_len]);
+		hasher.cv_stack_len++;
+		bytes += subtree_size;
+		size -= subtree_size;
+		chunk_counter += chunks;
+	}
+	chunk_init(hasher.chunk, chunk_counter);
+	chunk_update(hasher.chunk, bytes, size);
+}
+
+void blake3_hash(const void *data, size_t size, uint8_t out[BLAKE3_OUT_LEN], unsigned threads)
+{
+	if (!threads)
+		threads = std::max(1u, std::thread::hardware_concurrency());
+	output_root_bytes(subtree_output(static_cast<const uint8_t *>(data), size, 0, threads), out);
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Portable BLAKE3 (unkeyed hash mode, 32 byte output).
+//
+// Blake3Hasher is the incremental form for data that arrives in pieces.
+// blake3_hash() hashes a buffer in one go and splits large inputs along
+// BLAKE3's chunk tree, hashing subtrees on separate threads.
+
+#define BLAKE3_OUT_LEN 32
+#define BLAKE3_BLOCK_LEN 64
+#define BLAKE3_CHUNK_LEN 1024
+#define BLAKE3_MAX_DEPTH 54
+
+struct Blake3ChunkState
+{
+	uint32_t chaining_value[8];
+	uint64_t chunk_counter;
+	uint8_t block[BLAKE3_BLOCK_LEN];
+	uint8_t block_len;
+	uint8_t blocks_compressed;
+};
+
+struct Blake3Hasher
+{
+	Blake3ChunkState chunk;
+	uint32_t cv_stack[BLAKE3_MAX_DEPTH][8];
+	uint8_t cv_stack_len;
+};
+
+void blake3_init(Blake3Hasher &hasher);
+void blake3_update(Blake3Hasher &hasher, const void *data, size_t size);
+void blake3_final(const Blake3Hasher &hasher, uint8_t out[BLAKE3_OUT_LEN]);
+
+// Hashes data into a freshly initialised hasher the way blake3_hash() does,
+// but leaves it open so more data can be added with blake3_update().
+void blake3_update_parallel(Blake3Hasher &hasher, const void *data, size_t size, unsigned threads);
+
+// threads of 0 uses every core. Inputs below a few MB are hashed on the
+// calling thread whatever threads is.
+void blake3_hash(const void *data, size_t size, uint8_t out[BLAKE3_OUT_LEN], unsigned threads);
+
+// The root hash of a message of count >= 2 chunks from the chaining values of
+// its chunks, for chunks hashed elsewhere (see hash_batch.h).
+void blake3_root_from_chunks(const uint32_t (*chunk_cvs)[8], size_t count, uint8_t out[BLAKE3_OUT_LEN]);
@@ -0,0 +1,471 @@
+#include "hash_batch.h"
+
+#include <string.h>
+
+#include <algorithm>
+#include <vector>
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define HASH_BATCH_X86 1
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
+#define HASH_MAX_LANES 16
+
+#define CHUNK_START (1 << 0)
+#define CHUNK_END (1 << 1)
+#define ROOT (1 << 3)
+
+static const uint32_t sha1_iv[5] = { 0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0 };
+
+static const uint32_t blake3_lane_iv[8] = {
+	0x6A09E667, 0xBB67AE85, 0x3C6EF372, 0xA54FF53A,
+	0x510E527F, 0x9B05688C, 0x1F83D9AB, 0x5BE0CD19,
+};
+
+static const uint8_t blake3_lane_schedule[7][16] = {
+	{ 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 },
+	{ 2, 6, 3, 10, 7, 0, 4, 13, 1, 11, 12, 5, 9, 14, 15, 8 },
+	{ 3, 4, 10, 12, 13, 2, 7, 14, 6, 5, 9, 0, 11, 15, 8, 1 },
+	{ 10, 7, 12, 9, 14, 3, 13, 15, 4, 0, 11, 2, 5, 8, 1, 6 },
+	{ 12, 13, 9, 11, 15, 10, 14, 8, 7, 2, 5, 3, 0, 1, 6, 4 },
+	{ 9, 14, 11, 5, 8, 12, 15, 1, 13, 3, 0, 10, 2, 6, 4, 7 },
+	{ 11, 15, 5, 0, 1, 9, 8, 6, 14, 10, 2, 12, 3, 4, 7, 13 },
+};
+
+// Portable single lane, used where there is no vector unit we know of.
+#define HASH_LANES 1
+#define HASH_KERNEL(name) name##_scalar
+#define V uint32_t
+#define V_LOAD(p) (*(p))
+#define V_STORE(p, v) (*(p) = (v))
+#define V_SET1(x) uint32_t(x)
+#define V_ADD(a, b) uint32_t((a) + (b))
+#define V_XOR(a, b) ((a) ^ (b))
+#define V_AND(a, b) ((a) & (b))
+#define V_OR(a, b) ((a) | (b))
+#define V_ANDNOT(a, b) (~(a) & (b))
+#define V_SHL(v, n) uint32_t((v) << (n))
+#define V_SHR(v, n) ((v) >> (n))
+#include "hash_lanes.inl"
+#undef HASH_LANES
+#undef HASH_KERNEL
+#undef V
+#undef V_LOAD
+#undef V_STORE
+#undef V_SET1
+#undef V_ADD
+#undef V_XOR
+#undef V_AND
+#undef V_OR
+#undef V_ANDNOT
+#undef V_SHL
+#undef V_SHR
+
+#ifdef HASH_BATCH_X86
+// SSE2 is part of x86-64, so it needs no target switch.
+#define HASH_LANES 4
+#define HASH_KERNEL(name) name##_sse2
+#define V __m128i
+#define V_LOAD(p) _mm_loadu_si128((const __m128i *)(p))
+#define V_STORE(p, v) _mm_storeu_si128((__m128i *)(p), v)
+#define V_SET1(x) _mm_set1_epi32(int(x))
+#define V_ADD(a, b) _mm_add_epi32(a, b)
+#define V_XOR(a, b) _mm_xor_si128(a, b)
+#define V_AND(a, b) _mm_and_si128(a, b)
+#define V_OR(a, b) _mm_or_si128(a, b)
+#define V_ANDNOT(a, b) _mm_andnot_si128(a, b)
+#define V_SHL(v, n) _mm_slli_epi32(v, n)
+#define V_SHR(v, n) _mm_srli_epi32(v, n)
+#include "hash_lanes.inl"
+#undef HASH_LANES
+#undef HASH_KERNEL
+#undef V
+#undef V_LOAD
+#undef V_STORE
+#undef V_SET1
+#undef V_ADD
+#undef V_XOR
+#undef V_AND
+#undef V_OR
+#undef V_ANDNOT
+#undef V_SHL
+#undef V_SHR
+
+// GCC and Clang only emit AVX code in functions built for it. MSVC needs
+// nothing; the kernels are only called once the CPU says it has the
+// instructions.
+#if defined(__clang__)
+#pragma clang attribute push(__attribute__((target("avx2"))), apply_to = function)
+#elif defined(__GNUC__)
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#endif
+#define HASH_LANES 8
+#define HASH_KERNEL(name) name##_avx2
+#define V __m256i
+#define V_LOAD(p) _mm256_loadu_si256((const __m256i *)(p))
+#define V_STORE(p, v) _mm256_storeu_si256((__m256i *)(p), v)
+#define V_SET1(x) _mm256_set1_epi32(int(x))
+#define V_ADD(a, b) _mm256_add_epi32(a, b)
+#define V_XOR(a, b) _mm256_xor_si256(a, b)
+#define V_AND(a, b) _mm256_and_si256(a, b)
+#define V_OR(a, b) _mm256_or_si256(a, b)
+#define V_ANDNOT(a, b) _mm256_andnot_si256(a, b)
+#define V_SHL(v, n) _mm256_slli_epi32(v, n)
+#define V_SHR(v, n) _mm256_srli_epi32(v, n)
+#include "hash_lanes.inl"
+#undef HASH_LANES
+#undef HASH_KERNEL
+#undef V
+#undef V_LOAD
+#undef V_STORE
+#undef V_SET1
+#undef V_ADD
+#undef V_XOR
+#undef V_AND
+#undef V_OR
+#undef V_ANDNOT
+#undef V_SHL
+#undef V_SHR
+#if defined(__clang__)
+#pragma clang attribute pop
+#elif defined(__GNUC__)
+#pragma GCC pop_options
+#endif
+
+#if defined(__clang__)
+#pragma clang attribute push(__attribute__((target("avx512f"))), apply_to = function)
+#elif defined(__GNUC__)
+#pragma GCC push_options
+#pragma GCC target("avx512f")
+#endif
+#define HASH_LANES 16
+#define HASH_KERNEL(name) name##_avx512
+#define V __m512i
+#define V_LOAD(p) _mm512_loadu_si512((const void *)(p))
+#define V_STORE(p, v) _mm512_storeu_si512((void *)(p), v)
+#define V_SET1(x) _mm512_set1_epi32(int(x))
+#define V_ADD(a, b) _mm512_add_epi32(a, b)
+#define V_XOR(a, b) _mm512_xor_si512(a, b)
+#define V_AND(a, b) _mm512_and_si512(a, b)
+#define V_OR(a, b) _mm512_or_si512(a, b)
+#define V_ANDNOT(a, b) _mm512_andnot_si512(a, b)
+#define V_SHL(v, n) _mm512_slli_epi32(v, n)
+#define V_SHR(v, n) _mm512_srli_epi32(v, n)
+#include "hash_lanes.inl"
+#undef HASH_LANES
+#undef HASH_KERNEL
+#undef V
+#undef V_LOAD
+#undef V_STORE
+#undef V_SET1
+#undef V_ADD
+#undef V_XOR
+#undef V_AND
+#undef V_OR
+#undef V_ANDNOT
+#undef V_SHL
+#undef V_SHR
+#if defined(__clang__)
+#pragma clang attribute pop
+#elif defined(__GNUC__)
+#pragma GCC pop_options
+#endif
+#endif
+
+typedef void (*Sha1Kernel)(uint32_t (*state)[HASH_MAX_LANES], const uint8_t *const *blocks);
+typedef void (*Blake3Kernel)(uint32_t (*cv)[HASH_MAX_LANES], const uint8_t *const *blocks,
+	const uint32_t *counter_low, const uint32_t *counter_high, const uint32_t *block_len, const uint32_t *flags);
+
+static unsigned detect_lanes()
+{
+#ifdef HASH_BATCH_X86
+#ifdef _MSC_VER
+	int info[4];
+	__cpuid(info, 0);
+	int max_leaf = info[0];
+	__cpuid(info, 1);
+	bool avx = (info[2] >> 28) & 1;
+	bool osxsave = (info[2] >> 27) & 1;
+	if (max_leaf < 7 || !avx || !osxsave)
+		return 4;
+	// The OS has to save the wider registers on a context switch.
+	uint64_t xcr0 = _xgetbv(0);
+	__cpuidex(info, 7, 0);
+	if ((xcr0 & 0xE6) == 0xE6 && ((info[1] >> 16) & 1))
+		return 16;
+	if ((xcr0 & 0x6) == 0x6 && ((info[1] >> 5) & 1))
+		return 8;
+	return 4;
+#else
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx512f"))
+		return 16;
+	if (__builtin_cpu_supports("avx2"))
+		return 8;
+	return 4;
+#endif
+#else
+	return 1;
+#endif
+}
+
+unsigned hash_batch_lanes()
+{
+	static unsigned lanes = detect_lanes();
+	return lanes;
+}
+
+// The widest kernels that fit in lanes; lanes is rounded down to them.
+static void pick_kernels(unsigned &lanes, Sha1Kernel &sha1, Blake3Kernel &blake3)
+{
+	unsigned supported = hash_batch_lanes();
+	if (!lanes || lanes > supported)
+		lanes = supported;
+#ifdef HASH_BATCH_X86
+	if (lanes >= 16)
+	{
+		lanes = 16;
+		sha1 = sha1_blocks_avx512;
+		blake3 = blake3_blocks_avx512;
+		return;
+	}
+	if (lanes >= 8)
+	{
+		lanes = 8;
+		sha1 = sha1_blocks_avx2;
+		blake3 = blake3_blocks_avx2;
+		return;
+	}
+	if (lanes >= 4)
+	{
+		lanes = 4;
+		sha1 = sha1_blocks_sse2;
+		blake3 = blake3_blocks_sse2;
+		return;
+	}
+#endif
+	lanes = 1;
+	sha1 = sha1_blocks_scalar;
+	blake3 = blake3_blocks_scalar;
+}
+
+static const uint8_t zero_block[64] = {};
+
+struct Sha1Lane
+{
+	bool busy;
+	size_t message;
+	const uint8_t *data;
+	size_t full_blocks;
+	size_t blocks;
+	size_t next;
+	// The last one or two blocks, with the padding and the length.
+	uint8_t tail[128];
+};
+
+static void sha1_start_lane(Sha1Lane &lane, size_t message, const uint8_t *data, size_t size)
+{
+	lane.busy = true;
+	lane.message = message;
+	lane.data = data;
+	lane.full_blocks = size / 64;
+	size_t rest = size % 64;
+	size_t tail_blocks = rest + 9 <= 64 ? 1 : 2;
+	lane.blocks = lane.full_blocks + tail_blocks;
+	lane.next = 0;
+	memset(lane.tail, 0, sizeof(lane.tail));
+	memcpy(lane.tail, data + lane.full_blocks * 64, rest);
+	lane.tail[rest] = 0x80;
+	uint64_t bits = uint64_t(size) * 8;
+	for (int i = 0; i < 8; i++)
+		lane.tail[tail_blocks * 64 - 1 - i] = uint8_t(bits >> (8 * i));
+}
+
+void sha1_hash_many(const uint8_t *const *data, const size_t *sizes, size_t count, uint8_t (*digests)[SHA1_DIGEST_LEN], unsigned lanes)
+{
+	Sha1Kernel kernel;
+	Blake3Kernel unused;
+	pick_kernels(lanes, kernel, unused);
+
+	alignas(64) uint32_t state[5][HASH_MAX_LANES];
+	const uint8_t *blocks[HASH_MAX_LANES];
+	Sha1Lane lane_state[HASH_MAX_LANES];
+	for (unsigned l = 0; l < lanes; l++)
+		lane_state[l].busy = false;
+	size_t next_message = 0;
+	while (true)
+	{
+		bool busy = false;
+		for (unsigned l = 0; l < lanes; l++)
+		{
+			Sha1Lane &lane = lane_state[l];
+			if (!lane.busy && next_message < count)
+			{
+				sha1_start_lane(lane, next_message, data[next_message], sizes[next_message]);
+				next_message++;
+				for (int i = 0; i < 5; i++)
+					state[i][l] = sha1_iv[i];
+			}
+			busy = busy || lane.busy;
+			if (!lane.busy)
+				blocks[l] = zero_block;
+			else if (lane.next < lane.full_blocks)
+				blocks[l] = lane.data + lane.next * 64;
+			else
+				blocks[l] = lane.tail + (lane.next - lane.full_blocks) * 64;
+		}
+		if (!busy)
+			break;
+		kernel(state, blocks);
+		for (unsigned l = 0; l < lanes; l++)
+		{
+			Sha1Lane &lane = lane_state[l];
+			if (!lane.busy || ++lane.next < lane.blocks)
+				continue;
+			for (int i = 0; i < 5; i++)
+			{
+				uint32_t word = state[i][l];
+				uint8_t *out = digests[lane.message] + 4 * i;
+				out[0] = uint8_t(word >> 24);
+				out[1] = uint8_t(word >> 16);
+				out[2] = uint8_t(word >> 8);
+				out[3] = uint8_t(word);
+			}
+			lane.busy = false;
+		}
+	}
+}
+
+struct Blake3Lane
+{
+	bool busy;
+	size_t message;
+	uint64_t chunk;
+	const uint8_t *data;
+	size_t size;
+	size_t blocks;
+	size_t next;
+	bool root;
+	uint8_t last_block[BLAKE3_BLOCK_LEN];
+};
+
+void blake3_hash_many(const uint8_t *const *data, const size_t *sizes, size_t count, uint8_t (*digests)[BLAKE3_OUT_LEN], unsigned lanes)
+{
+	Sha1Kernel unused;
+	Blake3Kernel kernel;
+	pick_kernels(lanes, unused, kernel);
+
+	// Messages of more than one chunk keep their chunk chaining values
+	// until all of them are done, then the tree above them is hashed.
+	std::vector<size_t> first_cv(count);
+	size_t cv_count = 0;
+	for (size_t i = 0; i < count; i++)
+	{
+		size_t chunks = std::max<size_t>(1, (sizes[i] + BLAKE3_CHUNK_LEN - 1) / BLAKE3_CHUNK_LEN);
+		first_cv[i] = cv_count;
+		if (chunks > 1)
+			cv_count += chunks;
+	}
+	std::vector<uint32_t> chunk_cvs(cv_count * 8);
+
+	alignas(64) uint32_t cv[8][HASH_MAX_LANES];
+	alignas(64) uint32_t counter_low[HASH_MAX_LANES];
+	alignas(64) uint32_t counter_high[HASH_MAX_LANES];
+	alignas(64) uint32_t block_len[HASH_MAX_LANES];
+	alignas(64) uint32_t flags[HASH_MAX_LANES];
+	const uint8_t *blocks[HASH_MAX_LANES];
+	Blake3Lane lane_state[HASH_MAX_LANES];
+	for (unsigned l = 0; l < lanes; l++)
+		lane_state[l].busy = false;
+	size_t next_message = 0;
+	uint64_t next_chunk = 0;
+	while (true)
+	{
+		bool busy = false;
+		for (unsigned l = 0; l < lanes; l++)
+		{
+			Blake3Lane &lane = lane_state[l];
+			if (!lane.busy && next_message < count)
+			{
+				size_t size = sizes[next_message];
+				size_t offset = size_t(next_chunk) * BLAKE3_CHUNK_LEN;
+				lane.busy = true;
+				lane.message = next_message;
+				lane.chunk = next_chunk;
+				lane.data = data[next_message] + offset;
+				lane.size = std::min<size_t>(BLAKE3_CHUNK_LEN, size - offset);
+				lane.blocks = std::max<size_t>(1, (lane.size + BLAKE3_BLOCK_LEN - 1) / BLAKE3_BLOCK_LEN);
+				lane.next = 0;
+				lane.root = size <= BLAKE3_CHUNK_LEN;
+				size_t last_offset = (lane.blocks - 1) * BLAKE3_BLOCK_LEN;
+				memset(lane.last_block, 0, sizeof(lane.last_block));
+				memcpy(lane.last_block, lane.data + last_offset, lane.size - last_offset);
+				for (int i = 0; i < 8; i++)
+					cv[i][l] = blake3_lane_iv[i];
+				if (offset + lane.size >= size)
+				{
+					next_message++;
+					next_chunk = 0;
+				}
+				else
+				{
+					next_chunk++;
+				}
+			}
+			busy = busy || lane.busy;
+			if (!lane.busy)
+			{
+				blocks[l] = zero_block;
+				counter_low[l] = counter_high[l] = block_len[l] = flags[l] = 0;
+				continue;
+			}
+			bool last = lane.next + 1 == lane.blocks;
+			blocks[l] = last ? lane.last_block : lane.data + lane.next * BLAKE3_BLOCK_LEN;
+			counter_low[l] = uint32_t(lane.chunk);
+			counter_high[l] = uint32_t(lane.chunk >> 32);
+			block_len[l] = last ? uint32_t(lane.size - lane.next * BLAKE3_BLOCK_LEN) : BLAKE3_BLOCK_LEN;
+			flags[l] = (lane.next == 0 ? CHUNK_START : 0) | (last ? CHUNK_END : 0) | (last && lane.root ? ROOT : 0);
+		}
+		if (!busy)
+			break;
+		kernel(cv, blocks, counter_low, counter_high, block_len, flags);
+		for (unsigned l = 0; l < lanes; l++)
+		{
+			Blake3Lane &lane = lane_state[l];
+			if (!lane.busy || ++lane.next < lane.blocks)
+				continue;
+			if (lane.root)
+			{
+				for (int i = 0; i < 8; i++)
+				{
+					uint8_t *out = digests[lane.message] + 4 * i;
+					out[0] = uint8_t(cv[i][l]);
+					out[1] = uint8_t(cv[i][l] >> 8);
+					out[2] = uint8_t(cv[i][l] >> 16);
+					out[3] = uint8_t(cv[i][l] >> 24);
+				}
+			}
+			else
+			{
+				uint32_t *chunk_cv = &chunk_cvs[(first_cv[lane.message] + lane.chunk) * 8];
+				for (int i = 0; i < 8; i++)
+					chunk_cv[i] = cv[i][l];
+			}
+			lane.busy = false;
+		}
+	}
+
+	for (size_t i = 0; i < count; i++)
+	{
+		if (sizes[i] > BLAKE3_CHUNK_LEN)
+		{
+			size_t chunks = (sizes[i] + BLAKE3_CHUNK_LEN - 1) / BLAKE3_CHUNK_LEN;
+			blake3_root_from_chunks(reinterpret_cast<const uint32_t (*)[8]>(&chunk_cvs[first_cv[i] * 8]), chunks, digests[i]);
+		}
+	}
+}
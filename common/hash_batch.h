@@ -0,0 +1,25 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "blake3.h"
+
+// Hashes many independent messages at once, one per SIMD lane: 16 with
+// AVX-512, 8 with AVX2, 4 with SSE2 and 1 elsewhere. A lane that finishes
+// its message takes the next one, so messages of different sizes keep every
+// lane busy. Meant for the many small files of a batch, where hashing them
+// one at a time is dominated by the serial dependency chain of a single
+// stream.
+//
+// BLAKE3 lanes work on chunks, so a message of a few KB fills a few lanes.
+
+#define SHA1_DIGEST_LEN 20
+
+// lanes of 0 uses the widest the CPU supports; others are rounded down to an
+// instruction set.
+void sha1_hash_many(const uint8_t *const *data, const size_t *sizes, size_t count, uint8_t (*digests)[SHA1_DIGEST_LEN], unsigned lanes);
+void blake3_hash_many(const uint8_t *const *data, const size_t *sizes, size_t count, uint8_t (*digests)[BLAKE3_OUT_LEN], unsigned lanes);
+
+// Lanes of the instruction set picked for this CPU.
+unsigned hash_batch_lanes();
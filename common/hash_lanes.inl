@@ -0,0 +1,123 @@
+// SHA-1 and BLAKE3 compression across HASH_LANES independent messages, one
+// message per SIMD lane. Included by hash_batch.cpp once per instruction set
+// with these defined:
+//
+//   HASH_LANES             lanes in a vector
+//   HASH_KERNEL(name)      the function name for this instruction set
+//   V                      the vector type
+//   V_LOAD(p), V_STORE(p, v), V_SET1(x)
+//   V_ADD, V_XOR, V_AND, V_OR, V_ANDNOT(a, b) (~a & b)
+//   V_SHL(v, n), V_SHR(v, n)
+//
+// Lane l of every argument array is element l; arrays hold HASH_MAX_LANES.
+
+#define V_ROTL(v, n) V_OR(V_SHL(v, n), V_SHR(v, 32 - (n)))
+#define V_ROTR(v, n) V_OR(V_SHR(v, n), V_SHL(v, 32 - (n)))
+
+// Gathers word t of every lane's block into one vector.
+static inline void HASH_KERNEL(load_words)(const uint8_t *const *blocks, bool big_endian, V (&words)[16])
+{
+	alignas(64) uint32_t lanes[HASH_LANES];
+	for (int t = 0; t < 16; t++)
+	{
+		for (int l = 0; l < HASH_LANES; l++)
+		{
+			const uint8_t *p = blocks[l] + 4 * t;
+			lanes[l] = big_endian
+				? (uint32_t(p[0]) << 24) | (uint32_t(p[1]) << 16) | (uint32_t(p[2]) << 8) | uint32_t(p[3])
+				: uint32_t(p[0]) | (uint32_t(p[1]) << 8) | (uint32_t(p[2]) << 16) | (uint32_t(p[3]) << 24);
+		}
+		words[t] = V_LOAD(lanes);
+	}
+}
+
+static void HASH_KERNEL(sha1_blocks)(uint32_t (*state)[HASH_MAX_LANES], const uint8_t *const *blocks)
+{
+	V w[16];
+	HASH_KERNEL(load_words)(blocks, true, w);
+	V a = V_LOAD(state[0]);
+	V b = V_LOAD(state[1]);
+	V c = V_LOAD(state[2]);
+	V d = V_LOAD(state[3]);
+	V e = V_LOAD(state[4]);
+	V a0 = a, b0 = b, c0 = c, d0 = d, e0 = e;
+
+#define SHA1_SCHEDULE(t) \
+	(t < 16 ? w[t] : (w[(t) & 15] = V_ROTL(V_XOR(V_XOR(w[((t) - 3) & 15], w[((t) - 8) & 15]), V_XOR(w[((t) - 14) & 15], w[(t) & 15])), 1)))
+#define SHA1_STEP(t, f, k) \
+	{ \
+		V temp = V_ADD(V_ADD(V_ROTL(a, 5), f), V_ADD(V_ADD(e, V_SET1(k)), SHA1_SCHEDULE(t))); \
+		e = d; \
+		d = c; \
+		c = V_ROTL(b, 30); \
+		b = a; \
+		a = temp; \
+	}
+
+	for (int t = 0; t < 20; t++)
+		SHA1_STEP(t, V_OR(V_AND(b, c), V_ANDNOT(b, d)), 0x5A827999)
+	for (int t = 20; t < 40; t++)
+		SHA1_STEP(t, V_XOR(V_XOR(b, c), d), 0x6ED9EBA1)
+	for (int t = 40; t < 60; t++)
+		SHA1_STEP(t, V_OR(V_AND(b, c), V_AND(d, V_OR(b, c))), 0x8F1BBCDC)
+	for (int t = 60; t < 80; t++)
+		SHA1_STEP(t, V_XOR(V_XOR(b, c), d), 0xCA62C1D6)
+
+#undef SHA1_STEP
+#undef SHA1_SCHEDULE
+
+	V_STORE(state[0], V_ADD(a, a0));
+	V_STORE(state[1], V_ADD(b, b0));
+	V_STORE(state[2], V_ADD(c, c0));
+	V_STORE(state[3], V_ADD(d, d0));
+	V_STORE(state[4], V_ADD(e, e0));
+}
+
+// One BLAKE3 block compression per lane. Only the new chaining value is
+// kept, which for a root block is also the start of the output.
+static void HASH_KERNEL(blake3_blocks)(uint32_t (*cv)[HASH_MAX_LANES], const uint8_t *const *blocks,
+	const uint32_t *counter_low, const uint32_t *counter_high, const uint32_t *block_len, const uint32_t *flags)
+{
+	V m[16];
+	HASH_KERNEL(load_words)(blocks, false, m);
+	V v[16];
+	for (int i = 0; i < 8; i++)
+		v[i] = V_LOAD(cv[i]);
+	for (int i = 0; i < 4; i++)
+		v[8 + i] = V_SET1(blake3_lane_iv[i]);
+	v[12] = V_LOAD(counter_low);
+	v[13] = V_LOAD(counter_high);
+	v[14] = V_LOAD(block_len);
+	v[15] = V_LOAD(flags);
+
+#define BLAKE3_G(a, b, c, d, x, y) \
+	v[a] = V_ADD(V_ADD(v[a], v[b]), x); \
+	v[d] = V_ROTR(V_XOR(v[d], v[a]), 16); \
+	v[c] = V_ADD(v[c], v[d]); \
+	v[b] = V_ROTR(V_XOR(v[b], v[c]), 12); \
+	v[a] = V_ADD(V_ADD(v[a], v[b]), y); \
+	v[d] = V_ROTR(V_XOR(v[d], v[a]), 8); \
+	v[c] = V_ADD(v[c], v[d]); \
+	v[b] = V_ROTR(V_XOR(v[b], v[c]), 7);
+
+	for (int round = 0; round < 7; round++)
+	{
+		const uint8_t *s = blake3_lane_schedule[round];
+		BLAKE3_G(0, 4, 8, 12, m[s[0]], m[s[1]])
+		BLAKE3_G(1, 5, 9, 13, m[s[2]], m[s[3]])
+		BLAKE3_G(2, 6, 10, 14, m[s[4]], m[s[5]])
+		BLAKE3_G(3, 7, 11, 15, m[s[6]], m[s[7]])
+		BLAKE3_G(0, 5, 10, 15, m[s[8]], m[s[9]])
+		BLAKE3_G(1, 6, 11, 12, m[s[10]], m[s[11]])
+		BLAKE3_G(2, 7, 8, 13, m[s[12]], m[s[13]])
+		BLAKE3_G(3, 4, 9, 14, m[s[14]], m[s[15]])
+	}
+
+#undef BLAKE3_G
+
+	for (int i = 0; i < 8; i++)
+		V_STORE(cv[i], V_XOR(v[i], v[i + 8]));
+}
+
+#undef V_ROTL
+#undef V_ROTR
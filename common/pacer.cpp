@@ -0,0 +1,56 @@
+#include "pacer.h"
+
+#include <algorithm>
+#include <chrono>
+#include <thread>
+
+#include "stats.h"
+
+void set_rate(TokenBucket &bucket, uint64_t bytes_per_second)
+{
+	bucket.rate = bytes_per_second;
+	bucket.burst = std::max(int64_t(bytes_per_second / 10), int64_t(PACING_CHUNK));
+	bucket.tokens = bucket.burst;
+	bucket.last_refill = stats_now();
+}
+
+uint64_t token_bucket_take(TokenBucket &bucket, uint64_t size, uint64_t now)
+{
+	if (!bucket.rate)
+		return 0;
+	if (now > bucket.last_refill)
+	{
+		uint64_t elapsed = now - bucket.last_refill;
+		int64_t refill = int64_t(double(elapsed) * bucket.rate / 1e9);
+		if (refill > 0)
+		{
+			bucket.tokens = std::min(bucket.tokens + refill, bucket.burst);
+			bucket.last_refill = now;
+		}
+	}
+	bucket.tokens -= int64_t(size);
+	if (bucket.tokens >= 0)
+		return 0;
+	return uint64_t(double(-bucket.tokens) * 1e9 / bucket.rate);
+}
+
+void pace(Pacer &pacer, Priority priority, uint64_t size)
+{
+	uint64_t wait = token_bucket_take(pacer.buckets[int(priority)], size, stats_now());
+	if (!wait)
+		return;
+	StatsTimer timer(Stage::Pacing);
+	std::this_thread::sleep_for(std::chrono::nanoseconds(wait));
+}
+
+uint64_t pacer_ceiling(const Pacer &pacer)
+{
+	uint64_t ceiling = 0;
+	for (auto &bucket : pacer.buckets)
+	{
+		if (!bucket.rate)
+			return 0;
+		ceiling += bucket.rate;
+	}
+	return ceiling;
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <stdint.h>
+
+// Token bucket rate limiting for outgoing data.
+//
+// Each priority class has its own bucket, so a large bulk upload paced to a
+// low rate does not also slow down small files and metadata. Buckets are
+// owned by the sending thread and are not thread safe.
+
+enum class Priority
+{
+	Interactive,
+	Bulk,
+	Count
+};
+
+// Messages with at least this much data are sent as bulk.
+#define BULK_THRESHOLD (1 << 20)
+// Paced sends are split into chunks of this size, so the wire sees a steady
+// stream instead of a burst followed by a long sleep.
+#define PACING_CHUNK (64 * 1024)
+
+struct TokenBucket
+{
+	uint64_t rate = 0;
+	int64_t burst = 0;
+	int64_t tokens = 0;
+	uint64_t last_refill = 0;
+};
+
+struct Pacer
+{
+	TokenBucket buckets[int(Priority::Count)];
+};
+
+// A rate of 0 disables limiting for the class. The bucket starts full and
+// holds at most 100ms worth of data (at least one chunk).
+void set_rate(TokenBucket &bucket, uint64_t bytes_per_second);
+
+// Takes size bytes from the bucket, which may go into debt, and returns
+// how many nanoseconds to wait before sending them.
+uint64_t token_bucket_take(TokenBucket &bucket, uint64_t size, uint64_t now);
+
+// Blocks until size bytes may be sent for the given class.
+void pace(Pacer &pacer, Priority priority, uint64_t size);
+
+// The highest total rate the pacer allows, or 0 if any class is unlimited.
+uint64_t pacer_ceiling(const Pacer &pacer);
@@ -0,0 +1,430 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+
+#include <string_view>
+#include <type_traits>
+
+// The wire format shared by the client and the server.
+//
+// A connection opens with a hello from the client listing the content
+// hashes it can produce, most preferred first. The server answers with the
+// one it picked, or 0 if it supports none of them. Flags the client asks
+// for are echoed back if the server grants them:
+//
+//   client: magic "PHL0" | version u32 | flags u32 | count u32 | algorithm u32 [4]
+//   server: magic "PHL0" | version u32 | algorithm u32 | flags u32
+//
+// With HELLO_ACKNOWLEDGE granted the server sends acknowledgements back
+// once received messages are on disk. The count is the total number of
+// messages on this connection that are durable so far:
+//
+//   server: magic "PAK0" | count u64
+//
+// HELLO_SHARED_MEMORY is for a client on the same host. When it is granted
+// the server creates a shared ring (see shared_ring.h) and names it by its
+// process id and a ring id. The client answers with its own process id, or
+// 0 if it could not open the ring, and from then on writes its messages
+// into the ring instead of the socket. Acknowledgements and the end of the
+// connection still go over the socket:
+//
+//   server: magic "PSM0" | process_id u32 | ring_id u32
+//   client: magic "PSM0" | process_id u32
+//
+// After that every message starts with a fixed size header followed by the
+// path and then the payload:
+//
+//   magic "PID1"  | message_size u64 | header_size u32 | action u32 |
+//   digest_size u32 | digest [32]    | path_size u32   | path [path_size] | data
+//
+// header_size covers the fixed header and the path, message_size covers
+// header and data. An appended message carries the length the file had
+// when it was last sent, followed by the bytes to add after it. Its digest
+// is of the whole file after the append:
+//
+//   offset u64 | data
+//
+// Directory messages act on the directory and everything below it in one
+// go. Like a file rename, a directory rename carries the new path as its
+// data.
+//
+// A sparse message replaces the file like an added or modified one but
+// only carries its data extents, in ascending order, followed by their
+// bytes. Everything outside the extents is a hole. Its digest is of this
+// payload rather than of the expanded file, which would mean hashing every
+// hole:
+//
+//   file_size u64 | extent_count u32 | (offset u64 | length u64) [count] | data
+//
+// Only the first digest_size bytes of the digest are
+// used; it has to match the negotiated hash. All integers are little-endian
+// regardless of the host.
+//
+// The layout is described once below as a chain of fields, each placed at
+// the end of the previous one, so sizes and offsets are compile time
+// constants and the encoder and decoder can not drift apart.
+
+enum class FileAction : uint32_t
+{
+	Added = 1,
+	Removed = 2,
+	Modified = 3,
+	Renamed = 4,
+	Appended = 5,
+	Sparse = 6,
+	DirectoryAdded = 7,
+	DirectoryRemoved = 8,
+	DirectoryRenamed = 9,
+};
+
+enum class HashAlgorithm : uint32_t
+{
+	None = 0,
+	Sha1 = 1,
+	Blake3 = 2,
+};
+
+#define PROTOCOL_VERSION 2
+#define HELLO_ACKNOWLEDGE 1
+#define HELLO_SHARED_MEMORY 2
+#define MAX_DIGEST_SIZE 32
+#define MAX_HASH_ALGORITHMS 4
+#define MAX_SPARSE_EXTENTS (1 << 20)
+// The longest path a message can carry. Receivers read the path into a
+// fixed buffer, so a header with a longer one is rejected up front.
+#define MAX_PATH_SIZE 4096
+
+inline uint32_t hash_digest_size(HashAlgorithm algorithm)
+{
+	switch (algorithm)
+	{
+	case HashAlgorithm::Sha1:
+		return 20;
+	case HashAlgorithm::Blake3:
+		return 32;
+	default:
+		return 0;
+	}
+}
+
+inline const char *hash_name(HashAlgorithm algorithm)
+{
+	switch (algorithm)
+	{
+	case HashAlgorithm::Sha1:
+		return "sha1";
+	case HashAlgorithm::Blake3:
+		return "blake3";
+	default:
+		return "none";
+	}
+}
+
+template<typename T, size_t Offset>
+struct Scalar
+{
+	typedef typename std::conditional<std::is_enum<T>::value, std::underlying_type<T>, std::common_type<T>>::type::type WireType;
+	static_assert(std::is_unsigned<WireType>::value, "Scalar fields are unsigned integers");
+
+	static constexpr size_t offset = Offset;
+	static constexpr size_t size = sizeof(WireType);
+	static constexpr size_t end = Offset + size;
+
+	static T load(const uint8_t *message)
+	{
+		WireType value = 0;
+		for (size_t i = 0; i < size; i++)
+			value |= WireType(message[offset + i]) << (8 * i);
+		return T(value);
+	}
+
+	static void store(uint8_t *message, T value)
+	{
+		WireType wire = WireType(value);
+		for (size_t i = 0; i < size; i++)
+			message[offset + i] = uint8_t(wire >> (8 * i));
+	}
+};
+
+template<size_t Size, size_t Offset>
+struct Bytes
+{
+	static constexpr size_t offset = Offset;
+	static constexpr size_t size = Size;
+	static constexpr size_t end = Offset + Size;
+
+	static const uint8_t *view(const uint8_t *message)
+	{
+		return message + offset;
+	}
+
+	static void store(uint8_t *message, const void *value)
+	{
+		memcpy(message + offset, value, size);
+	}
+};
+
+// Count consecutive scalars of the same type.
+template<typename T, size_t Count, size_t Offset>
+struct ScalarArray
+{
+	typedef Scalar<T, Offset> Element;
+
+	static constexpr size_t offset = Offset;
+	static constexpr size_t size = Element::size * Count;
+	static constexpr size_t end = Offset + size;
+
+	static T load(const uint8_t *message, size_t index)
+	{
+		return Element::load(message + index * Element::size);
+	}
+
+	static void store(uint8_t *message, size_t index, T value)
+	{
+		Element::store(message + index * Element::size, value);
+	}
+};
+
+struct HelloRequest
+{
+	typedef Bytes<4, 0> Magic;
+	typedef Scalar<uint32_t, Magic::end> Version;
+	typedef Scalar<uint32_t, Version::end> Flags;
+	typedef Scalar<uint32_t, Flags::end> Count;
+	typedef ScalarArray<HashAlgorithm, MAX_HASH_ALGORITHMS, Count::end> Algorithms;
+
+	static constexpr size_t size = Algorithms::end;
+};
+static_assert(HelloRequest::size == 32, "The hello is 32 bytes on the wire");
+
+struct HelloReply
+{
+	typedef Bytes<4, 0> Magic;
+	typedef Scalar<uint32_t, Magic::end> Version;
+	typedef Scalar<HashAlgorithm, Version::end> Algorithm;
+	typedef Scalar<uint32_t, Algorithm::end> Flags;
+
+	static constexpr size_t size = Flags::end;
+};
+static_assert(HelloReply::size == 16, "The hello reply is 16 bytes on the wire");
+
+struct Acknowledgement
+{
+	typedef Bytes<4, 0> Magic;
+	typedef Scalar<uint64_t, Magic::end> Count;
+
+	static constexpr size_t size = Count::end;
+};
+static_assert(Acknowledgement::size == 12, "An acknowledgement is 12 bytes on the wire");
+
+struct SharedRingOffer
+{
+	typedef Bytes<4, 0> Magic;
+	typedef Scalar<uint32_t, Magic::end> ProcessId;
+	typedef Scalar<uint32_t, ProcessId::end> RingId;
+
+	static constexpr size_t size = RingId::end;
+};
+static_assert(SharedRingOffer::size == 12, "A shared ring offer is 12 bytes on the wire");
+
+struct SharedRingAttach
+{
+	typedef Bytes<4, 0> Magic;
+	typedef Scalar<uint32_t, Magic::end> ProcessId;
+
+	static constexpr size_t size = ProcessId::end;
+};
+static_assert(SharedRingAttach::size == 8, "A shared ring attach is 8 bytes on the wire");
+
+struct MessageHeader
+{
+	typedef Bytes<4, 0> Magic;
+	typedef Scalar<uint64_t, Magic::end> MessageSize;
+	typedef Scalar<uint32_t, MessageSize::end> HeaderSize;
+	typedef Scalar<FileAction, HeaderSize::end> Action;
+	typedef Scalar<uint32_t, Action::end> DigestSize;
+	typedef Bytes<MAX_DIGEST_SIZE, DigestSize::end> Digest;
+	typedef Scalar<uint32_t, Digest::end> PathSize;
+
+	static constexpr size_t size = PathSize::end;
+};
+static_assert(MessageHeader::size == 60, "The fixed header is 60 bytes on the wire");
+
+struct AppendPayload
+{
+	typedef Scalar<uint64_t, 0> Offset;
+
+	static constexpr size_t size = Offset::end;
+};
+
+struct SparsePayload
+{
+	typedef Scalar<uint64_t, 0> FileSize;
+	typedef Scalar<uint32_t, FileSize::end> ExtentCount;
+
+	static constexpr size_t size = ExtentCount::end;
+};
+
+struct SparseExtent
+{
+	typedef Scalar<uint64_t, 0> Offset;
+	typedef Scalar<uint64_t, Offset::end> Length;
+
+	static constexpr size_t size = Length::end;
+};
+
+constexpr size_t sparse_payload_size(size_t extent_count)
+{
+	return SparsePayload::size + extent_count * SparseExtent::size;
+}
+
+static const char protocol_magic[4] = { 'P', 'I', 'D', '1' };
+static const char hello_magic[4] = { 'P', 'H', 'L', '0' };
+static const char acknowledgement_magic[4] = { 'P', 'A', 'K', '0' };
+static const char shared_ring_magic[4] = { 'P', 'S', 'M', '0' };
+
+// Fills in a hello offering count algorithms, most preferred first.
+inline void encode_hello_request(uint8_t (&buffer)[HelloRequest::size], const HashAlgorithm *algorithms, size_t count, uint32_t flags)
+{
+	memset(buffer, 0, sizeof(buffer));
+	count = count < MAX_HASH_ALGORITHMS ? count : MAX_HASH_ALGORITHMS;
+	HelloRequest::Magic::store(buffer, hello_magic);
+	HelloRequest::Version::store(buffer, PROTOCOL_VERSION);
+	HelloRequest::Flags::store(buffer, flags);
+	HelloRequest::Count::store(buffer, uint32_t(count));
+	for (size_t i = 0; i < count; i++)
+		HelloRequest::Algorithms::store(buffer, i, algorithms[i]);
+}
+
+inline void encode_hello_reply(uint8_t (&buffer)[HelloReply::size], HashAlgorithm algorithm, uint32_t flags)
+{
+	HelloReply::Magic::store(buffer, hello_magic);
+	HelloReply::Version::store(buffer, PROTOCOL_VERSION);
+	HelloReply::Algorithm::store(buffer, algorithm);
+	HelloReply::Flags::store(buffer, flags);
+}
+
+inline void encode_acknowledgement(uint8_t (&buffer)[Acknowledgement::size], uint64_t count)
+{
+	Acknowledgement::Magic::store(buffer, acknowledgement_magic);
+	Acknowledgement::Count::store(buffer, count);
+}
+
+inline bool decode_acknowledgement(const uint8_t (&buffer)[Acknowledgement::size], uint64_t &count)
+{
+	if (memcmp(Acknowledgement::Magic::view(buffer), acknowledgement_magic, sizeof(acknowledgement_magic)) != 0)
+		return false;
+	count = Acknowledgement::Count::load(buffer);
+	return true;
+}
+
+inline void encode_shared_ring_offer(uint8_t (&buffer)[SharedRingOffer::size], uint32_t process_id, uint32_t ring_id)
+{
+	SharedRingOffer::Magic::store(buffer, shared_ring_magic);
+	SharedRingOffer::ProcessId::store(buffer, process_id);
+	SharedRingOffer::RingId::store(buffer, ring_id);
+}
+
+inline bool decode_shared_ring_offer(const uint8_t (&buffer)[SharedRingOffer::size], uint32_t &process_id, uint32_t &ring_id)
+{
+	if (memcmp(SharedRingOffer::Magic::view(buffer), shared_ring_magic, sizeof(shared_ring_magic)) != 0)
+		return false;
+	process_id = SharedRingOffer::ProcessId::load(buffer);
+	ring_id = SharedRingOffer::RingId::load(buffer);
+	return true;
+}
+
+inline void encode_shared_ring_attach(uint8_t (&buffer)[SharedRingAttach::size], uint32_t process_id)
+{
+	SharedRingAttach::Magic::store(buffer, shared_ring_magic);
+	SharedRingAttach::ProcessId::store(buffer, process_id);
+}
+
+// The client's process id, or 0 if it did not attach.
+inline uint32_t decode_shared_ring_attach(const uint8_t (&buffer)[SharedRingAttach::size])
+{
+	if (memcmp(SharedRingAttach::Magic::view(buffer), shared_ring_magic, sizeof(shared_ring_magic)) != 0)
+		return 0;
+	return SharedRingAttach::ProcessId::load(buffer);
+}
+
+// The first offered algorithm the receiver supports, in the sender's order.
+// None if the hello is malformed or nothing matches.
+inline HashAlgorithm choose_hash_algorithm(const uint8_t (&buffer)[HelloRequest::size])
+{
+	if (memcmp(HelloRequest::Magic::view(buffer), hello_magic, sizeof(hello_magic)) != 0
+		|| HelloRequest::Version::load(buffer) != PROTOCOL_VERSION)
+		return HashAlgorithm::None;
+	uint32_t count = HelloRequest::Count::load(buffer);
+	for (uint32_t i = 0; i < count && i < MAX_HASH_ALGORITHMS; i++)
+	{
+		HashAlgorithm algorithm = HelloRequest::Algorithms::load(buffer, i);
+		if (hash_digest_size(algorithm))
+			return algorithm;
+	}
+	return HashAlgorithm::None;
+}
+
+// The algorithm the server picked, or None if the reply is malformed.
+inline HashAlgorithm decode_hello_reply(const uint8_t (&buffer)[HelloReply::size])
+{
+	if (memcmp(HelloReply::Magic::view(buffer), hello_magic, sizeof(hello_magic)) != 0
+		|| HelloReply::Version::load(buffer) != PROTOCOL_VERSION)
+		return HashAlgorithm::None;
+	return HelloReply::Algorithm::load(buffer);
+}
+
+constexpr size_t message_header_size(size_t path_size)
+{
+	return MessageHeader::size + path_size;
+}
+
+// Writes the header and the path. Returns the number of bytes written, or 0
+// if the buffer is too small or the path too long.
+inline size_t encode_header(uint8_t *buffer, size_t buffer_size, FileAction action, const void *digest, uint32_t digest_size, std::string_view path, uint64_t data_size)
+{
+	size_t header_size = message_header_size(path.size());
+	if (header_size > buffer_size || path.size() > MAX_PATH_SIZE || digest_size > MAX_DIGEST_SIZE)
+		return 0;
+	MessageHeader::Magic::store(buffer, protocol_magic);
+	MessageHeader::MessageSize::store(buffer, header_size + data_size);
+	MessageHeader::HeaderSize::store(buffer, uint32_t(header_size));
+	MessageHeader::Action::store(buffer, action);
+	MessageHeader::DigestSize::store(buffer, digest_size);
+	memset(buffer + MessageHeader::Digest::offset, 0, MessageHeader::Digest::size);
+	memcpy(buffer + MessageHeader::Digest::offset, digest, digest_size);
+	MessageHeader::PathSize::store(buffer, uint32_t(path.size()));
+	memcpy(buffer + MessageHeader::size, path.data(), path.size());
+	return header_size;
+}
+
+// A view into a received header. Nothing is copied; the accessors decode
+// straight from the receive buffer, which has to outlive the view.
+struct HeaderView
+{
+	HeaderView(const uint8_t *data)
+		: data(data)
+	{}
+
+	bool valid() const
+	{
+		return memcmp(MessageHeader::Magic::view(data), protocol_magic, sizeof(protocol_magic)) == 0
+			&& path_size() <= MAX_PATH_SIZE
+			&& header_size() == message_header_size(path_size())
+			&& message_size() >= header_size()
+			&& digest_size() <= MAX_DIGEST_SIZE
+			&& action() >= FileAction::Added
+			&& action() <= FileAction::DirectoryRenamed;
+	}
+
+	uint64_t message_size() const { return MessageHeader::MessageSize::load(data); }
+	uint32_t header_size() const { return MessageHeader::HeaderSize::load(data); }
+	FileAction action() const { return MessageHeader::Action::load(data); }
+	uint32_t digest_size() const { return MessageHeader::DigestSize::load(data); }
+	const uint8_t *digest() const { return MessageHeader::Digest::view(data); }
+	uint32_t path_size() const { return MessageHeader::PathSize::load(data); }
+	uint64_t data_size() const { return message_size() - header_size(); }
+
+	const uint8_t *data;
+};
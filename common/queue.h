@@ -0,0 +1,261 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+// Bounded lock-free queues for handing work between pipeline threads.
+//
+// try_push and try_pop never block. A full queue makes try_push fail, which
+// is how backpressure reaches the producer; it decides whether to wait with
+// push_wait or to do something else. The value passed to try_push is only
+// moved from when it returns true.
+//
+// The waiting helpers spin briefly and only touch the mutex in QueueSignal
+// once a thread is about to sleep, so a queue that keeps moving stays
+// lock-free.
+
+#define QUEUE_CACHE_LINE 64
+#define QUEUE_SPIN_COUNT 64
+
+struct QueueSignal
+{
+	void notify()
+	{
+		// Pairs with the fence in wait(): either the waiter sees the new
+		// state, or we see the waiter.
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (waiters.load(std::memory_order_relaxed))
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			condition.notify_all();
+		}
+	}
+
+	template<typename Ready>
+	void wait(Ready ready)
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		waiters.fetch_add(1, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		condition.wait_for(lock, std::chrono::milliseconds(100), ready);
+		waiters.fetch_sub(1, std::memory_order_relaxed);
+	}
+
+	std::atomic<int> waiters{ 0 };
+	std::mutex mutex;
+	std::condition_variable condition;
+};
+
+inline size_t queue_capacity(size_t capacity)
+{
+	size_t rounded = 1;
+	while (rounded < capacity)
+		rounded <<= 1;
+	return rounded;
+}
+
+// One producer thread, one consumer thread.
+template<typename T>
+struct SpscQueue
+{
+	explicit SpscQueue(size_t capacity)
+		: slots(new T[queue_capacity(capacity)])
+		, mask(queue_capacity(capacity) - 1)
+	{}
+
+	bool try_push(T &value)
+	{
+		size_t tail_position = tail.load(std::memory_order_relaxed);
+		if (tail_position - cached_head > mask)
+		{
+			cached_head = head.load(std::memory_order_acquire);
+			if (tail_position - cached_head > mask)
+				return false;
+		}
+		slots[tail_position & mask] = std::move(value);
+		tail.store(tail_position + 1, std::memory_order_release);
+		not_empty.notify();
+		return true;
+	}
+
+	bool try_pop(T &value)
+	{
+		size_t head_position = head.load(std::memory_order_relaxed);
+		if (head_position == cached_tail)
+		{
+			cached_tail = tail.load(std::memory_order_acquire);
+			if (head_position == cached_tail)
+				return false;
+		}
+		value = std::move(slots[head_position & mask]);
+		head.store(head_position + 1, std::memory_order_release);
+		not_full.notify();
+		return true;
+	}
+
+	size_t size() const
+	{
+		return tail.load(std::memory_order_acquire) - head.load(std::memory_order_acquire);
+	}
+
+	bool full() const
+	{
+		return size() > mask;
+	}
+
+	void close()
+	{
+		closed.store(true);
+		not_empty.notify();
+		not_full.notify();
+	}
+
+	std::unique_ptr<T[]> slots;
+	size_t mask;
+	std::atomic<bool> closed{ false };
+	QueueSignal not_empty;
+	QueueSignal not_full;
+
+	alignas(QUEUE_CACHE_LINE) std::atomic<size_t> head{ 0 };
+	size_t cached_tail = 0;
+
+	alignas(QUEUE_CACHE_LINE) std::atomic<size_t> tail{ 0 };
+	size_t cached_head = 0;
+};
+
+// Any number of producer threads, one consumer thread. Every slot carries a
+// sequence number telling producers and the consumer whose turn it is
+// (Vyukov's bounded queue), so producers only contend on the tail counter.
+template<typename T>
+struct MpscQueue
+{
+	struct Slot
+	{
+		std::atomic<size_t> sequence;
+		T value;
+	};
+
+	explicit MpscQueue(size_t capacity)
+		: slots(new Slot[queue_capacity(capacity)])
+		, mask(queue_capacity(capacity) - 1)
+	{
+		for (size_t i = 0; i <= mask; i++)
+			slots[i].sequence.store(i, std::memory_order_relaxed);
+	}
+
+	bool try_push(T &value)
+	{
+		size_t position = tail.load(std::memory_order_relaxed);
+		Slot *slot;
+		while (true)
+		{
+			slot = &slots[position & mask];
+			size_t sequence = slot->sequence.load(std::memory_order_acquire);
+			intptr_t difference = intptr_t(sequence) - intptr_t(position);
+			if (difference == 0)
+			{
+				if (tail.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+					break;
+			}
+			else if (difference < 0)
+			{
+				return false;
+			}
+			else
+			{
+				position = tail.load(std::memory_order_relaxed);
+			}
+		}
+		slot->value = std::move(value);
+		slot->sequence.store(position + 1, std::memory_order_release);
+		not_empty.notify();
+		return true;
+	}
+
+	bool try_pop(T &value)
+	{
+		size_t position = head.load(std::memory_order_relaxed);
+		Slot &slot = slots[position & mask];
+		if (slot.sequence.load(std::memory_order_acquire) != position + 1)
+			return false;
+		value = std::move(slot.value);
+		slot.sequence.store(position + mask + 1, std::memory_order_release);
+		head.store(position + 1, std::memory_order_release);
+		not_full.notify();
+		return true;
+	}
+
+	size_t size() const
+	{
+		size_t head_position = head.load(std::memory_order_acquire);
+		size_t tail_position = tail.load(std::memory_order_acquire);
+		return tail_position > head_position ? tail_position - head_position : 0;
+	}
+
+	bool full() const
+	{
+		return size() > mask;
+	}
+
+	void close()
+	{
+		closed.store(true);
+		not_empty.notify();
+		not_full.notify();
+	}
+
+	std::unique_ptr<Slot[]> slots;
+	size_t mask;
+	std::atomic<bool> closed{ false };
+	QueueSignal not_empty;
+	QueueSignal not_full;
+
+	alignas(QUEUE_CACHE_LINE) std::atomic<size_t> head{ 0 };
+	alignas(QUEUE_CACHE_LINE) std::atomic<size_t> tail{ 0 };
+};
+
+// Blocks until the value is queued. Returns false if the queue was closed.
+template<typename Queue, typename T>
+bool push_wait(Queue &queue, T &value)
+{
+	for (int spin = 0; spin < QUEUE_SPIN_COUNT; spin++)
+	{
+		if (queue.try_push(value))
+			return true;
+		std::this_thread::yield();
+	}
+	while (!queue.try_push(value))
+	{
+		if (queue.closed.load())
+			return false;
+		queue.not_full.wait([&queue] { return !queue.full() || queue.closed.load(); });
+	}
+	return true;
+}
+
+// Blocks until a value is available. Returns false once the queue is closed
+// and drained.
+template<typename Queue, typename T>
+bool pop_wait(Queue &queue, T &value)
+{
+	for (int spin = 0; spin < QUEUE_SPIN_COUNT; spin++)
+	{
+		if (queue.try_pop(value))
+			return true;
+		std::this_thread::yield();
+	}
+	while (!queue.try_pop(value))
+	{
+		if (queue.closed.load())
+			return queue.try_pop(value);
+		queue.not_empty.wait([&queue] { return queue.size() || queue.closed.load(); });
+	}
+	return true;
+}
@@ -0,0 +1,236 @@
+#include "shared_ring.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <wchar.h>
+
+#include <algorithm>
+#include <new>
+
+// The control block gets a page of its own, so the data starts page aligned.
+#define SHARED_RING_CONTROL_SIZE 4096
+
+static_assert(sizeof(SharedRingControl) <= SHARED_RING_CONTROL_SIZE, "The control block fits in its page");
+
+static void ring_name(wchar_t (&name)[64], uint32_t process_id, uint32_t ring_id, const wchar_t *suffix)
+{
+	swprintf(name, 64, L"Local\\pexip_drop_ring_%u_%u%ls", process_id, ring_id, suffix);
+}
+
+static bool map_ring(SharedRing &ring)
+{
+	uint8_t *view = (uint8_t *)MapViewOfFile(ring.mapping, FILE_MAP_ALL_ACCESS, 0, 0, 0);
+	if (!view)
+	{
+		fprintf(stderr, "Failed to map the shared ring: %lu\n", GetLastError());
+		return false;
+	}
+	ring.control = reinterpret_cast<SharedRingControl *>(view);
+	ring.data = view + SHARED_RING_CONTROL_SIZE;
+	return true;
+}
+
+bool shared_ring_create(SharedRing &ring, uint32_t process_id, uint32_t ring_id, uint32_t capacity)
+{
+	wchar_t name[64];
+	ring_name(name, process_id, ring_id, L"");
+	ring.mapping = CreateFileMappingW(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, 0, SHARED_RING_CONTROL_SIZE + capacity, name);
+	if (!ring.mapping || GetLastError() == ERROR_ALREADY_EXISTS)
+	{
+		fprintf(stderr, "Failed to create the shared ring: %lu\n", GetLastError());
+		shared_ring_close(ring, false);
+		return false;
+	}
+	if (!map_ring(ring))
+	{
+		shared_ring_close(ring, false);
+		return false;
+	}
+	new (ring.control) SharedRingControl();
+	ring.control->capacity = capacity;
+	ring.capacity = capacity;
+
+	ring_name(name, process_id, ring_id, L"_data");
+	ring.data_event = CreateEventW(NULL, FALSE, FALSE, name);
+	ring_name(name, process_id, ring_id, L"_space");
+	ring.space_event = CreateEventW(NULL, FALSE, FALSE, name);
+	if (!ring.data_event || !ring.space_event)
+	{
+		fprintf(stderr, "Failed to create the shared ring events: %lu\n", GetLastError());
+		shared_ring_close(ring, false);
+		return false;
+	}
+	return true;
+}
+
+bool shared_ring_open(SharedRing &ring, uint32_t process_id, uint32_t ring_id)
+{
+	wchar_t name[64];
+	ring_name(name, process_id, ring_id, L"");
+	ring.mapping = OpenFileMappingW(FILE_MAP_ALL_ACCESS, FALSE, name);
+	if (!ring.mapping || !map_ring(ring))
+	{
+		fprintf(stderr, "Failed to open the shared ring: %lu\n", GetLastError());
+		shared_ring_close(ring, true);
+		return false;
+	}
+	ring.capacity = ring.control->capacity;
+
+	ring_name(name, process_id, ring_id, L"_data");
+	ring.data_event = OpenEventW(EVENT_MODIFY_STATE | SYNCHRONIZE, FALSE, name);
+	ring_name(name, process_id, ring_id, L"_space");
+	ring.space_event = OpenEventW(EVENT_MODIFY_STATE | SYNCHRONIZE, FALSE, name);
+	if (!ring.data_event || !ring.space_event)
+	{
+		fprintf(stderr, "Failed to open the shared ring events: %lu\n", GetLastError());
+		shared_ring_close(ring, true);
+		return false;
+	}
+	return true;
+}
+
+bool shared_ring_watch_peer(SharedRing &ring, uint32_t process_id)
+{
+	ring.peer = OpenProcess(SYNCHRONIZE, FALSE, process_id);
+	if (!ring.peer)
+	{
+		fprintf(stderr, "Failed to open process %u: %lu\n", process_id, GetLastError());
+		return false;
+	}
+	return true;
+}
+
+static void close_handle(HANDLE &handle)
+{
+	if (handle)
+		CloseHandle(handle);
+	handle = NULL;
+}
+
+void shared_ring_close(SharedRing &ring, bool producer)
+{
+	if (ring.control)
+	{
+		if (producer)
+		{
+			ring.control->producer_closed.store(1);
+			if (ring.data_event)
+				SetEvent(ring.data_event);
+		}
+		else
+		{
+			ring.control->consumer_closed.store(1);
+			if (ring.space_event)
+				SetEvent(ring.space_event);
+		}
+		UnmapViewOfFile(ring.control);
+	}
+	ring.control = nullptr;
+	ring.data = nullptr;
+	ring.capacity = 0;
+	close_handle(ring.mapping);
+	close_handle(ring.data_event);
+	close_handle(ring.space_event);
+	close_handle(ring.peer);
+}
+
+// False if the other process exited instead.
+static bool wait_event(SharedRing &ring, HANDLE event)
+{
+	HANDLE handles[2] = { event, ring.peer };
+	return WaitForMultipleObjects(ring.peer ? 2 : 1, handles, FALSE, INFINITE) == WAIT_OBJECT_0;
+}
+
+static void wake(std::atomic<uint32_t> &waiting, HANDLE event)
+{
+	if (waiting.load() && waiting.exchange(0))
+		SetEvent(event);
+}
+
+bool shared_ring_write(SharedRing &ring, const void *data, size_t size)
+{
+	SharedRingControl &control = *ring.control;
+	const uint8_t *bytes = static_cast<const uint8_t *>(data);
+	uint64_t head = control.head.load(std::memory_order_relaxed);
+	while (size)
+	{
+		if (control.consumer_closed.load())
+			return false;
+		uint64_t used = head - control.tail.load(std::memory_order_acquire);
+		if (used == ring.capacity)
+		{
+			// Raise the flag before looking again, so a consume in between
+			// either shows up here or signals the event.
+			control.producer_waiting.store(1);
+			if (head - control.tail.load() < ring.capacity || control.consumer_closed.load())
+				control.producer_waiting.store(0);
+			else if (!wait_event(ring, ring.space_event))
+				return false;
+			continue;
+		}
+		size_t offset = size_t(head % ring.capacity);
+		size_t chunk = std::min(size, size_t(std::min(uint64_t(ring.capacity) - used, uint64_t(ring.capacity) - offset)));
+		memcpy(ring.data + offset, bytes, chunk);
+		head += chunk;
+		control.head.store(head);
+		wake(control.consumer_waiting, ring.data_event);
+		bytes += chunk;
+		size -= chunk;
+	}
+	return true;
+}
+
+RingState shared_ring_peek(SharedRing &ring, const uint8_t *&data, size_t &size)
+{
+	SharedRingControl &control = *ring.control;
+	uint64_t tail = control.tail.load(std::memory_order_relaxed);
+	while (true)
+	{
+		uint64_t head = control.head.load(std::memory_order_acquire);
+		if (head != tail)
+		{
+			size_t offset = size_t(tail % ring.capacity);
+			data = ring.data + offset;
+			size = size_t(std::min(head - tail, uint64_t(ring.capacity) - offset));
+			return RingState::Ready;
+		}
+		if (control.producer_closed.load())
+		{
+			// The producer writes everything before it closes.
+			if (control.head.load() != tail)
+				continue;
+			return RingState::Closed;
+		}
+		control.consumer_waiting.store(1);
+		if (control.head.load() != tail || control.producer_closed.load())
+			control.consumer_waiting.store(0);
+		else if (!wait_event(ring, ring.data_event))
+			return RingState::Error;
+	}
+}
+
+void shared_ring_consume(SharedRing &ring, size_t size)
+{
+	SharedRingControl &control = *ring.control;
+	control.tail.store(control.tail.load(std::memory_order_relaxed) + size);
+	wake(control.producer_waiting, ring.space_event);
+}
+
+RingState shared_ring_read(SharedRing &ring, void *data, size_t size)
+{
+	uint8_t *bytes = static_cast<uint8_t *>(data);
+	while (size)
+	{
+		const uint8_t *available;
+		size_t available_size;
+		RingState state = shared_ring_peek(ring, available, available_size);
+		if (state != RingState::Ready)
+			return state;
+		size_t chunk = std::min(size, available_size);
+		memcpy(bytes, available, chunk);
+		shared_ring_consume(ring, chunk);
+		bytes += chunk;
+		size -= chunk;
+	}
+	return RingState::Ready;
+}
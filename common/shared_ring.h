@@ -0,0 +1,78 @@
+#pragma once
+
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+
+// A byte stream from a client to a server on the same host through a ring
+// buffer in shared memory, instead of through loopback TCP. The client
+// copies each message into the ring once and the server writes files
+// straight out of it.
+//
+// The ring is a single producer, single consumer queue: head and tail are
+// running byte counts, each written by one side only. A side that finds the
+// ring empty or full raises its waiting flag and sleeps on a named event;
+// the other side only signals the event when the flag is up, so a stream
+// that keeps both sides busy makes no system calls. Each side also waits on
+// the other's process, so neither hangs if the other one dies.
+
+#define SHARED_RING_CAPACITY (16 << 20)
+
+struct SharedRingControl
+{
+	uint32_t capacity;
+	alignas(64) std::atomic<uint64_t> head;
+	std::atomic<uint32_t> producer_waiting;
+	std::atomic<uint32_t> producer_closed;
+	alignas(64) std::atomic<uint64_t> tail;
+	std::atomic<uint32_t> consumer_waiting;
+	std::atomic<uint32_t> consumer_closed;
+};
+
+struct SharedRing
+{
+	HANDLE mapping = NULL;
+	SharedRingControl *control = nullptr;
+	uint8_t *data = nullptr;
+	uint32_t capacity = 0;
+	// Signalled when bytes are added, and when they are consumed.
+	HANDLE data_event = NULL;
+	HANDLE space_event = NULL;
+	HANDLE peer = NULL;
+};
+
+enum class RingState
+{
+	Ready,
+	// The producer finished and everything it wrote has been read.
+	Closed,
+	// The other side closed early or died.
+	Error
+};
+
+// The server creates the ring, named after its process and a ring id, and
+// the client opens it by those.
+bool shared_ring_create(SharedRing &ring, uint32_t process_id, uint32_t ring_id, uint32_t capacity);
+bool shared_ring_open(SharedRing &ring, uint32_t process_id, uint32_t ring_id);
+bool shared_ring_watch_peer(SharedRing &ring, uint32_t process_id);
+// Marks this side closed, wakes the other one and unmaps the ring.
+void shared_ring_close(SharedRing &ring, bool producer);
+
+// Blocks while the ring is full. Returns false if the consumer went away.
+bool shared_ring_write(SharedRing &ring, const void *data, size_t size);
+
+// Blocks until there is something to read and returns the longest readable
+// run that does not wrap around. It stays valid until it is consumed.
+RingState shared_ring_peek(SharedRing &ring, const uint8_t *&data, size_t &size);
+void shared_ring_consume(SharedRing &ring, size_t size);
+// Copies exactly size bytes out.
+RingState shared_ring_read(SharedRing &ring, void *data, size_t size);
@@ -0,0 +1,193 @@
+#include "stats.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+struct StatsSnapshot
+{
+	uint64_t buckets[int(Stage::Count)][STATS_BUCKETS];
+	uint64_t counters[int(Counter::Count)];
+	uint64_t time;
+};
+
+struct StatsRegistry
+{
+	std::mutex mutex;
+	std::vector<ThreadStats *> threads;
+
+	std::condition_variable wakeup;
+	std::thread dump_thread;
+	bool stop = false;
+};
+
+static StatsRegistry &stats_registry()
+{
+	static StatsRegistry registry;
+	return registry;
+}
+
+static const char *stage_names[] = {
+	"event_to_batch",
+	"read",
+	"hash",
+	"queue_wait",
+	"backpressure",
+	"pacing",
+	"send",
+	"server_receive",
+	"server_write",
+	"flush",
+};
+static_assert(sizeof(stage_names) / sizeof(stage_names[0]) == int(Stage::Count), "Missing stage name");
+
+ThreadStats *register_thread_stats()
+{
+	StatsRegistry &registry = stats_registry();
+	ThreadStats *stats = new ThreadStats();
+	std::unique_lock<std::mutex> lock(registry.mutex);
+	registry.threads.push_back(stats);
+	return stats;
+}
+
+static void take_snapshot(StatsSnapshot &snapshot)
+{
+	StatsRegistry &registry = stats_registry();
+	memset(&snapshot, 0, sizeof(snapshot));
+	snapshot.time = stats_now();
+	std::unique_lock<std::mutex> lock(registry.mutex);
+	for (ThreadStats *stats : registry.threads)
+	{
+		for (int stage = 0; stage < int(Stage::Count); stage++)
+		{
+			for (int bucket = 0; bucket < STATS_BUCKETS; bucket++)
+				snapshot.buckets[stage][bucket] += stats->buckets[stage][bucket].load(std::memory_order_relaxed);
+		}
+		for (int counter = 0; counter < int(Counter::Count); counter++)
+			snapshot.counters[counter] += stats->counters[counter].load(std::memory_order_relaxed);
+	}
+}
+
+static uint64_t bucket_value(int bucket)
+{
+	if (bucket < STATS_SUB_BUCKETS)
+		return uint64_t(bucket);
+	int exponent = bucket / STATS_SUB_BUCKETS + STATS_SUB_BUCKET_BITS - 1;
+	uint64_t sub_bucket = uint64_t(bucket % STATS_SUB_BUCKETS) + STATS_SUB_BUCKETS;
+	uint64_t low = sub_bucket << (exponent - STATS_SUB_BUCKET_BITS);
+	uint64_t width = uint64_t(1) << (exponent - STATS_SUB_BUCKET_BITS);
+	return low + width / 2;
+}
+
+static uint64_t percentile(const uint64_t *buckets, uint64_t count, double fraction)
+{
+	uint64_t target = uint64_t(double(count) * fraction + 0.5);
+	if (target == 0)
+		target = 1;
+	uint64_t seen = 0;
+	for (int bucket = 0; bucket < STATS_BUCKETS; bucket++)
+	{
+		seen += buckets[bucket];
+		if (seen >= target)
+			return bucket_value(bucket);
+	}
+	return bucket_value(STATS_BUCKETS - 1);
+}
+
+static void print_stats(const StatsSnapshot &previous, const StatsSnapshot &current)
+{
+	double seconds = double(current.time - previous.time) / 1e9;
+	fprintf(stderr, "stats: last %.1fs\n", seconds);
+	for (int stage = 0; stage < int(Stage::Count); stage++)
+	{
+		uint64_t buckets[STATS_BUCKETS];
+		uint64_t count = 0;
+		int max_bucket = 0;
+		for (int bucket = 0; bucket < STATS_BUCKETS; bucket++)
+		{
+			buckets[bucket] = current.buckets[stage][bucket] - previous.buckets[stage][bucket];
+			count += buckets[bucket];
+			if (buckets[bucket])
+				max_bucket = bucket;
+		}
+		if (!count)
+			continue;
+		fprintf(stderr, "  %-15s count %8llu  p50 %10.3fms  p90 %10.3fms  p99 %10.3fms  max %10.3fms\n",
+			stage_names[stage],
+			(unsigned long long)count,
+			percentile(buckets, count, 0.50) / 1e6,
+			percentile(buckets, count, 0.90) / 1e6,
+			percentile(buckets, count, 0.99) / 1e6,
+			bucket_value(max_bucket) / 1e6);
+	}
+	uint64_t counters[int(Counter::Count)];
+	for (int counter = 0; counter < int(Counter::Count); counter++)
+		counters[counter] = current.counters[counter] - previous.counters[counter];
+	if (counters[int(Counter::BytesSent)] || counters[int(Counter::FilesSent)])
+		fprintf(stderr, "  sent     %10.3f MB/s %10.1f files/s\n",
+			counters[int(Counter::BytesSent)] / seconds / (1024 * 1024),
+			counters[int(Counter::FilesSent)] / seconds);
+	if (counters[int(Counter::BytesReceived)] || counters[int(Counter::FilesWritten)])
+		fprintf(stderr, "  received %10.3f MB/s %10.1f files/s\n",
+			counters[int(Counter::BytesReceived)] / seconds / (1024 * 1024),
+			counters[int(Counter::FilesWritten)] / seconds);
+	if (counters[int(Counter::BytesRelayed)])
+		fprintf(stderr, "  relayed  %10.3f MB/s\n",
+			counters[int(Counter::BytesRelayed)] / seconds / (1024 * 1024));
+	if (counters[int(Counter::MessagesAcknowledged)])
+		fprintf(stderr, "  durable  %10.1f messages/s acknowledged\n",
+			counters[int(Counter::MessagesAcknowledged)] / seconds);
+	if (counters[int(Counter::BatchesDeferred)])
+		fprintf(stderr, "  deferred %10llu batches waiting for the hasher\n",
+			(unsigned long long)counters[int(Counter::BatchesDeferred)]);
+	if (counters[int(Counter::ChangesFiltered)])
+		fprintf(stderr, "  filtered %10.1f changes/s excluded by rules\n",
+			counters[int(Counter::ChangesFiltered)] / seconds);
+}
+
+static void dump_loop(int interval_seconds)
+{
+	StatsRegistry &registry = stats_registry();
+	std::unique_ptr<StatsSnapshot> previous(new StatsSnapshot());
+	std::unique_ptr<StatsSnapshot> current(new StatsSnapshot());
+	take_snapshot(*previous);
+	while (true)
+	{
+		{
+			std::unique_lock<std::mutex> lock(registry.mutex);
+			registry.wakeup.wait_for(lock, std::chrono::seconds(interval_seconds), [&registry] { return registry.stop; });
+			if (registry.stop)
+				return;
+		}
+		take_snapshot(*current);
+		print_stats(*previous, *current);
+		std::swap(previous, current);
+	}
+}
+
+void start_stats_dump(int interval_seconds)
+{
+	StatsRegistry &registry = stats_registry();
+	if (interval_seconds <= 0 || registry.dump_thread.joinable())
+		return;
+	registry.stop = false;
+	registry.dump_thread = std::thread(dump_loop, interval_seconds);
+}
+
+void stop_stats_dump()
+{
+	StatsRegistry &registry = stats_registry();
+	if (!registry.dump_thread.joinable())
+		return;
+	{
+		std::unique_lock<std::mutex> lock(registry.mutex);
+		registry.stop = true;
+	}
+	registry.wakeup.notify_all();
+	registry.dump_thread.join();
+}
@@ -0,0 +1,116 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <atomic>
+#include <chrono>
+
+// Per-stage latency histograms and throughput counters.
+//
+// Every thread records into its own block, so recording is a couple of
+// relaxed loads and stores with no shared cache lines. The dump thread
+// merges all blocks. Histograms are log-linear (HDR style): 16 linear
+// sub-buckets per power of two, which keeps the relative error below 7%
+// for any value up to 2^48 ns.
+
+enum class Stage
+{
+	EventToBatch,
+	Read,
+	Hash,
+	QueueWait,
+	Backpressure,
+	Pacing,
+	Send,
+	ServerReceive,
+	ServerWrite,
+	Flush,
+	Count
+};
+
+enum class Counter
+{
+	BytesSent,
+	FilesSent,
+	BytesReceived,
+	FilesWritten,
+	BatchesDeferred,
+	BytesRelayed,
+	MessagesAcknowledged,
+	ChangesFiltered,
+	Count
+};
+
+#define STATS_SUB_BUCKET_BITS 4
+#define STATS_SUB_BUCKETS (1 << STATS_SUB_BUCKET_BITS)
+#define STATS_MAX_BITS 48
+#define STATS_BUCKETS ((STATS_MAX_BITS - STATS_SUB_BUCKET_BITS + 1) * STATS_SUB_BUCKETS)
+
+struct ThreadStats
+{
+	std::atomic<uint64_t> buckets[int(Stage::Count)][STATS_BUCKETS];
+	std::atomic<uint64_t> counters[int(Counter::Count)];
+};
+
+ThreadStats *register_thread_stats();
+
+inline ThreadStats &thread_stats()
+{
+	static thread_local ThreadStats *stats = register_thread_stats();
+	return *stats;
+}
+
+inline int stats_bucket(uint64_t value)
+{
+	if (value < STATS_SUB_BUCKETS)
+		return int(value);
+	if (value >= (uint64_t(1) << STATS_MAX_BITS))
+		value = (uint64_t(1) << STATS_MAX_BITS) - 1;
+	int exponent = 63;
+	while (!(value >> exponent))
+		exponent--;
+	int sub_bucket = int(value >> (exponent - STATS_SUB_BUCKET_BITS)) & (STATS_SUB_BUCKETS - 1);
+	return (exponent - STATS_SUB_BUCKET_BITS + 1) * STATS_SUB_BUCKETS + sub_bucket;
+}
+
+inline uint64_t stats_now()
+{
+	return uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count());
+}
+
+// Only the owning thread writes its block, so a load and a store is enough.
+inline void stats_bump(std::atomic<uint64_t> &value, uint64_t add)
+{
+	value.store(value.load(std::memory_order_relaxed) + add, std::memory_order_relaxed);
+}
+
+inline void stats_record(Stage stage, uint64_t nanoseconds)
+{
+	ThreadStats &stats = thread_stats();
+	stats_bump(stats.buckets[int(stage)][stats_bucket(nanoseconds)], 1);
+}
+
+inline void stats_add(Counter counter, uint64_t value)
+{
+	stats_bump(thread_stats().counters[int(counter)], value);
+}
+
+struct StatsTimer
+{
+	StatsTimer(Stage stage)
+		: stage(stage)
+		, start(stats_now())
+	{}
+	~StatsTimer()
+	{
+		stats_record(stage, stats_now() - start);
+	}
+
+	Stage stage;
+	uint64_t start;
+};
+
+// Prints the histograms and rates for the last interval to stderr every
+// interval_seconds from a background thread.
+void start_stats_dump(int interval_seconds);
+void stop_stats_dump();
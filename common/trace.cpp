@@ -0,0 +1,159 @@
+#include "trace.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+#include <atomic>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+
+#define TRACE_EVENTS (1 << 16)
+
+struct TraceEvent
+{
+	std::atomic<uint64_t> sequence;
+	const char *name;
+	uint64_t start;
+	uint64_t end;
+	uint64_t bytes;
+	uint32_t thread;
+	uint32_t detail_size;
+	char detail[TRACE_DETAIL_SIZE];
+};
+
+struct TraceState
+{
+	std::string file_name;
+	const char *process_name = "";
+	uint64_t start_time = 0;
+	std::atomic<uint64_t> next;
+	std::atomic<uint32_t> next_thread;
+	std::unique_ptr<TraceEvent[]> events;
+	std::mutex write_mutex;
+};
+
+bool trace_enabled = false;
+
+static TraceState &trace_state()
+{
+	static TraceState state;
+	return state;
+}
+
+static uint32_t trace_thread()
+{
+	static thread_local uint32_t thread = trace_state().next_thread.fetch_add(1, std::memory_order_relaxed) + 1;
+	return thread;
+}
+
+bool enable_trace(const std::string &file_name, const char *process_name)
+{
+	TraceState &state = trace_state();
+	FILE *file = fopen(file_name.c_str(), "w");
+	if (!file)
+	{
+		fprintf(stderr, "Failed to open trace file %s\n", file_name.c_str());
+		return false;
+	}
+	fclose(file);
+	// Written again on exit, possibly after the working directory changed.
+	state.file_name = std::filesystem::absolute(file_name).string();
+	state.process_name = process_name;
+	state.start_time = stats_now();
+	state.next.store(0);
+	state.events.reset(new TraceEvent[TRACE_EVENTS]);
+	for (int i = 0; i < TRACE_EVENTS; i++)
+		state.events[i].sequence.store(0, std::memory_order_relaxed);
+	trace_enabled = true;
+	return true;
+}
+
+void trace_span(const char *name, uint64_t start, uint64_t end, const char *detail, size_t detail_size, uint64_t bytes)
+{
+	TraceState &state = trace_state();
+	uint64_t sequence = state.next.fetch_add(1, std::memory_order_relaxed);
+	TraceEvent &event = state.events[sequence & (TRACE_EVENTS - 1)];
+	event.sequence.store(0, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+	event.name = name;
+	event.start = start;
+	event.end = end;
+	event.bytes = bytes;
+	event.thread = trace_thread();
+	// Keep the tail of long paths, that is where the file name is. A detail
+	// TraceScope already cut to size can also start inside a character.
+	size_t skip = detail_size > TRACE_DETAIL_SIZE ? detail_size - TRACE_DETAIL_SIZE : 0;
+	while (skip < detail_size && (detail[skip] & 0xc0) == 0x80)
+		skip++;
+	event.detail_size = uint32_t(detail_size - skip);
+	if (detail_size)
+		memcpy(event.detail, detail + skip, event.detail_size);
+	event.sequence.store(sequence + 1, std::memory_order_release);
+}
+
+static void write_json_string(FILE *file, const char *string, size_t size)
+{
+	fputc('"', file);
+	for (size_t i = 0; i < size; i++)
+	{
+		unsigned char c = (unsigned char)string[i];
+		if (c == '"' || c == '\\')
+			fprintf(file, "\\%c", c);
+		else if (c < 0x20)
+			fprintf(file, "\\u%04x", c);
+		else
+			fputc(c, file);
+	}
+	fputc('"', file);
+}
+
+bool write_trace()
+{
+	TraceState &state = trace_state();
+	if (!trace_enabled)
+		return true;
+	std::unique_lock<std::mutex> lock(state.write_mutex);
+	FILE *file = fopen(state.file_name.c_str(), "w");
+	if (!file)
+	{
+		fprintf(stderr, "Failed to open trace file %s\n", state.file_name.c_str());
+		return false;
+	}
+
+	fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+	fprintf(file, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"tid\":0,\"args\":{\"name\":\"%s\"}}", state.process_name);
+
+	uint64_t end = state.next.load(std::memory_order_acquire);
+	uint64_t begin = end > TRACE_EVENTS ? end - TRACE_EVENTS : 0;
+	uint64_t written = 0;
+	for (uint64_t sequence = begin; sequence < end; sequence++)
+	{
+		TraceEvent &event = state.events[sequence & (TRACE_EVENTS - 1)];
+		if (event.sequence.load(std::memory_order_acquire) != sequence + 1)
+			continue;
+		TraceEvent copy;
+		copy.name = event.name;
+		copy.start = event.start;
+		copy.end = event.end;
+		copy.bytes = event.bytes;
+		copy.thread = event.thread;
+		copy.detail_size = std::min(event.detail_size, uint32_t(TRACE_DETAIL_SIZE));
+		memcpy(copy.detail, event.detail, copy.detail_size);
+		std::atomic_thread_fence(std::memory_order_acquire);
+		if (event.sequence.load(std::memory_order_relaxed) != sequence + 1)
+			continue;
+
+		uint64_t start = copy.start > state.start_time ? copy.start - state.start_time : 0;
+		fprintf(file, ",\n{\"name\":\"%s\",\"cat\":\"pexip\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"bytes\":%llu,\"path\":",
+			copy.name, copy.thread, start / 1000.0, (copy.end - copy.start) / 1000.0, (unsigned long long)copy.bytes);
+		write_json_string(file, copy.detail, copy.detail_size);
+		fprintf(file, "}}");
+		written++;
+	}
+	fprintf(file, "\n]}\n");
+	fclose(file);
+	fprintf(stderr, "Wrote %llu trace events to %s\n", (unsigned long long)written, state.file_name.c_str());
+	return true;
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+
+#include <string>
+#include <string_view>
+
+#include "stats.h"
+
+// Opt-in span tracing into a fixed ring buffer, written out as Chrome
+// trace-event JSON (open it in Perfetto or chrome://tracing).
+//
+// trace_enabled is set once at startup before any thread is started and
+// never changes, so a disabled TraceScope costs one well predicted branch.
+
+extern bool trace_enabled;
+
+bool enable_trace(const std::string &file_name, const char *process_name);
+bool write_trace();
+
+void trace_span(const char *name, uint64_t start, uint64_t end, const char *detail, size_t detail_size, uint64_t bytes);
+
+#define TRACE_DETAIL_SIZE 128
+
+// The detail is copied, so it only has to live until set_detail() returns.
+struct TraceScope
+{
+	TraceScope(const char *name)
+		: name(name)
+		, start(0)
+		, bytes(0)
+		, detail_size(0)
+	{
+		if (trace_enabled)
+			start = stats_now();
+	}
+	~TraceScope()
+	{
+		if (start)
+			trace_span(name, start, stats_now(), detail, detail_size, bytes);
+	}
+
+	void set_detail(std::string_view string)
+	{
+		if (!start)
+			return;
+		// Only the last TRACE_DETAIL_SIZE bytes are kept by trace_span().
+		detail_size = string.size() < TRACE_DETAIL_SIZE ? string.size() : TRACE_DETAIL_SIZE;
+		memcpy(detail, string.data() + string.size() - detail_size, detail_size);
+	}
+
+	const char *name;
+	uint64_t start;
+	uint64_t bytes;
+	char detail[TRACE_DETAIL_SIZE];
+	size_t detail_size;
+};
@@ -0,0 +1,78 @@
+#include "worker_pool.h"
+
+#include <algorithm>
+
+static void run_indices(WorkerPool &pool, const WorkerJob &job, size_t count, unsigned worker)
+{
+	size_t index;
+	while ((index = pool.next.fetch_add(1)) < count)
+		job(index, worker);
+}
+
+static void worker_thread(WorkerPool &pool, unsigned worker)
+{
+	uint64_t seen = 0;
+	std::unique_lock<std::mutex> lock(pool.mutex);
+	while (true)
+	{
+		pool.started.wait(lock, [&] { return pool.stopping || pool.generation != seen; });
+		if (pool.stopping)
+			return;
+		seen = pool.generation;
+		const WorkerJob &job = *pool.job;
+		size_t count = pool.count;
+		lock.unlock();
+		run_indices(pool, job, count, worker);
+		lock.lock();
+		if (--pool.busy == 0)
+			pool.finished.notify_one();
+	}
+}
+
+void worker_pool_start(WorkerPool &pool, unsigned threads)
+{
+	if (!threads)
+		threads = std::max(1u, std::thread::hardware_concurrency());
+	for (unsigned worker = 1; worker < threads; worker++)
+		pool.threads.emplace_back(worker_thread, std::ref(pool), worker);
+}
+
+void worker_pool_stop(WorkerPool &pool)
+{
+	{
+		std::lock_guard<std::mutex> lock(pool.mutex);
+		pool.stopping = true;
+	}
+	pool.started.notify_all();
+	for (auto &thread : pool.threads)
+		thread.join();
+	pool.threads.clear();
+}
+
+unsigned worker_pool_size(const WorkerPool &pool)
+{
+	return unsigned(pool.threads.size()) + 1;
+}
+
+void run_parallel(WorkerPool &pool, size_t count, const WorkerJob &job)
+{
+	if (count <= 1 || pool.threads.empty())
+	{
+		for (size_t index = 0; index < count; index++)
+			job(index, 0);
+		return;
+	}
+	{
+		std::lock_guard<std::mutex> lock(pool.mutex);
+		pool.job = &job;
+		pool.count = count;
+		pool.next.store(0);
+		pool.busy = unsigned(pool.threads.size());
+		pool.generation++;
+	}
+	pool.started.notify_all();
+	run_indices(pool, job, count, 0);
+	std::unique_lock<std::mutex> lock(pool.mutex);
+	pool.finished.wait(lock, [&] { return pool.busy == 0; });
+	pool.job = nullptr;
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// A fixed set of threads that run one job at a time over a range of
+// indices, fork-join style. The calling thread works on the job too and
+// returns once every index is done. Indices are handed out one at a time,
+// so a few slow items do not leave the other threads idle.
+
+typedef std::function<void(size_t index, unsigned worker)> WorkerJob;
+
+struct WorkerPool
+{
+	std::vector<std::thread> threads;
+	std::mutex mutex;
+	std::condition_variable started;
+	std::condition_variable finished;
+	const WorkerJob *job = nullptr;
+	size_t count = 0;
+	std::atomic<size_t> next{ 0 };
+	// Threads still inside the current job.
+	unsigned busy = 0;
+	uint64_t generation = 0;
+	bool stopping = false;
+};
+
+// threads of 0 uses one per core. The calling thread counts as one of them.
+void worker_pool_start(WorkerPool &pool, unsigned threads);
+void worker_pool_stop(WorkerPool &pool);
+
+// Threads that run a job, the caller included. Worker numbers passed to a
+// job are below this, so jobs can keep scratch space per worker.
+unsigned worker_pool_size(const WorkerPool &pool);
+
+void run_parallel(WorkerPool &pool, size_t count, const WorkerJob &job);
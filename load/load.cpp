@@ -0,0 +1,613 @@
+#include <errno.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "blake3.h"
+
+// End-to-end load harness. Drives a watched directory with scripted
+// workloads and polls the server's target directory until each change
+// shows up there with the right content. Optionally starts the server and
+// the client itself so their CPU time can be reported.
+//
+// The latency of a change runs from the moment the write (or rename, or
+// delete) returns to the first poll that sees the expected content, so it
+// is only as fine as --poll.
+
+extern char **environ;
+
+namespace fs = std::filesystem;
+
+enum class Scenario
+{
+	Small,
+	Large,
+	Save,
+	Checkout,
+	Append,
+	Delete,
+	Count
+};
+
+static const char *scenario_names[int(Scenario::Count)] = { "small", "large", "save", "checkout", "append", "delete" };
+
+struct LoadOptions
+{
+	std::vector<Scenario> scenarios;
+	fs::path watched;
+	fs::path served;
+	std::string server_command;
+	std::string client_command;
+	double duration = 10;
+	double rate = 50;
+	double timeout = 30;
+	double settle = 2;
+	uint32_t poll_ms = 1;
+	uint64_t large_size = 64 << 20;
+	uint32_t checkout_files = 200;
+	uint64_t seed = 1;
+};
+
+// What the served copy of a path has to look like. A newer change to the
+// same path replaces the expectation before it is met.
+struct Expectation
+{
+	Scenario scenario;
+	bool absent = false;
+	uint64_t size = 0;
+	uint8_t digest[BLAKE3_OUT_LEN];
+	uint64_t written_time = 0;
+	uint64_t generation = 0;
+};
+
+struct Results
+{
+	std::vector<uint64_t> latencies[int(Scenario::Count)];
+	uint64_t superseded[int(Scenario::Count)] = {};
+	uint64_t lost[int(Scenario::Count)] = {};
+	uint64_t bytes = 0;
+};
+
+struct Harness
+{
+	LoadOptions options;
+	std::mutex mutex;
+	std::map<std::string, Expectation> pending;
+	uint64_t generation = 0;
+	Results results;
+	std::atomic<bool> stop{ false };
+	// Small files known to have arrived, for the delete workload.
+	std::vector<std::string> synced_small;
+	std::mt19937_64 random;
+};
+
+static uint64_t now_ns()
+{
+	return uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count());
+}
+
+static std::vector<uint8_t> random_data(Harness &harness, size_t size)
+{
+	std::vector<uint8_t> data(size);
+	uint64_t value = harness.random();
+	for (size_t i = 0; i < size; i++)
+	{
+		if (i % 8 == 0)
+			value = harness.random();
+		data[i] = uint8_t(value >> (8 * (i % 8)));
+	}
+	return data;
+}
+
+static bool write_whole_file(const fs::path &path, const std::vector<uint8_t> &data)
+{
+	std::error_code error;
+	fs::create_directories(path.parent_path(), error);
+	FILE *file = fopen(path.c_str(), "wb");
+	if (!file)
+	{
+		fprintf(stderr, "Failed to create %s: %s\n", path.c_str(), strerror(errno));
+		return false;
+	}
+	bool success = fwrite(data.data(), 1, data.size(), file) == data.size();
+	success = fclose(file) == 0 && success;
+	if (!success)
+		fprintf(stderr, "Failed to write %s\n", path.c_str());
+	return success;
+}
+
+static void expect(Harness &harness, Scenario scenario, const std::string &path, const uint8_t *data, size_t size)
+{
+	Expectation expectation;
+	expectation.scenario = scenario;
+	expectation.size = size;
+	blake3_hash(data, size, expectation.digest, 1);
+	expectation.written_time = now_ns();
+	std::lock_guard<std::mutex> lock(harness.mutex);
+	expectation.generation = ++harness.generation;
+	auto it = harness.pending.find(path);
+	if (it != harness.pending.end())
+	{
+		harness.results.superseded[int(it->second.scenario)]++;
+		it->second = expectation;
+	}
+	else
+	{
+		harness.pending.emplace(path, expectation);
+	}
+}
+
+static void expect_absent(Harness &harness, Scenario scenario, const std::string &path)
+{
+	Expectation expectation;
+	expectation.scenario = scenario;
+	expectation.absent = true;
+	expectation.written_time = now_ns();
+	std::lock_guard<std::mutex> lock(harness.mutex);
+	expectation.generation = ++harness.generation;
+	auto it = harness.pending.find(path);
+	if (it != harness.pending.end())
+	{
+		harness.results.superseded[int(it->second.scenario)]++;
+		it->second = expectation;
+	}
+	else
+	{
+		harness.pending.emplace(path, expectation);
+	}
+}
+
+static void write_expected(Harness &harness, Scenario scenario, const std::string &path, const std::vector<uint8_t> &data)
+{
+	if (write_whole_file(harness.options.watched / path, data))
+		expect(harness, scenario, path, data.data(), data.size());
+}
+
+// Many small files, the common case.
+static void run_small(Harness &harness, uint64_t op)
+{
+	size_t size = 1024 + harness.random() % (16 * 1024);
+	write_expected(harness, Scenario::Small, "small/file" + std::to_string(op % 1000), random_data(harness, size));
+}
+
+static void run_large(Harness &harness, uint64_t op)
+{
+	write_expected(harness, Scenario::Large, "large/file" + std::to_string(op % 4) + ".bin", random_data(harness, harness.options.large_size));
+}
+
+// What most editors do on save: write a temporary file next to the
+// document and rename it over the original.
+static void run_save(Harness &harness, uint64_t op)
+{
+	std::string path = "save/document" + std::to_string(op % 10) + ".txt";
+	std::string temporary = path + ".tmp~";
+	std::vector<uint8_t> data = random_data(harness, 2048 + harness.random() % 8192);
+	if (!write_whole_file(harness.options.watched / temporary, data))
+		return;
+	std::error_code error;
+	fs::rename(harness.options.watched / temporary, harness.options.watched / path, error);
+	if (error)
+	{
+		fprintf(stderr, "Failed to rename %s: %s\n", temporary.c_str(), error.message().c_str());
+		return;
+	}
+	expect(harness, Scenario::Save, path, data.data(), data.size());
+	expect_absent(harness, Scenario::Save, temporary);
+}
+
+// A branch switch: a burst of creates, rewrites and deletes across a
+// directory tree, as fast as the filesystem takes them.
+static void run_checkout(Harness &harness, uint64_t op)
+{
+	std::string base = "checkout/tree" + std::to_string(op % 2) + "/";
+	uint32_t count = harness.options.checkout_files;
+	for (uint32_t i = 0; i < count; i++)
+	{
+		std::string path = base + "dir" + std::to_string(i % 16) + "/file" + std::to_string(i);
+		if (harness.random() % 4 == 0)
+		{
+			std::error_code error;
+			if (fs::remove(harness.options.watched / path, error))
+				expect_absent(harness, Scenario::Checkout, path);
+			continue;
+		}
+		write_expected(harness, Scenario::Checkout, path, random_data(harness, 512 + harness.random() % 4096));
+	}
+}
+
+// A log that only grows. A new file is started once it gets big.
+static void run_append(Harness &harness, uint64_t op)
+{
+	static std::vector<uint8_t> content;
+	static uint64_t log_number = 0;
+	if (content.size() >= (64 << 20))
+	{
+		content.clear();
+		log_number++;
+	}
+	std::string path = "append/log" + std::to_string(log_number) + ".txt";
+	std::vector<uint8_t> line = random_data(harness, 4096);
+	fs::path full_path = harness.options.watched / path;
+	std::error_code error;
+	fs::create_directories(full_path.parent_path(), error);
+	FILE *file = fopen(full_path.c_str(), "ab");
+	if (!file)
+	{
+		fprintf(stderr, "Failed to open %s: %s\n", full_path.c_str(), strerror(errno));
+		return;
+	}
+	bool success = fwrite(line.data(), 1, line.size(), file) == line.size();
+	success = fclose(file) == 0 && success;
+	if (!success)
+		return;
+	content.insert(content.end(), line.begin(), line.end());
+	expect(harness, Scenario::Append, path, content.data(), content.size());
+	(void)op;
+}
+
+static void run_delete(Harness &harness, uint64_t op)
+{
+	std::string path;
+	{
+		std::lock_guard<std::mutex> lock(harness.mutex);
+		if (harness.synced_small.empty())
+			return;
+		size_t index = harness.random() % harness.synced_small.size();
+		path = harness.synced_small[index];
+		harness.synced_small[index] = harness.synced_small.back();
+		harness.synced_small.pop_back();
+	}
+	std::error_code error;
+	if (fs::remove(harness.options.watched / path, error))
+		expect_absent(harness, Scenario::Delete, path);
+	(void)op;
+}
+
+static void run_operation(Harness &harness, Scenario scenario, uint64_t op)
+{
+	switch (scenario)
+	{
+	case Scenario::Small:
+		run_small(harness, op);
+		break;
+	case Scenario::Large:
+		run_large(harness, op);
+		break;
+	case Scenario::Save:
+		run_save(harness, op);
+		break;
+	case Scenario::Checkout:
+		run_checkout(harness, op);
+		break;
+	case Scenario::Append:
+		run_append(harness, op);
+		break;
+	case Scenario::Delete:
+		run_delete(harness, op);
+		break;
+	default:
+		break;
+	}
+}
+
+static bool hash_file(const fs::path &path, uint64_t size, uint8_t (&digest)[BLAKE3_OUT_LEN])
+{
+	FILE *file = fopen(path.c_str(), "rb");
+	if (!file)
+		return false;
+	Blake3Hasher hasher;
+	blake3_init(hasher);
+	std::vector<uint8_t> buffer(1 << 20);
+	uint64_t total = 0;
+	size_t read;
+	while ((read = fread(buffer.data(), 1, buffer.size(), file)) > 0)
+	{
+		blake3_update(hasher, buffer.data(), read);
+		total += read;
+	}
+	fclose(file);
+	blake3_final(hasher, digest);
+	return total == size;
+}
+
+// Only hashes a served file once its size matches, so a large file that is
+// still arriving costs a stat per poll.
+static bool matches(const fs::path &path, const Expectation &expectation)
+{
+	struct stat info;
+	if (stat(path.c_str(), &info) != 0)
+		return expectation.absent;
+	if (expectation.absent || uint64_t(info.st_size) != expectation.size)
+		return false;
+	uint8_t digest[BLAKE3_OUT_LEN];
+	return hash_file(path, expectation.size, digest) && memcmp(digest, expectation.digest, sizeof(digest)) == 0;
+}
+
+static void checker_thread(Harness &harness)
+{
+	std::vector<std::pair<std::string, Expectation>> snapshot;
+	while (true)
+	{
+		bool stopping = harness.stop.load();
+		{
+			std::lock_guard<std::mutex> lock(harness.mutex);
+			snapshot.assign(harness.pending.begin(), harness.pending.end());
+		}
+		if (snapshot.empty() && stopping)
+			return;
+		for (auto &entry : snapshot)
+		{
+			if (!matches(harness.options.served / entry.first, entry.second))
+				continue;
+			uint64_t seen = now_ns();
+			std::lock_guard<std::mutex> lock(harness.mutex);
+			auto it = harness.pending.find(entry.first);
+			if (it == harness.pending.end() || it->second.generation != entry.second.generation)
+				continue;
+			harness.results.latencies[int(entry.second.scenario)].push_back(seen - entry.second.written_time);
+			harness.results.bytes += entry.second.size;
+			if (entry.second.scenario == Scenario::Small)
+				harness.synced_small.push_back(entry.first);
+			harness.pending.erase(it);
+		}
+		std::this_thread::sleep_for(std::chrono::milliseconds(harness.options.poll_ms));
+	}
+}
+
+// Arguments are separated by spaces; there is no quoting.
+static pid_t start_process(const std::string &command)
+{
+	std::vector<std::string> words;
+	size_t begin = 0;
+	while (begin < command.size())
+	{
+		size_t end = command.find(' ', begin);
+		if (end == std::string::npos)
+			end = command.size();
+		if (end > begin)
+			words.push_back(command.substr(begin, end - begin));
+		begin = end + 1;
+	}
+	if (words.empty())
+		return -1;
+	std::vector<char *> argv;
+	for (auto &word : words)
+		argv.push_back(&word[0]);
+	argv.push_back(nullptr);
+	pid_t pid;
+	int error = posix_spawnp(&pid, argv[0], nullptr, nullptr, argv.data(), environ);
+	if (error)
+	{
+		fprintf(stderr, "Failed to start %s: %s\n", argv[0], strerror(error));
+		return -1;
+	}
+	return pid;
+}
+
+static double cpu_seconds(const struct rusage &usage)
+{
+	return double(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) + double(usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+// Interrupts the process the way Ctrl-C would and returns the CPU time it
+// used, or a negative value if it could not be collected.
+static double stop_process(pid_t pid)
+{
+	if (pid <= 0)
+		return -1;
+	kill(pid, SIGINT);
+	for (int i = 0; i < 50; i++)
+	{
+		int status;
+		struct rusage usage;
+		pid_t done = wait4(pid, &status, WNOHANG, &usage);
+		if (done == pid)
+			return cpu_seconds(usage);
+		std::this_thread::sleep_for(std::chrono::milliseconds(100));
+	}
+	kill(pid, SIGKILL);
+	int status;
+	struct rusage usage;
+	if (wait4(pid, &status, 0, &usage) != pid)
+		return -1;
+	return cpu_seconds(usage);
+}
+
+static double percentile(std::vector<uint64_t> &values, double fraction)
+{
+	if (values.empty())
+		return 0;
+	size_t index = std::min(values.size() - 1, size_t(fraction * double(values.size())));
+	std::nth_element(values.begin(), values.begin() + index, values.end());
+	return double(values[index]) / 1e6;
+}
+
+static void print_results(Harness &harness, double elapsed, double server_cpu, double client_cpu)
+{
+	Results &results = harness.results;
+	printf("%-10s %8s %10s %10s %10s %10s %8s\n", "scenario", "synced", "p50 ms", "p99 ms", "max ms", "superseded", "lost");
+	for (Scenario scenario : harness.options.scenarios)
+	{
+		std::vector<uint64_t> &latencies = results.latencies[int(scenario)];
+		double p50 = percentile(latencies, 0.5);
+		double p99 = percentile(latencies, 0.99);
+		double max = latencies.empty() ? 0 : double(*std::max_element(latencies.begin(), latencies.end())) / 1e6;
+		printf("%-10s %8zu %10.2f %10.2f %10.2f %10llu %8llu\n", scenario_names[int(scenario)], latencies.size(), p50, p99, max,
+			(unsigned long long)results.superseded[int(scenario)], (unsigned long long)results.lost[int(scenario)]);
+	}
+	printf("synced %.1f MB in %.1f s, %.1f MB/s\n", double(results.bytes) / (1024 * 1024), elapsed, double(results.bytes) / (1024 * 1024) / elapsed);
+
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	printf("cpu: load %.2f s", cpu_seconds(usage));
+	if (server_cpu >= 0)
+		printf(", server %.2f s", server_cpu);
+	if (client_cpu >= 0)
+		printf(", client %.2f s", client_cpu);
+	printf("\n");
+}
+
+static bool parse_scenarios(const std::string &list, std::vector<Scenario> &scenarios)
+{
+	size_t begin = 0;
+	while (begin <= list.size())
+	{
+		size_t end = list.find(',', begin);
+		if (end == std::string::npos)
+			end = list.size();
+		std::string name = list.substr(begin, end - begin);
+		auto found = std::find_if(std::begin(scenario_names), std::end(scenario_names), [&name](const char *scenario) { return name == scenario; });
+		if (found == std::end(scenario_names))
+		{
+			fprintf(stderr, "Unknown scenario '%s'\n", name.c_str());
+			return false;
+		}
+		scenarios.push_back(Scenario(found - std::begin(scenario_names)));
+		begin = end + 1;
+	}
+	return true;
+}
+
+static void usage()
+{
+	fprintf(stderr, "usage: win_drop_load [--scenarios small,large,save,checkout,append,delete] [--duration seconds] [--rate ops/s]\n"
+		"                     [--timeout seconds] [--settle seconds] [--poll ms] [--large-size MB] [--checkout-files n] [--seed n]\n"
+		"                     [--server command] [--client command] watched-directory served-directory\n");
+}
+
+int main(int argc, char **argv)
+{
+	LoadOptions options;
+	int arg = 1;
+	while (arg < argc && strncmp(argv[arg], "--", 2) == 0)
+	{
+		std::string name = argv[arg];
+		if (arg + 1 >= argc)
+		{
+			usage();
+			return 1;
+		}
+		std::string value = argv[arg + 1];
+		if (name == "--scenarios")
+		{
+			if (!parse_scenarios(value, options.scenarios))
+				return 1;
+		}
+		else if (name == "--duration")
+			options.duration = atof(value.c_str());
+		else if (name == "--rate" && atof(value.c_str()) > 0)
+			options.rate = atof(value.c_str());
+		else if (name == "--timeout")
+			options.timeout = atof(value.c_str());
+		else if (name == "--settle")
+			options.settle = atof(value.c_str());
+		else if (name == "--poll")
+			options.poll_ms = uint32_t(atoi(value.c_str()));
+		else if (name == "--large-size" && atof(value.c_str()) > 0)
+			options.large_size = uint64_t(atof(value.c_str()) * 1024 * 1024);
+		else if (name == "--checkout-files" && atoi(value.c_str()) > 0)
+			options.checkout_files = uint32_t(atoi(value.c_str()));
+		else if (name == "--seed")
+			options.seed = strtoull(value.c_str(), nullptr, 10);
+		else if (name == "--server")
+			options.server_command = value;
+		else if (name == "--client")
+			options.client_command = value;
+		else
+		{
+			usage();
+			return 1;
+		}
+		arg += 2;
+	}
+	if (argc - arg != 2)
+	{
+		usage();
+		return 1;
+	}
+	options.watched = argv[arg];
+	options.served = argv[arg + 1];
+	if (options.scenarios.empty())
+	{
+		for (int scenario = 0; scenario < int(Scenario::Count); scenario++)
+			options.scenarios.push_back(Scenario(scenario));
+	}
+
+	Harness harness;
+	harness.options = options;
+	harness.random.seed(options.seed);
+
+	pid_t server = -1;
+	pid_t client = -1;
+	if (!options.server_command.empty() && (server = start_process(options.server_command)) < 0)
+		return 1;
+	if (!options.client_command.empty() && (client = start_process(options.client_command)) < 0)
+	{
+		stop_process(server);
+		return 1;
+	}
+	std::this_thread::sleep_for(std::chrono::duration<double>(options.settle));
+
+	std::thread checker(checker_thread, std::ref(harness));
+	uint64_t start = now_ns();
+	uint64_t interval = uint64_t(1e9 / options.rate);
+	uint64_t end = start + uint64_t(options.duration * 1e9);
+	uint64_t op = 0;
+	for (uint64_t next = start; next < end; next += interval, op++)
+	{
+		uint64_t now = now_ns();
+		if (next > now)
+			std::this_thread::sleep_for(std::chrono::nanoseconds(next - now));
+		Scenario scenario = options.scenarios[op % options.scenarios.size()];
+		run_operation(harness, scenario, op / options.scenarios.size());
+	}
+
+	// Whatever has not arrived within the timeout is counted as lost.
+	uint64_t deadline = now_ns() + uint64_t(options.timeout * 1e9);
+	while (now_ns() < deadline)
+	{
+		{
+			std::lock_guard<std::mutex> lock(harness.mutex);
+			if (harness.pending.empty())
+				break;
+		}
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	}
+	{
+		std::lock_guard<std::mutex> lock(harness.mutex);
+		for (auto &entry : harness.pending)
+		{
+			fprintf(stderr, "Never arrived: %s\n", entry.first.c_str());
+			harness.results.lost[int(entry.second.scenario)]++;
+		}
+		harness.pending.clear();
+	}
+	harness.stop = true;
+	checker.join();
+	double elapsed = double(now_ns() - start) / 1e9;
+
+	double client_cpu = stop_process(client);
+	double server_cpu = stop_process(server);
+	print_results(harness, elapsed, server_cpu, client_cpu);
+	return 0;
+}
@@ -0,0 +1,388 @@
+#include "catalog.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <vector>
+
+#define CATALOG_VERSION 2
+#define CATALOG_RECORD_DEAD 1
+#define CATALOG_MIN_CAPACITY (uint64_t(1) << 20)
+
+static uint64_t record_size_for(size_t path_size)
+{
+	uint64_t size = sizeof(CatalogRecord) + path_size;
+	return (size + 7) & ~uint64_t(7);
+}
+
+static CatalogFileHeader *catalog_header(const Catalog &catalog)
+{
+	return reinterpret_cast<CatalogFileHeader *>(catalog.data);
+}
+
+static CatalogRecord *catalog_record(const Catalog &catalog, uint64_t offset)
+{
+	return reinterpret_cast<CatalogRecord *>(catalog.data + offset);
+}
+
+static const char *record_path(const CatalogRecord *record)
+{
+	return reinterpret_cast<const char *>(record + 1);
+}
+
+static void unmap_catalog(Catalog &catalog)
+{
+	if (catalog.data)
+		UnmapViewOfFile(catalog.data);
+	if (catalog.mapping)
+		CloseHandle(catalog.mapping);
+	catalog.data = nullptr;
+	catalog.mapping = NULL;
+}
+
+static bool map_catalog(Catalog &catalog, uint64_t capacity)
+{
+	unmap_catalog(catalog);
+	catalog.mapping = CreateFileMappingW(catalog.file, NULL, PAGE_READWRITE, DWORD(capacity >> 32), DWORD(capacity), NULL);
+	if (!catalog.mapping)
+	{
+		fprintf(stderr, "Failed to map catalog %s: %s\n", catalog.file_name.c_str(), error_to_string(GetLastError()).c_str());
+		return false;
+	}
+	catalog.data = reinterpret_cast<uint8_t *>(MapViewOfFile(catalog.mapping, FILE_MAP_ALL_ACCESS, 0, 0, 0));
+	if (!catalog.data)
+	{
+		fprintf(stderr, "Failed to map view of catalog %s: %s\n", catalog.file_name.c_str(), error_to_string(GetLastError()).c_str());
+		CloseHandle(catalog.mapping);
+		catalog.mapping = NULL;
+		return false;
+	}
+	catalog.capacity = capacity;
+	return true;
+}
+
+static void reset_catalog(Catalog &catalog)
+{
+	CatalogFileHeader *header = catalog_header(catalog);
+	memset(header, 0, sizeof(*header));
+	memcpy(header->magic, "PDC0", 4);
+	header->version = CATALOG_VERSION;
+	header->used = sizeof(CatalogFileHeader);
+	catalog.index.clear();
+}
+
+static void kill_record(Catalog &catalog, uint64_t offset)
+{
+	CatalogFileHeader *header = catalog_header(catalog);
+	CatalogRecord *record = catalog_record(catalog, offset);
+	record->flags |= CATALOG_RECORD_DEAD;
+	header->live--;
+	header->dead_bytes += record->record_size;
+}
+
+static bool scan_catalog(Catalog &catalog)
+{
+	CatalogFileHeader *header = catalog_header(catalog);
+	if (memcmp(header->magic, "PDC0", 4) || header->version != CATALOG_VERSION
+		|| header->used < sizeof(CatalogFileHeader) || header->used > catalog.capacity)
+		return false;
+
+	uint64_t live = 0;
+	uint64_t dead_bytes = 0;
+	uint64_t offset = sizeof(CatalogFileHeader);
+	while (offset < header->used)
+	{
+		CatalogRecord *record = catalog_record(catalog, offset);
+		if (header->used - offset < sizeof(CatalogRecord)
+			|| record->record_size != record_size_for(record->path_size)
+			|| record->record_size > header->used - offset)
+			return false;
+		if (!(record->flags & CATALOG_RECORD_DEAD))
+		{
+			auto inserted = catalog.index.emplace(std::string(record_path(record), record->path_size), offset);
+			if (!inserted.second)
+			{
+				catalog_record(catalog, inserted.first->second)->flags |= CATALOG_RECORD_DEAD;
+				dead_bytes += catalog_record(catalog, inserted.first->second)->record_size;
+				inserted.first->second = offset;
+			}
+			else
+			{
+				live++;
+			}
+		}
+		else
+		{
+			dead_bytes += record->record_size;
+		}
+		offset += record->record_size;
+	}
+	header->live = live;
+	header->dead_bytes = dead_bytes;
+	return true;
+}
+
+static HANDLE open_catalog_file(const std::string &file_name, DWORD disposition)
+{
+	return CreateFileW(s2ws(file_name).c_str(),
+		GENERIC_READ | GENERIC_WRITE,
+		NULL,
+		NULL,
+		disposition,
+		NULL,
+		NULL);
+}
+
+// Rewrites the live records into a fresh file and swaps it in, so a crash
+// halfway leaves the old catalog untouched.
+static bool compact_catalog(Catalog &catalog)
+{
+	std::string tmp_name = catalog.file_name + ".tmp";
+	HANDLE tmp_file = open_catalog_file(tmp_name, CREATE_ALWAYS);
+	if (tmp_file == INVALID_HANDLE_VALUE)
+	{
+		fprintf(stderr, "Failed to create catalog %s: %s\n", tmp_name.c_str(), error_to_string(GetLastError()).c_str());
+		return false;
+	}
+
+	std::vector<uint8_t> buffer;
+	buffer.reserve(size_t(catalog_header(catalog)->used - catalog_header(catalog)->dead_bytes));
+	buffer.resize(sizeof(CatalogFileHeader));
+	CatalogFileHeader *header = catalog_header(catalog);
+	uint64_t offset = sizeof(CatalogFileHeader);
+	while (offset < header->used)
+	{
+		CatalogRecord *record = catalog_record(catalog, offset);
+		if (!(record->flags & CATALOG_RECORD_DEAD))
+		{
+			const uint8_t *begin = reinterpret_cast<const uint8_t *>(record);
+			buffer.insert(buffer.end(), begin, begin + record->record_size);
+		}
+		offset += record->record_size;
+	}
+	CatalogFileHeader compacted = *header;
+	compacted.used = buffer.size();
+	compacted.dead_bytes = 0;
+	memcpy(buffer.data(), &compacted, sizeof(compacted));
+
+	DWORD bytes_written;
+	bool written = WriteFile(tmp_file, buffer.data(), DWORD(buffer.size()), &bytes_written, NULL) && bytes_written == buffer.size();
+	CloseHandle(tmp_file);
+	if (!written)
+	{
+		fprintf(stderr, "Failed to write catalog %s: %s\n", tmp_name.c_str(), error_to_string(GetLastError()).c_str());
+		DeleteFileW(s2ws(tmp_name).c_str());
+		return false;
+	}
+
+	// The old file is kept whole when it cannot be replaced.
+	uint64_t capacity = std::max(CATALOG_MIN_CAPACITY, uint64_t(buffer.size()));
+	uint64_t used = header->used;
+	unmap_catalog(catalog);
+	CloseHandle(catalog.file);
+	catalog.file = INVALID_HANDLE_VALUE;
+	if (!MoveFileExW(s2ws(tmp_name).c_str(), s2ws(catalog.file_name).c_str(), MOVEFILE_REPLACE_EXISTING))
+	{
+		fprintf(stderr, "Failed to replace catalog %s: %s\n", catalog.file_name.c_str(), error_to_string(GetLastError()).c_str());
+		DeleteFileW(s2ws(tmp_name).c_str());
+		capacity = std::max(capacity, used);
+	}
+
+	catalog.file = open_catalog_file(catalog.file_name, OPEN_ALWAYS);
+	if (catalog.file == INVALID_HANDLE_VALUE)
+	{
+		fprintf(stderr, "Failed to reopen catalog %s: %s\n", catalog.file_name.c_str(), error_to_string(GetLastError()).c_str());
+		return false;
+	}
+	catalog.index.clear();
+	if (!map_catalog(catalog, capacity))
+		return false;
+	if (!scan_catalog(catalog))
+		reset_catalog(catalog);
+	return true;
+}
+
+// Dead records are dropped once they take up more than half of the file.
+static bool worth_compacting(const CatalogFileHeader *header)
+{
+	return header->dead_bytes > CATALOG_MIN_CAPACITY && header->dead_bytes > header->used / 2;
+}
+
+// Makes room for record_size more bytes. A full catalog is compacted
+// before it is grown, so a long running server does not keep every
+// record it ever wrote.
+static bool reserve_catalog(Catalog &catalog, uint64_t record_size)
+{
+	if (catalog.capacity >= catalog_header(catalog)->used + record_size)
+		return true;
+	if (worth_compacting(catalog_header(catalog)) && !compact_catalog(catalog) && !catalog.data)
+		return false;
+	uint64_t needed = catalog_header(catalog)->used + record_size;
+	uint64_t capacity = catalog.capacity;
+	while (capacity < needed)
+		capacity *= 2;
+	return capacity == catalog.capacity || map_catalog(catalog, capacity);
+}
+
+bool open_catalog(Catalog &catalog, const std::string &target_directory)
+{
+	catalog.file_name = target_directory + "\\" CATALOG_FILE_NAME;
+	catalog.file = open_catalog_file(catalog.file_name, OPEN_ALWAYS);
+	if (catalog.file == INVALID_HANDLE_VALUE)
+	{
+		fprintf(stderr, "Failed to open catalog %s: %s\n", catalog.file_name.c_str(), error_to_string(GetLastError()).c_str());
+		return false;
+	}
+	LARGE_INTEGER file_size;
+	if (!GetFileSizeEx(catalog.file, &file_size))
+	{
+		fprintf(stderr, "Failed to read catalog %s size: %s\n", catalog.file_name.c_str(), error_to_string(GetLastError()).c_str());
+		close_catalog(catalog);
+		return false;
+	}
+	bool existed = uint64_t(file_size.QuadPart) >= sizeof(CatalogFileHeader);
+	if (!map_catalog(catalog, std::max(CATALOG_MIN_CAPACITY, uint64_t(file_size.QuadPart))))
+	{
+		close_catalog(catalog);
+		return false;
+	}
+
+	if (!existed || !scan_catalog(catalog))
+	{
+		if (existed)
+			fprintf(stderr, "Catalog %s is corrupt. Starting with an empty catalog\n", catalog.file_name.c_str());
+		reset_catalog(catalog);
+	}
+	if (worth_compacting(catalog_header(catalog)))
+		compact_catalog(catalog);
+	return catalog.data != nullptr;
+}
+
+void close_catalog(Catalog &catalog)
+{
+	unmap_catalog(catalog);
+	if (catalog.file != INVALID_HANDLE_VALUE)
+		CloseHandle(catalog.file);
+	catalog.file = INVALID_HANDLE_VALUE;
+	catalog.index.clear();
+}
+
+void validate_catalog(Catalog &catalog)
+{
+	uint64_t stale = 0;
+	for (auto it = catalog.index.begin(); it != catalog.index.end();)
+	{
+		const CatalogRecord *record = catalog_record(catalog, it->second);
+		WIN32_FILE_ATTRIBUTE_DATA attributes;
+		bool valid = GetFileAttributesExW(s2ws(it->first).c_str(), GetFileExInfoStandard, &attributes)
+			&& !(attributes.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+			&& ((uint64_t(attributes.nFileSizeHigh) << 32) | attributes.nFileSizeLow) == record->size
+			&& ((uint64_t(attributes.ftLastWriteTime.dwHighDateTime) << 32) | attributes.ftLastWriteTime.dwLowDateTime) == record->mtime;
+		if (valid)
+		{
+			++it;
+			continue;
+		}
+		kill_record(catalog, it->second);
+		it = catalog.index.erase(it);
+		stale++;
+	}
+	fprintf(stderr, "Catalog has %zu entries. Dropped %llu stale entries\n", catalog.index.size(), (unsigned long long)stale);
+}
+
+const CatalogRecord *catalog_lookup(const Catalog &catalog, const std::string &path)
+{
+	auto it = catalog.index.find(path);
+	if (it == catalog.index.end())
+		return nullptr;
+	return catalog_record(catalog, it->second);
+}
+
+bool catalog_update(Catalog &catalog, const std::string &path, HashAlgorithm algorithm, const uint8_t *digest, uint64_t size, uint64_t mtime)
+{
+	uint64_t record_size = record_size_for(path.size());
+	if (!reserve_catalog(catalog, record_size))
+		return false;
+
+	CatalogFileHeader *header = catalog_header(catalog);
+	uint64_t offset = header->used;
+	CatalogRecord *record = catalog_record(catalog, offset);
+	memset(record, 0, size_t(record_size));
+	record->record_size = uint32_t(record_size);
+	record->algorithm = algorithm;
+	memcpy(record->digest, digest, hash_digest_size(algorithm));
+	record->path_size = uint32_t(path.size());
+	record->size = size;
+	record->mtime = mtime;
+	memcpy(record + 1, path.data(), path.size());
+	header->used += record_size;
+	header->live++;
+
+	auto inserted = catalog.index.emplace(path, offset);
+	if (!inserted.second)
+	{
+		kill_record(catalog, inserted.first->second);
+		inserted.first->second = offset;
+	}
+	return true;
+}
+
+void catalog_remove(Catalog &catalog, const std::string &path)
+{
+	auto it = catalog.index.find(path);
+	if (it == catalog.index.end())
+		return;
+	kill_record(catalog, it->second);
+	catalog.index.erase(it);
+}
+
+bool catalog_rename(Catalog &catalog, const std::string &from, const std::string &to)
+{
+	auto it = catalog.index.find(from);
+	if (it == catalog.index.end())
+	{
+		catalog_remove(catalog, to);
+		return true;
+	}
+	CatalogRecord record = *catalog_record(catalog, it->second);
+	catalog_remove(catalog, from);
+	return catalog_update(catalog, to, record.algorithm, record.digest, record.size, record.mtime);
+}
+
+// The entries below a directory sort together, but paths arrive with
+// either separator and the two sort apart, so each gets its own range.
+template<typename Visit>
+static void for_each_below(Catalog &catalog, const std::string &directory, Visit visit)
+{
+	std::vector<std::string> paths;
+	for (char separator : { '\\', '/' })
+	{
+		std::string first = directory + separator;
+		for (auto it = catalog.index.lower_bound(first); it != catalog.index.end() && it->first.compare(0, first.size(), first) == 0; ++it)
+			paths.push_back(it->first);
+	}
+	for (auto &path : paths)
+		visit(path);
+}
+
+void catalog_remove_directory(Catalog &catalog, const std::string &directory)
+{
+	for_each_below(catalog, directory, [&catalog](const std::string &path) {
+		catalog_remove(catalog, path);
+	});
+}
+
+bool catalog_rename_directory(Catalog &catalog, const std::string &from, const std::string &to)
+{
+	bool success = true;
+	for_each_below(catalog, from, [&](const std::string &path) {
+		success = catalog_rename(catalog, path, to + path.substr(from.size())) && success;
+	});
+	return success;
+}
+
+// NTFS names are case-insensitive, so ".PEXIP_DROP_CATALOG" is the same file.
+bool is_catalog_path(const std::string &path)
+{
+	return _stricmp(path.c_str(), CATALOG_FILE_NAME) == 0 || _stricmp(path.c_str(), CATALOG_FILE_NAME ".tmp") == 0;
+}
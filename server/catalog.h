@@ -0,0 +1,63 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <string>
+#include <map>
+
+#include "win_global.h"
+#include "protocol.h"
+
+#define CATALOG_FILE_NAME ".pexip_drop_catalog"
+
+// One record in the mapped catalog file. Records are appended and never
+// moved while the server runs; an update marks the old record dead and
+// appends a new one. The path bytes follow the record, padded to 8 bytes.
+struct CatalogRecord
+{
+	uint32_t record_size;
+	uint32_t flags;
+	HashAlgorithm algorithm;
+	uint32_t path_size;
+	uint8_t digest[MAX_DIGEST_SIZE];
+	uint64_t size;
+	uint64_t mtime;
+};
+
+struct CatalogFileHeader
+{
+	char magic[4];
+	uint32_t version;
+	uint64_t used;
+	uint64_t live;
+	uint64_t dead_bytes;
+};
+
+struct Catalog
+{
+	std::string file_name;
+	HANDLE file = INVALID_HANDLE_VALUE;
+	HANDLE mapping = NULL;
+	uint8_t *data = nullptr;
+	uint64_t capacity = 0;
+	// Ordered, so the entries below a directory are one range.
+	std::map<std::string, uint64_t> index;
+};
+
+bool open_catalog(Catalog &catalog, const std::string &target_directory);
+void close_catalog(Catalog &catalog);
+
+// Drops every entry whose size or last write time no longer matches the
+// file on disk. Only the file attributes are read, nothing is rehashed.
+void validate_catalog(Catalog &catalog);
+
+const CatalogRecord *catalog_lookup(const Catalog &catalog, const std::string &path);
+// Stores hash_digest_size(algorithm) bytes of digest.
+bool catalog_update(Catalog &catalog, const std::string &path, HashAlgorithm algorithm, const uint8_t *digest, uint64_t size, uint64_t mtime);
+void catalog_remove(Catalog &catalog, const std::string &path);
+bool catalog_rename(Catalog &catalog, const std::string &from, const std::string &to);
+// Every entry below the directory.
+void catalog_remove_directory(Catalog &catalog, const std::string &directory);
+bool catalog_rename_directory(Catalog &catalog, const std::string &from, const std::string &to);
+
+bool is_catalog_path(const std::string &path);
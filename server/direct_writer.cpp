@@ -0,0 +1,174 @@
+#include "direct_writer.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+
+#include "stats.h"
+#include "trace.h"
+
+static bool enable_lock_memory_privilege()
+{
+	HANDLE token;
+	if (!OpenProcessToken(GetCurrentProcess(), TOKEN_ADJUST_PRIVILEGES | TOKEN_QUERY, &token))
+		return false;
+	TOKEN_PRIVILEGES privileges;
+	privileges.PrivilegeCount = 1;
+	privileges.Privileges[0].Attributes = SE_PRIVILEGE_ENABLED;
+	// AdjustTokenPrivileges succeeds even when the privilege is not held.
+	bool enabled = LookupPrivilegeValueW(NULL, SE_LOCK_MEMORY_NAME, &privileges.Privileges[0].Luid)
+		&& AdjustTokenPrivileges(token, FALSE, &privileges, 0, NULL, NULL)
+		&& GetLastError() == ERROR_SUCCESS;
+	CloseHandle(token);
+	return enabled;
+}
+
+static uint8_t *allocate_buffers(size_t size, bool &large_pages)
+{
+	size_t large_page = GetLargePageMinimum();
+	large_pages = false;
+	if (large_page && size % large_page == 0 && enable_lock_memory_privilege())
+	{
+		void *memory = VirtualAlloc(NULL, size, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE);
+		if (memory)
+		{
+			large_pages = true;
+			return (uint8_t *)memory;
+		}
+	}
+	// Pages are aligned well beyond any sector size.
+	return (uint8_t *)VirtualAlloc(NULL, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+}
+
+static void writer_thread(DirectWriter &writer)
+{
+	DirectBuffer *buffer;
+	while (pop_wait(writer.filled, buffer))
+	{
+		TraceScope trace("direct_write");
+		trace.bytes = buffer->size;
+		uint64_t start = stats_now();
+		OVERLAPPED ol;
+		memset(&ol, 0, sizeof(ol));
+		ol.Offset = DWORD(buffer->offset);
+		ol.OffsetHigh = DWORD(buffer->offset >> 32);
+		DWORD bytes_written;
+		buffer->error = ERROR_SUCCESS;
+		if (!WriteFile(buffer->file, buffer->data, buffer->size, &bytes_written, &ol))
+			buffer->error = GetLastError();
+		else if (bytes_written != buffer->size)
+			buffer->error = ERROR_WRITE_FAULT;
+		buffer->write_time = stats_now() - start;
+		push_wait(writer.returned, buffer);
+	}
+}
+
+bool direct_writer_start(DirectWriter &writer)
+{
+	writer.memory = allocate_buffers(size_t(DIRECT_BUFFER_SIZE) * DIRECT_BUFFER_COUNT, writer.large_pages);
+	if (!writer.memory)
+	{
+		fprintf(stderr, "Failed to allocate direct write buffers: %s\n", error_to_string(GetLastError()).c_str());
+		writer.options.enabled = false;
+		return false;
+	}
+	writer.idle.clear();
+	for (int i = 0; i < DIRECT_BUFFER_COUNT; i++)
+	{
+		writer.buffers[i].data = writer.memory + size_t(i) * DIRECT_BUFFER_SIZE;
+		writer.idle.push_back(&writer.buffers[i]);
+	}
+	writer.thread = std::thread(writer_thread, std::ref(writer));
+	fprintf(stderr, "Writing files of %llu MB and more without buffering, %s pages\n",
+		(unsigned long long)(writer.options.min_size >> 20), writer.large_pages ? "large" : "small");
+	return true;
+}
+
+void direct_writer_stop(DirectWriter &writer)
+{
+	if (!writer.thread.joinable())
+		return;
+	writer.filled.close();
+	writer.thread.join();
+	VirtualFree(writer.memory, 0, MEM_RELEASE);
+	writer.memory = nullptr;
+}
+
+bool use_direct_write(const DirectWriter &writer, uint64_t size)
+{
+	return writer.options.enabled && writer.memory && size >= writer.options.min_size;
+}
+
+// Unbuffered I/O has to be in whole logical sectors. The physical sector
+// is a multiple of it and avoids read-modify-write on 4K drives.
+static DWORD sector_size(HANDLE file_handle)
+{
+	FILE_STORAGE_INFO info;
+	if (!GetFileInformationByHandleEx(file_handle, FileStorageInfo, &info, sizeof(info)))
+		return 4096;
+	return std::max(info.LogicalBytesPerSector, info.PhysicalBytesPerSectorForPerformance);
+}
+
+// Takes back a buffer the writer thread is done with.
+static bool collect_buffer(DirectWriter &writer, const std::string &path, uint64_t &write_time)
+{
+	DirectBuffer *buffer;
+	pop_wait(writer.returned, buffer);
+	writer.idle.push_back(buffer);
+	write_time += buffer->write_time;
+	if (buffer->error == ERROR_SUCCESS)
+		return true;
+	fprintf(stderr, "Failed to write to file %s: %s\n", path.c_str(), error_to_string(buffer->error).c_str());
+	return false;
+}
+
+bool direct_write(DirectWriter &writer, HANDLE file_handle, const std::string &path, uint64_t size,
+	const std::function<bool(uint8_t *, size_t)> &fill, uint64_t &write_time)
+{
+	uint64_t sector = sector_size(file_handle);
+	uint64_t aligned_size = (size + sector - 1) / sector * sector;
+	// Reserving the space up front keeps a large file in few extents.
+	FILE_ALLOCATION_INFO allocation;
+	allocation.AllocationSize.QuadPart = LONGLONG(aligned_size);
+	SetFileInformationByHandle(file_handle, FileAllocationInfo, &allocation, sizeof(allocation));
+
+	bool success = true;
+	uint64_t offset = 0;
+	while (success && offset < size)
+	{
+		if (writer.idle.empty() && !collect_buffer(writer, path, write_time))
+		{
+			success = false;
+			break;
+		}
+		DirectBuffer *buffer = writer.idle.back();
+		size_t chunk = size_t(std::min(size - offset, uint64_t(DIRECT_BUFFER_SIZE)));
+		if (!fill(buffer->data, chunk))
+		{
+			success = false;
+			break;
+		}
+		size_t padded = size_t((chunk + sector - 1) / sector * sector);
+		memset(buffer->data + chunk, 0, padded - chunk);
+		buffer->file = file_handle;
+		buffer->offset = offset;
+		buffer->size = DWORD(padded);
+		writer.idle.pop_back();
+		push_wait(writer.filled, buffer);
+		offset += chunk;
+	}
+	while (writer.idle.size() < DIRECT_BUFFER_COUNT)
+		success = collect_buffer(writer, path, write_time) && success;
+	if (success && aligned_size != size)
+	{
+		FILE_END_OF_FILE_INFO end_of_file;
+		end_of_file.EndOfFile.QuadPart = LONGLONG(size);
+		if (!SetFileInformationByHandle(file_handle, FileEndOfFileInfo, &end_of_file, sizeof(end_of_file)))
+		{
+			fprintf(stderr, "Failed to set the size of %s: %s\n", path.c_str(), error_to_string(GetLastError()).c_str());
+			success = false;
+		}
+	}
+	return success;
+}
@@ -0,0 +1,74 @@
+#pragma once
+
+#include "win_global.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <functional>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "queue.h"
+
+// Large files are written with FILE_FLAG_NO_BUFFERING, so mirroring them
+// does not push everything else out of the server's file cache. The data is
+// received straight into a small pool of large, sector-aligned buffers. A
+// writer thread writes each full buffer while the next one is received.
+// The pool is backed by large pages when the process may lock memory.
+
+#define DIRECT_BUFFER_SIZE (4 << 20)
+#define DIRECT_BUFFER_COUNT 4
+#define DIRECT_WRITE_MIN (uint64_t(16) << 20)
+
+struct DirectWriteOptions
+{
+	bool enabled = false;
+	// Smaller files go through the file cache as before.
+	uint64_t min_size = DIRECT_WRITE_MIN;
+};
+
+struct DirectBuffer
+{
+	uint8_t *data;
+	HANDLE file;
+	uint64_t offset;
+	DWORD size;
+	// Set by the writer thread.
+	DWORD error;
+	uint64_t write_time;
+};
+
+struct DirectWriter
+{
+	DirectWriter()
+		: filled(DIRECT_BUFFER_COUNT)
+		, returned(DIRECT_BUFFER_COUNT)
+	{}
+
+	DirectWriteOptions options;
+	uint8_t *memory = nullptr;
+	bool large_pages = false;
+	DirectBuffer buffers[DIRECT_BUFFER_COUNT];
+	// Buffers the receiving thread holds. The others are queued for writing
+	// or on their way back.
+	std::vector<DirectBuffer *> idle;
+	SpscQueue<DirectBuffer *> filled;
+	SpscQueue<DirectBuffer *> returned;
+	std::thread thread;
+};
+
+// Allocates the buffers and starts the writer thread. On failure large
+// files are written through the cache.
+bool direct_writer_start(DirectWriter &writer);
+void direct_writer_stop(DirectWriter &writer);
+
+bool use_direct_write(const DirectWriter &writer, uint64_t size);
+
+// Writes size bytes to a file opened with FILE_FLAG_NO_BUFFERING, taking
+// them from fill(data, size) one buffer at a time. The unaligned tail is
+// written padded to a whole sector and cut off again. Returns false if
+// fill or a write fails; every write has finished either way.
+bool direct_write(DirectWriter &writer, HANDLE file_handle, const std::string &path, uint64_t size,
+	const std::function<bool(uint8_t *, size_t)> &fill, uint64_t &write_time);
@@ -0,0 +1,140 @@
+#include "durability.h"
+
+#include <stdio.h>
+
+#include "protocol.h"
+#include "stats.h"
+#include "trace.h"
+
+static void send_acknowledgement(Durability &durability, uint64_t count)
+{
+	uint8_t buffer[Acknowledgement::size];
+	encode_acknowledgement(buffer, count);
+	if (send(durability.socket, (const char *)buffer, sizeof(buffer), 0) != sizeof(buffer))
+		fprintf(stderr, "Failed to acknowledge %llu messages: %d\n", (unsigned long long)count, WSAGetLastError());
+}
+
+static void flush_thread(Durability &durability)
+{
+	uint64_t max_delay = uint64_t(durability.options.max_delay_ms) * 1000000;
+	uint64_t taken = 0;
+	std::unique_lock<std::mutex> lock(durability.mutex);
+	while (true)
+	{
+		if (durability.completed == taken && durability.pending.empty())
+		{
+			if (durability.stop)
+				break;
+			durability.wake.wait(lock);
+			continue;
+		}
+		uint64_t now = stats_now();
+		uint64_t deadline = durability.oldest_pending + max_delay;
+		if (!durability.stop && !durability.force && durability.pending.size() < durability.options.max_batch && now < deadline)
+		{
+			durability.wake.wait_for(lock, std::chrono::nanoseconds(deadline - now));
+			continue;
+		}
+
+		std::vector<HANDLE> group;
+		group.swap(durability.pending);
+		taken = durability.completed;
+		durability.oldest_pending = 0;
+		durability.force = false;
+		bool acknowledge = durability.acknowledge;
+		lock.unlock();
+
+		{
+			StatsTimer timer(Stage::Flush);
+			std::string detail = std::to_string(group.size()) + " files";
+			TraceScope trace("group_commit");
+			trace.set_detail(detail);
+			for (HANDLE file_handle : group)
+			{
+				if (!FlushFileBuffers(file_handle))
+					fprintf(stderr, "Failed to flush file: %s\n", error_to_string(GetLastError()).c_str());
+				CloseHandle(file_handle);
+			}
+		}
+		if (acknowledge)
+			send_acknowledgement(durability, taken);
+
+		lock.lock();
+		durability.durable = taken;
+		durability.flushed.notify_all();
+	}
+}
+
+void durability_start(Durability &durability, SOCKET socket, bool acknowledge)
+{
+	if (!durability.options.enabled)
+		return;
+	durability.socket = socket;
+	durability.acknowledge = acknowledge;
+	durability.completed = 0;
+	durability.durable = 0;
+	durability.oldest_pending = 0;
+	durability.stop = false;
+	durability.force = false;
+	durability.thread = std::thread(flush_thread, std::ref(durability));
+}
+
+void durability_hand_off(Durability &durability, HANDLE file_handle)
+{
+	if (!durability.options.enabled)
+	{
+		if (!CloseHandle(file_handle))
+			fprintf(stderr, "Failed to close file: %s\n", error_to_string(GetLastError()).c_str());
+		return;
+	}
+	std::lock_guard<std::mutex> lock(durability.mutex);
+	durability.pending.push_back(file_handle);
+	if (!durability.oldest_pending)
+	{
+		durability.oldest_pending = stats_now();
+		durability.wake.notify_one();
+	}
+}
+
+void durability_complete(Durability &durability)
+{
+	if (!durability.options.enabled)
+		return;
+	std::lock_guard<std::mutex> lock(durability.mutex);
+	durability.completed++;
+	// The first message of a group starts the delay, a full group ends it.
+	bool first = !durability.oldest_pending;
+	if (first)
+		durability.oldest_pending = stats_now();
+	if (first || durability.pending.size() >= durability.options.max_batch)
+		durability.wake.notify_one();
+}
+
+void durability_barrier(Durability &durability)
+{
+	if (!durability.options.enabled)
+		return;
+	std::unique_lock<std::mutex> lock(durability.mutex);
+	uint64_t target = durability.completed;
+	auto done = [&durability, target] { return durability.durable >= target && durability.pending.empty(); };
+	if (done())
+		return;
+	durability.force = true;
+	durability.wake.notify_one();
+	durability.flushed.wait(lock, done);
+}
+
+// What is still pending is flushed. After a clean close the client is
+// still reading, so the last group is acknowledged as well.
+void durability_stop(Durability &durability, bool acknowledge)
+{
+	if (!durability.options.enabled || !durability.thread.joinable())
+		return;
+	{
+		std::lock_guard<std::mutex> lock(durability.mutex);
+		durability.stop = true;
+		durability.acknowledge = durability.acknowledge && acknowledge;
+		durability.wake.notify_one();
+	}
+	durability.thread.join();
+}
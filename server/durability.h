@@ -0,0 +1,56 @@
+#pragma once
+
+#include "win_global.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Group commit. Instead of closing a file it has written, a handler hands
+// the handle over here, and a background thread flushes the handles of
+// many messages together before acknowledging all of them to the client.
+// A group is flushed once it holds max_batch files or its oldest message
+// has waited max_delay_ms, whichever comes first.
+//
+// Without durability handles are closed right away and nothing is
+// acknowledged, as before.
+struct DurabilityOptions
+{
+	bool enabled = false;
+	size_t max_batch = 64;
+	uint32_t max_delay_ms = 10;
+};
+
+struct Durability
+{
+	DurabilityOptions options;
+	SOCKET socket = INVALID_SOCKET;
+	// Whether the client asked for acknowledgements.
+	bool acknowledge = false;
+
+	std::mutex mutex;
+	std::condition_variable wake;
+	std::condition_variable flushed;
+	std::vector<HANDLE> pending;
+	uint64_t completed = 0;
+	uint64_t durable = 0;
+	uint64_t oldest_pending = 0;
+	bool force = false;
+	bool stop = false;
+	std::thread thread;
+};
+
+void durability_start(Durability &durability, SOCKET socket, bool acknowledge);
+// Takes ownership of the handle.
+void durability_hand_off(Durability &durability, HANDLE file_handle);
+// Marks one more message as done. Its files are durable once the group
+// holding them is flushed.
+void durability_complete(Durability &durability);
+// Waits until everything handed off so far is flushed. Called before
+// renames and removals, which need the files closed.
+void durability_barrier(Durability &durability);
+void durability_stop(Durability &durability, bool acknowledge);
@@ -4,9 +4,79 @@
 #include <stdio.h>
 
 #include "server.h"
+#include "stats.h"
+#include "trace.h"
+
+static BOOL WINAPI write_trace_on_exit(DWORD ctrl_type)
+{
+	write_trace();
+	return FALSE;
+}
 
 int __cdecl main(int argc, char **argv) 
 {
+	int stats_interval = 0;
+	std::string trace_file;
+	ServerOptions options;
+	int arg = 1;
+	while (arg < argc && strncmp(argv[arg], "--", 2) == 0)
+	{
+		if (strcmp(argv[arg], "--stats") == 0 && arg + 1 < argc)
+		{
+			stats_interval = atoi(argv[arg + 1]);
+			arg += 2;
+		}
+		else if (strcmp(argv[arg], "--trace") == 0 && arg + 1 < argc)
+		{
+			trace_file = argv[arg + 1];
+			arg += 2;
+		}
+		else if (strcmp(argv[arg], "--relay") == 0 && arg + 1 < argc)
+		{
+			options.relay = argv[arg + 1];
+			arg += 2;
+		}
+		else if (strcmp(argv[arg], "--durable") == 0)
+		{
+			options.durability.enabled = true;
+			arg += 1;
+		}
+		else if (strcmp(argv[arg], "--direct-io") == 0)
+		{
+			options.direct_write.enabled = true;
+			arg += 1;
+		}
+		else if (strcmp(argv[arg], "--direct-io-min") == 0 && arg + 1 < argc)
+		{
+			options.direct_write.min_size = uint64_t(atof(argv[arg + 1]) * 1024 * 1024);
+			arg += 2;
+		}
+		else if (strcmp(argv[arg], "--group-size") == 0 && arg + 1 < argc && atoi(argv[arg + 1]) > 0)
+		{
+			options.durability.max_batch = atoi(argv[arg + 1]);
+			arg += 2;
+		}
+		else if (strcmp(argv[arg], "--group-delay") == 0 && arg + 1 < argc)
+		{
+			options.durability.max_delay_ms = atoi(argv[arg + 1]);
+			arg += 2;
+		}
+		else
+		{
+			printf("usage: pexip_dropbox [--stats seconds] [--trace file.json] [--relay server-name] [--durable] [--group-size files] [--group-delay ms] [--direct-io] [--direct-io-min MB] [directory]\n");
+			return 1;
+		}
+	}
+	argc -= arg - 1;
+	argv += arg - 1;
+
+	if (!trace_file.empty())
+	{
+		if (!enable_trace(trace_file, "pexip_drop_server"))
+			return -1;
+		SetConsoleCtrlHandler(write_trace_on_exit, TRUE);
+	}
+
 	std::string path;
 	if (argc == 2)
 	{
@@ -39,7 +109,7 @@ int __cdecl main(int argc, char **argv)
 	}
 	else
 	{
-		printf("usage: pexip_dropbox [directory]\n");
+		printf("usage: pexip_dropbox [--stats seconds] [--trace file.json] [--relay server-name] [--durable] [--group-size files] [--group-delay ms] [--direct-io] [--direct-io-min MB] [directory]\n");
 		return 1;
 	}
 
@@ -50,9 +120,15 @@ int __cdecl main(int argc, char **argv)
 		return -1;
 	}
 
-	if (!run_server(path))
+	// The dump thread has to be joined before static destruction.
+	start_stats_dump(stats_interval);
+	if (!run_server(path, options))
 	{
+		stop_stats_dump();
+		write_trace();
 		return -1;
 	}
+	stop_stats_dump();
+	write_trace();
 	return 0;
 }
@@ -0,0 +1,125 @@
+#include "relay.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include "stats.h"
+
+#define DEFAULT_PORT "41218"
+
+static SOCKET connect_downstream(const std::string &server)
+{
+	struct addrinfo *result = NULL;
+	struct addrinfo hints;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_protocol = IPPROTO_TCP;
+
+	int failed = getaddrinfo(server.c_str(), DEFAULT_PORT, &hints, &result);
+	if (failed)
+	{
+		fprintf(stderr, "getaddrinfo for relay %s failed with error: %d\n", server.c_str(), failed);
+		return INVALID_SOCKET;
+	}
+
+	SOCKET connected = INVALID_SOCKET;
+	for (struct addrinfo *ptr = result; ptr != NULL; ptr = ptr->ai_next)
+	{
+		connected = socket(ptr->ai_family, ptr->ai_socktype, ptr->ai_protocol);
+		if (connected == INVALID_SOCKET)
+			break;
+		if (connect(connected, ptr->ai_addr, (int)ptr->ai_addrlen) != SOCKET_ERROR)
+			break;
+		closesocket(connected);
+		connected = INVALID_SOCKET;
+	}
+	freeaddrinfo(result);
+	return connected;
+}
+
+static bool negotiate_downstream(Relay &relay, HashAlgorithm hash)
+{
+	uint8_t request[HelloRequest::size];
+	encode_hello_request(request, &hash, 1, 0);
+	if (send(relay.socket, (const char *)request, sizeof(request), 0) != sizeof(request))
+		return false;
+	uint8_t reply[HelloReply::size];
+	int received = 0;
+	while (received < int(sizeof(reply)))
+	{
+		int bytes_received = recv(relay.socket, (char *)reply + received, int(sizeof(reply)) - received, 0);
+		if (bytes_received <= 0)
+			return false;
+		received += bytes_received;
+	}
+	return decode_hello_reply(reply) == hash;
+}
+
+bool relay_enabled(const Relay &relay)
+{
+	return !relay.server.empty();
+}
+
+bool relay_begin(Relay &relay, HashAlgorithm hash)
+{
+	relay.active = false;
+	if (!relay_enabled(relay))
+		return false;
+	if (relay.socket != INVALID_SOCKET && relay.hash != hash)
+		relay_close(relay);
+	if (relay.socket == INVALID_SOCKET)
+	{
+		relay.socket = connect_downstream(relay.server);
+		if (relay.socket == INVALID_SOCKET)
+		{
+			fprintf(stderr, "Unable to connect to relay %s, not forwarding\n", relay.server.c_str());
+			return false;
+		}
+		if (!negotiate_downstream(relay, hash))
+		{
+			fprintf(stderr, "Relay %s does not accept %s, not forwarding\n", relay.server.c_str(), hash_name(hash));
+			relay_close(relay);
+			return false;
+		}
+		relay.hash = hash;
+		fprintf(stderr, "Relaying to %s\n", relay.server.c_str());
+	}
+	relay.active = true;
+	return true;
+}
+
+void relay_send(Relay &relay, const void *data, size_t size)
+{
+	if (!relay.active)
+		return;
+	size_t total_bytes_sent = 0;
+	while (total_bytes_sent < size)
+	{
+		int bytes_sent = send(relay.socket, (const char *)data + total_bytes_sent, int(size - total_bytes_sent), 0);
+		if (bytes_sent == SOCKET_ERROR)
+		{
+			fprintf(stderr, "Failed to relay to %s: %d\n", relay.server.c_str(), WSAGetLastError());
+			relay_close(relay);
+			return;
+		}
+		total_bytes_sent += size_t(bytes_sent);
+	}
+	stats_add(Counter::BytesRelayed, size);
+}
+
+void relay_end(Relay &relay)
+{
+	relay.active = false;
+}
+
+void relay_close(Relay &relay)
+{
+	if (relay.socket != INVALID_SOCKET)
+	{
+		shutdown(relay.socket, SD_SEND);
+		closesocket(relay.socket);
+	}
+	relay.socket = INVALID_SOCKET;
+	relay.active = false;
+}
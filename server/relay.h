@@ -0,0 +1,36 @@
+#pragma once
+
+#include "win_global.h"
+
+#include <stddef.h>
+
+#include <string>
+
+#include "protocol.h"
+
+// Forwards every accepted operation to a downstream server, so servers can
+// be chained. Data is passed on chunk by chunk as it arrives instead of
+// after the whole file has been received.
+//
+// A message is started with relay_begin() and its bytes passed with
+// relay_send(). If the downstream connection fails part way, the rest of
+// that message is dropped and a new connection is made at the next
+// relay_begin(), so the downstream stream is never left with half a
+// message followed by the start of another.
+//
+// Headers are forwarded as they are, so the downstream connection has to
+// use the same content hash as the client the message came from. It is
+// renegotiated when a client with a different hash connects.
+struct Relay
+{
+	std::string server;
+	SOCKET socket = INVALID_SOCKET;
+	HashAlgorithm hash = HashAlgorithm::None;
+	bool active = false;
+};
+
+bool relay_enabled(const Relay &relay);
+bool relay_begin(Relay &relay, HashAlgorithm hash);
+void relay_send(Relay &relay, const void *data, size_t size);
+void relay_end(Relay &relay);
+void relay_close(Relay &relay);
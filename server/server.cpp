@@ -2,11 +2,21 @@
 #include "win_global.h"
 
 #include <string>
+#include <vector>
 #include <algorithm>
 
-#include "deserializer.h"
+#include "server.h"
+#include "protocol.h"
+#include "catalog.h"
+#include "relay.h"
+#include "durability.h"
+#include "direct_writer.h"
+#include "shared_ring.h"
+#include "stats.h"
+#include "trace.h"
 
 #include <Shlwapi.h>
+#include <winioctl.h>
 
 #include <assert.h>
 #define DEFAULT_PORT 41218
@@ -18,23 +28,6 @@ enum class SocketState
 	Error
 };
 
-enum class FileAction
-{
-	Added = 1,
-	Removed = 2,
-	Modified = 3,
-	Renamed = 4,
-};
-
-struct Header
-{
-	uint64_t full_size;
-	uint32_t header_size;
-	FileAction action;
-	uint8_t sha[20];
-	uint32_t path_size;
-};
-
 struct FileCloser
 {
 	FileCloser(HANDLE handle)
@@ -42,12 +35,30 @@ struct FileCloser
 	{}
 	~FileCloser()
 	{
-		if (!CloseHandle(handle))
+		if (handle != INVALID_HANDLE_VALUE && !CloseHandle(handle))
 			fprintf(stderr, "Failed to close file: %s\n", error_to_string(GetLastError()).c_str());
 	}
 
+	HANDLE release()
+	{
+		HANDLE released = handle;
+		handle = INVALID_HANDLE_VALUE;
+		return released;
+	}
+
 	HANDLE handle;
 };
+
+// Where a client's messages come from: the socket, or a shared ring once a
+// client on the same host has attached to one. Acknowledgements always go
+// back over the socket.
+struct Connection
+{
+	SOCKET socket;
+	SharedRing ring;
+	bool shared = false;
+};
+
 static SocketState read_from_socket(SOCKET socket, void *buffer, size_t buffer_size)
 {
 	char *b = reinterpret_cast<char *>(buffer);
@@ -68,34 +79,72 @@ static SocketState read_from_socket(SOCKET socket, void *buffer, size_t buffer_s
 	return SocketState::NoError;
 }
 
-static SocketState read_header(SOCKET socket, Header &target_header)
+static SocketState ring_state(Connection &connection, RingState state)
+{
+	switch (state)
+	{
+	case RingState::Ready:
+		return SocketState::NoError;
+	case RingState::Closed:
+		return SocketState::Closed;
+	default:
+		fprintf(stderr, "Client left the shared ring\n");
+		closesocket(connection.socket);
+		return SocketState::Error;
+	}
+}
+
+static SocketState read_from_connection(Connection &connection, void *buffer, size_t buffer_size)
 {
-	char buffer[44];
-	SocketState socket_state = read_from_socket(socket, buffer, sizeof(buffer));
+	if (!connection.shared)
+		return read_from_socket(connection.socket, buffer, buffer_size);
+	return ring_state(connection, shared_ring_read(connection.ring, buffer, buffer_size));
+}
+
+static SocketState read_header(Connection &connection, uint8_t (&buffer)[MessageHeader::size])
+{
+	SocketState socket_state = read_from_connection(connection, buffer, sizeof(buffer));
 	if (socket_state != SocketState::NoError)
 		return socket_state;
 
-	uint32_t offset = 0;
-	if (memcmp(buffer, "PID0", 4))
+	if (!HeaderView(buffer).valid())
 	{
-		fprintf(stderr, "Wrong magic in header: %d\n", WSAGetLastError());
+		fprintf(stderr, "Wrong header content: %d\n", WSAGetLastError());
+		closesocket(connection.socket);
+		return SocketState::Error;
+	}
+	return SocketState::NoError;
+}
+
+// Picks the first hash the client offers that we support and tells it which.
+// Acknowledgements are only granted when we flush what we write. Shared
+// memory is granted whenever it is asked for; a client that turns out not
+// to be on this host fails to attach.
+static SocketState read_hello(SOCKET socket, bool durable, HashAlgorithm &algorithm, bool &acknowledge, bool &shared)
+{
+	uint8_t request[HelloRequest::size];
+	SocketState socket_state = read_from_socket(socket, request, sizeof(request));
+	if (socket_state != SocketState::NoError)
+		return socket_state;
+	algorithm = choose_hash_algorithm(request);
+	uint32_t flags = HelloRequest::Flags::load(request);
+	acknowledge = durable && (flags & HELLO_ACKNOWLEDGE);
+	shared = (flags & HELLO_SHARED_MEMORY) != 0;
+	uint8_t reply[HelloReply::size];
+	encode_hello_reply(reply, algorithm, (acknowledge ? HELLO_ACKNOWLEDGE : 0) | (shared ? HELLO_SHARED_MEMORY : 0));
+	if (send(socket, (const char *)reply, sizeof(reply), 0) != sizeof(reply))
+	{
+		fprintf(stderr, "Failed to answer hello: %d\n", WSAGetLastError());
 		closesocket(socket);
 		return SocketState::Error;
 	}
-	DeSerializer ds(buffer + 4, sizeof(buffer));
-	ds.read_to_type(target_header.full_size);
-	ds.read_to_type(target_header.header_size);
-	ds.read_to_type(target_header.action);
-	ds.read_to(target_header.sha, 20);
-	if (!ds.read_to_type(target_header.path_size)
-		|| target_header.full_size < target_header.header_size
-		|| target_header.action < FileAction::Added
-		|| target_header.action > FileAction::Renamed)
+	if (algorithm == HashAlgorithm::None)
 	{
-		fprintf(stderr, "Wrong header content: %d\n", WSAGetLastError());
+		fprintf(stderr, "Client offered no supported content hash\n");
 		closesocket(socket);
 		return SocketState::Error;
 	}
+	fprintf(stderr, "Using %s for content hashes\n", hash_name(algorithm));
 	return SocketState::NoError;
 }
 
@@ -109,12 +158,16 @@ static bool is_sub_path(const std::string &parent, const std::string &sub_path)
 	std::wstring sub_path_w = s2ws(sub_path);
 	DWORD attr = GetFileAttributesW(sub_path_w.c_str());
 	bool create = !file_exist(attr);
+	// Directories can only be opened for their attributes, with backup
+	// semantics. Files are shared for writing, since a file written
+	// earlier may still be open waiting for its group commit.
+	bool directory = !create && (attr & FILE_ATTRIBUTE_DIRECTORY);
 	HANDLE file_handle = CreateFileW(sub_path_w.c_str(),
-		GENERIC_WRITE | GENERIC_READ,
-		NULL,
+		directory ? FILE_READ_ATTRIBUTES : GENERIC_WRITE | GENERIC_READ,
+		directory ? FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE : FILE_SHARE_READ | FILE_SHARE_WRITE,
 		NULL,
 		create ? OPEN_ALWAYS : OPEN_EXISTING,
-		NULL,
+		directory ? FILE_FLAG_BACKUP_SEMANTICS : NULL,
 		NULL);
 	if (file_handle == INVALID_HANDLE_VALUE)
 	{
@@ -130,163 +183,807 @@ static bool is_sub_path(const std::string &parent, const std::string &sub_path)
 	if (create)
 		DeleteFileW(real_sub_w.c_str());
 
-	return real_sub.find(parent) == 0;
+	// Strictly below the parent. The parent itself, or a sibling that only
+	// shares its name as a prefix, must never be removed or moved.
+	return real_sub.size() > parent.size() && real_sub.compare(0, parent.size(), parent) == 0
+		&& (parent.back() == '\\' || real_sub[parent.size()] == '\\');
 }
 
-static SocketState handle_added_modified(const std::string &target_directory, SOCKET socket, Header &header)
+static uint64_t file_time_to_uint64(const FILETIME &time)
 {
+	return (uint64_t(time.dwHighDateTime) << 32) | time.dwLowDateTime;
+}
+
+// Paths come from the network, so they are checked lexically before any
+// directory is created for them. Empty, "." and ".." components are all
+// refused, so a path always names something below the target directory.
+// is_sub_path() still has the final word.
+static bool is_relative_path(const std::string &path)
+{
+	if (path.empty() || path[0] == '\\' || path[0] == '/' || path.find(':') != std::string::npos)
+		return false;
+	size_t start = 0;
+	while (start <= path.size())
+	{
+		size_t end = path.find_first_of("\\/", start);
+		if (end == std::string::npos)
+			end = path.size();
+		if (end == start || (end - start == 1 && path[start] == '.')
+			|| (end - start == 2 && path.compare(start, 2, "..") == 0))
+			return false;
+		start = end + 1;
+	}
+	return true;
+}
+
+// Clients watching several roots send them under a prefix, and files can
+// show up in sub directories the server has not seen yet.
+static bool create_parent_directories(const std::string &path)
+{
+	for (size_t slash = path.find_first_of("\\/"); slash != std::string::npos; slash = path.find_first_of("\\/", slash + 1))
+	{
+		if (!CreateDirectoryW(s2ws(path.substr(0, slash)).c_str(), NULL) && GetLastError() != ERROR_ALREADY_EXISTS)
+		{
+			fprintf(stderr, "Failed to create directory for %s: %s\n", path.c_str(), error_to_string(GetLastError()).c_str());
+			return false;
+		}
+	}
+	return true;
+}
+
+static bool is_writable_path(const std::string &target_directory, const std::string &path, bool create_parents)
+{
+	if (is_catalog_path(path))
+	{
+		fprintf(stderr, "illigal path specified. Reserved for the catalog %s\n", path.c_str());
+		return false;
+	}
+	if (!is_relative_path(path))
+	{
+		fprintf(stderr, "illigal path specified. Not a relative path %s\n", path.c_str());
+		return false;
+	}
+	if (create_parents && !create_parent_directories(path))
+		return false;
+	if (!is_sub_path(target_directory, path))
+	{
+		fprintf(stderr, "illigal path specified. Not a sub path of %s -> %s\n", target_directory.c_str(), path.c_str());
+		return false;
+	}
+	return true;
+}
+
+// Writes straight out of the shared pages, without copying to a buffer.
+static SocketState receive_from_ring_to_file(Relay &relay, Connection &connection, HANDLE file_handle, const std::string &path, uint64_t size, uint64_t &receive_time, uint64_t &write_time)
+{
+	while (size)
+	{
+		const uint8_t *data;
+		size_t available;
+		uint64_t start = stats_now();
+		SocketState socket_state = ring_state(connection, shared_ring_peek(connection.ring, data, available));
+		if (socket_state != SocketState::NoError)
+			return socket_state;
+		receive_time += stats_now() - start;
+		DWORD write_size = DWORD(std::min(uint64_t(available), std::min(size, uint64_t(1) << 30)));
+		relay_send(relay, data, write_size);
+
+		start = stats_now();
+		DWORD bytes_written;
+		if (!WriteFile(file_handle, data, write_size, &bytes_written, NULL))
+		{
+			fprintf(stderr, "Failed to write to file %s: %s\n", path.c_str(), error_to_string(GetLastError()).c_str());
+			closesocket(connection.socket);
+			return SocketState::Error;
+		}
+		assert(bytes_written == write_size);
+		shared_ring_consume(connection.ring, write_size);
+		size -= write_size;
+		write_time += stats_now() - start;
+	}
+	return SocketState::NoError;
+}
+
+// Streams size bytes from the socket to the file's current position,
+// relaying them as they arrive.
+static SocketState receive_to_file(Relay &relay, Connection &connection, HANDLE file_handle, const std::string &path, uint64_t size, uint64_t &receive_time, uint64_t &write_time)
+{
+	if (connection.shared)
+		return receive_from_ring_to_file(relay, connection, file_handle, path, size, receive_time, write_time);
+	char buffer[1 << 15];
+	while (size)
+	{
+		uint32_t read_size = uint32_t(std::min(size, uint64_t(sizeof(buffer))));
+		uint64_t start = stats_now();
+		SocketState socket_state = read_from_connection(connection, buffer, read_size);
+		if (socket_state != SocketState::NoError)
+			return socket_state;
+		receive_time += stats_now() - start;
+		relay_send(relay, buffer, read_size);
+
+		start = stats_now();
+		DWORD bytes_written;
+		if (!WriteFile(file_handle, buffer, read_size, &bytes_written, NULL))
+		{
+			fprintf(stderr, "Failed to write to file %s: %s\n", path.c_str(), error_to_string(GetLastError()).c_str());
+			closesocket(connection.socket);
+			return SocketState::Error;
+		}
+		assert(bytes_written == read_size);
+		size -= read_size;
+		write_time += stats_now() - start;
+	}
+	return SocketState::NoError;
+}
+
+static SocketState handle_added_modified(const std::string &target_directory, Catalog &catalog, Relay &relay, Durability &durability, DirectWriter &direct_writer, Connection &connection, HashAlgorithm algorithm, const HeaderView &header)
+{
+	TraceScope trace("handle_added_modified");
 	fprintf(stderr, "Add/Modify\n");
 	char buffer[1 << 15];
-	uint32_t read_size = uint32_t(std::min(header.path_size + (header.full_size - header.header_size), sizeof(buffer)));
-	SocketState socket_state = read_from_socket(socket, buffer, read_size);
+	uint32_t read_size = uint32_t(std::min(header.path_size() + header.data_size(), sizeof(buffer)));
+	uint64_t start = stats_now();
+	SocketState socket_state = read_from_connection(connection, buffer, read_size);
 	if (socket_state != SocketState::NoError)
 		return socket_state;
-	std::string path(buffer, header.path_size);
-	if (!is_sub_path(target_directory, path))
+	uint64_t receive_time = stats_now() - start;
+	uint64_t write_time = 0;
+	std::string path(buffer, header.path_size());
+	trace.set_detail(path);
+	trace.bytes = header.data_size();
+	if (!is_writable_path(target_directory, path, true))
 	{
-		fprintf(stderr, "illigal path specified. Not a sub path of %s -> %s\n", target_directory.c_str(), path.c_str());
-		closesocket(socket);
+		closesocket(connection.socket);
 		return SocketState::Error;
 	}
+	// Forward before writing, so the next hop works in parallel with us.
+	relay_begin(relay, algorithm);
+	relay_send(relay, header.data, MessageHeader::size);
+	relay_send(relay, buffer, read_size);
+	bool direct = use_direct_write(direct_writer, header.data_size());
 	HANDLE file_handle = CreateFileW(s2ws(path).c_str(),
 		GENERIC_WRITE,
-		NULL,
+		FILE_SHARE_READ | FILE_SHARE_WRITE,
 		NULL,
 		CREATE_ALWAYS,
-		NULL,
+		direct ? FILE_FLAG_NO_BUFFERING : 0,
 		NULL);
 	if (file_handle == INVALID_HANDLE_VALUE)
 	{
 		fprintf(stderr, "Failed to open file for creation/modification %s\n", path.c_str());
-		closesocket(socket);
+		closesocket(connection.socket);
 		return SocketState::Error;
 	}
 	FileCloser closer(file_handle);
 
-	uint64_t full_bytes_written = 0;
-	DWORD bytes_written;
-	if (!WriteFile(file_handle, buffer + header.path_size, read_size - header.path_size, &bytes_written, NULL))
+	const char *received = buffer + header.path_size();
+	size_t received_size = read_size - header.path_size();
+	if (direct)
 	{
-		fprintf(stderr, "Failed to write to file %s: %s\n", path.c_str(), error_to_string(GetLastError()).c_str());
-		closesocket(socket);
-		return SocketState::Error;
+		// The start of the data came in with the path.
+		auto fill = [&](uint8_t *data, size_t size) {
+			size_t copied = std::min(size, received_size);
+			memcpy(data, received, copied);
+			received += copied;
+			received_size -= copied;
+			if (copied == size)
+				return true;
+			uint64_t receive_start = stats_now();
+			socket_state = read_from_connection(connection, data + copied, size - copied);
+			if (socket_state != SocketState::NoError)
+				return false;
+			receive_time += stats_now() - receive_start;
+			relay_send(relay, data + copied, size - copied);
+			return true;
+		};
+		if (!direct_write(direct_writer, file_handle, path, header.data_size(), fill, write_time))
+		{
+			if (socket_state != SocketState::NoError)
+				return socket_state;
+			closesocket(connection.socket);
+			return SocketState::Error;
+		}
 	}
-	assert(bytes_written == read_size - header.path_size);
-	full_bytes_written += bytes_written;
+	else
+	{
+		DWORD bytes_written;
+		start = stats_now();
+		if (!WriteFile(file_handle, received, DWORD(received_size), &bytes_written, NULL))
+		{
+			fprintf(stderr, "Failed to write to file %s: %s\n", path.c_str(), error_to_string(GetLastError()).c_str());
+			closesocket(connection.socket);
+			return SocketState::Error;
+		}
+		assert(bytes_written == received_size);
+		write_time += stats_now() - start;
+		socket_state = receive_to_file(relay, connection, file_handle, path, header.data_size() - received_size, receive_time, write_time);
+		if (socket_state != SocketState::NoError)
+			return socket_state;
+	}
+	relay_end(relay);
+	stats_record(Stage::ServerReceive, receive_time);
+	stats_record(Stage::ServerWrite, write_time);
+	stats_add(Counter::FilesWritten, 1);
 
-	uint64_t file_size = header.full_size - header.header_size;
-	while (full_bytes_written < file_size)
+	BY_HANDLE_FILE_INFORMATION info;
+	if (GetFileInformationByHandle(file_handle, &info))
+	{
+		uint64_t size = (uint64_t(info.nFileSizeHigh) << 32) | info.nFileSizeLow;
+		catalog_update(catalog, path, algorithm, header.digest(), size, file_time_to_uint64(info.ftLastWriteTime));
+	}
+	else
 	{
-		read_size = uint32_t(std::min(file_size - full_bytes_written, sizeof(buffer)));
-		SocketState socket_state = read_from_socket(socket, buffer, read_size);
+		fprintf(stderr, "Failed to read file information for %s: %s\n", path.c_str(), error_to_string(GetLastError()).c_str());
+		catalog_remove(catalog, path);
+	}
+
+	durability_hand_off(durability, closer.release());
+	return SocketState::NoError;
+}
+
+// Reads and drops the rest of a message that can not be applied.
+static SocketState skip_payload(Relay &relay, Connection &connection, uint64_t size)
+{
+	char buffer[1 << 15];
+	while (size)
+	{
+		uint32_t read_size = uint32_t(std::min(size, uint64_t(sizeof(buffer))));
+		SocketState socket_state = read_from_connection(connection, buffer, read_size);
 		if (socket_state != SocketState::NoError)
 			return socket_state;
+		relay_send(relay, buffer, read_size);
+		size -= read_size;
+	}
+	return SocketState::NoError;
+}
 
-		if (!WriteFile(file_handle, buffer, read_size, &bytes_written, NULL))
+// The client only sends an append when the file had the offset's length
+// the last time it was sent, so the catalog entry and the file on disk have
+// to agree with it. If they do not, the data is dropped and the entry
+// removed; the file is out of date until the client next sends it whole.
+static SocketState handle_append(const std::string &target_directory, Catalog &catalog, Relay &relay, Durability &durability, Connection &connection, HashAlgorithm algorithm, const HeaderView &header)
+{
+	TraceScope trace("handle_append");
+	fprintf(stderr, "Append\n");
+	char buffer[1 << 15];
+	if (header.data_size() < AppendPayload::size)
+	{
+		fprintf(stderr, "illigal datasize for appending to file\n");
+		closesocket(connection.socket);
+		return SocketState::Error;
+	}
+	uint32_t read_size = uint32_t(header.path_size() + AppendPayload::size);
+	if (read_size > sizeof(buffer))
+	{
+		fprintf(stderr, "illigal path size for appending to file\n");
+		closesocket(connection.socket);
+		return SocketState::Error;
+	}
+	uint64_t start = stats_now();
+	SocketState socket_state = read_from_connection(connection, buffer, read_size);
+	if (socket_state != SocketState::NoError)
+		return socket_state;
+	uint64_t receive_time = stats_now() - start;
+	uint64_t write_time = 0;
+	std::string path(buffer, header.path_size());
+	uint64_t offset = AppendPayload::Offset::load(reinterpret_cast<const uint8_t *>(buffer) + header.path_size());
+	uint64_t remaining = header.data_size() - AppendPayload::size;
+	trace.set_detail(path);
+	trace.bytes = remaining;
+	if (!is_writable_path(target_directory, path, false))
+	{
+		closesocket(connection.socket);
+		return SocketState::Error;
+	}
+	relay_begin(relay, algorithm);
+	relay_send(relay, header.data, MessageHeader::size);
+	relay_send(relay, buffer, read_size);
+
+	const CatalogRecord *record = catalog_lookup(catalog, path);
+	HANDLE file_handle = INVALID_HANDLE_VALUE;
+	LARGE_INTEGER file_size;
+	if (record && record->size == offset && record->algorithm == algorithm)
+	{
+		file_handle = CreateFileW(s2ws(path).c_str(),
+			GENERIC_WRITE,
+			FILE_SHARE_READ | FILE_SHARE_WRITE,
+			NULL,
+			OPEN_EXISTING,
+			NULL,
+			NULL);
+	}
+	if (file_handle == INVALID_HANDLE_VALUE || !GetFileSizeEx(file_handle, &file_size) || uint64_t(file_size.QuadPart) != offset)
+	{
+		fprintf(stderr, "%s is not at %llu bytes as the append expects. Dropping it until it is sent again\n", path.c_str(), (unsigned long long)offset);
+		if (file_handle != INVALID_HANDLE_VALUE)
+			CloseHandle(file_handle);
+		catalog_remove(catalog, path);
+		socket_state = skip_payload(relay, connection, remaining);
+		relay_end(relay);
+		return socket_state;
+	}
+	FileCloser closer(file_handle);
+	LARGE_INTEGER end = {};
+	SetFilePointerEx(file_handle, end, NULL, FILE_END);
+
+	socket_state = receive_to_file(relay, connection, file_handle, path, remaining, receive_time, write_time);
+	if (socket_state != SocketState::NoError)
+	{
+		catalog_remove(catalog, path);
+		return socket_state;
+	}
+	relay_end(relay);
+	stats_record(Stage::ServerReceive, receive_time);
+	stats_record(Stage::ServerWrite, write_time);
+	stats_add(Counter::FilesWritten, 1);
+
+	BY_HANDLE_FILE_INFORMATION info;
+	if (GetFileInformationByHandle(file_handle, &info))
+	{
+		uint64_t size = (uint64_t(info.nFileSizeHigh) << 32) | info.nFileSizeLow;
+		catalog_update(catalog, path, algorithm, header.digest(), size, file_time_to_uint64(info.ftLastWriteTime));
+	}
+	else
+	{
+		fprintf(stderr, "Failed to read file information for %s: %s\n", path.c_str(), error_to_string(GetLastError()).c_str());
+		catalog_remove(catalog, path);
+	}
+
+	durability_hand_off(durability, closer.release());
+	return SocketState::NoError;
+}
+
+// Extents have to be in order, not overlap, stay inside the file and add
+// up to the data that follows them.
+static bool valid_extents(const uint8_t *extents, uint32_t count, uint64_t file_size, uint64_t data_size)
+{
+	uint64_t end = 0;
+	uint64_t total = 0;
+	for (uint32_t i = 0; i < count; i++)
+	{
+		uint64_t offset = SparseExtent::Offset::load(extents + i * SparseExtent::size);
+		uint64_t length = SparseExtent::Length::load(extents + i * SparseExtent::size);
+		if (offset < end || length > file_size || offset > file_size - length)
+			return false;
+		end = offset + length;
+		total += length;
+	}
+	return total == data_size;
+}
+
+// Writes each extent at its offset and sets the length, so everything in
+// between stays a hole. If the volume can not do sparse files the gaps are
+// filled with zeros instead, which still gives the right content.
+static SocketState handle_sparse(const std::string &target_directory, Catalog &catalog, Relay &relay, Durability &durability, Connection &connection, HashAlgorithm algorithm, const HeaderView &header)
+{
+	TraceScope trace("handle_sparse");
+	fprintf(stderr, "Sparse\n");
+	char buffer[1 << 15];
+	if (header.data_size() < SparsePayload::size || header.path_size() + SparsePayload::size > sizeof(buffer))
+	{
+		fprintf(stderr, "illigal size for sparse file\n");
+		closesocket(connection.socket);
+		return SocketState::Error;
+	}
+	uint32_t read_size = uint32_t(header.path_size() + SparsePayload::size);
+	uint64_t start = stats_now();
+	SocketState socket_state = read_from_connection(connection, buffer, read_size);
+	if (socket_state != SocketState::NoError)
+		return socket_state;
+	uint64_t receive_time = stats_now() - start;
+	uint64_t write_time = 0;
+	std::string path(buffer, header.path_size());
+	const uint8_t *payload = reinterpret_cast<const uint8_t *>(buffer) + header.path_size();
+	uint64_t file_size = SparsePayload::FileSize::load(payload);
+	uint32_t extent_count = SparsePayload::ExtentCount::load(payload);
+	trace.set_detail(path);
+	trace.bytes = header.data_size();
+	if (extent_count > MAX_SPARSE_EXTENTS || header.data_size() < sparse_payload_size(extent_count))
+	{
+		fprintf(stderr, "illigal extent count for sparse file %s\n", path.c_str());
+		closesocket(connection.socket);
+		return SocketState::Error;
+	}
+	std::vector<uint8_t> extents(extent_count * SparseExtent::size);
+	socket_state = read_from_connection(connection, extents.data(), extents.size());
+	if (socket_state != SocketState::NoError)
+		return socket_state;
+	uint64_t data_size = header.data_size() - sparse_payload_size(extent_count);
+	if (!valid_extents(extents.data(), extent_count, file_size, data_size))
+	{
+		fprintf(stderr, "illigal extents for sparse file %s\n", path.c_str());
+		closesocket(connection.socket);
+		return SocketState::Error;
+	}
+	if (!is_writable_path(target_directory, path, true))
+	{
+		closesocket(connection.socket);
+		return SocketState::Error;
+	}
+	relay_begin(relay, algorithm);
+	relay_send(relay, header.data, MessageHeader::size);
+	relay_send(relay, buffer, read_size);
+	relay_send(relay, extents.data(), extents.size());
+
+	HANDLE file_handle = CreateFileW(s2ws(path).c_str(),
+		GENERIC_WRITE,
+		FILE_SHARE_READ | FILE_SHARE_WRITE,
+		NULL,
+		CREATE_ALWAYS,
+		NULL,
+		NULL);
+	if (file_handle == INVALID_HANDLE_VALUE)
+	{
+		fprintf(stderr, "Failed to open file for creation/modification %s\n", path.c_str());
+		closesocket(connection.socket);
+		return SocketState::Error;
+	}
+	FileCloser closer(file_handle);
+	FILE_SET_SPARSE_BUFFER set_sparse;
+	set_sparse.SetSparse = TRUE;
+	DWORD bytes_returned;
+	if (!DeviceIoControl(file_handle, FSCTL_SET_SPARSE, &set_sparse, sizeof(set_sparse), NULL, 0, &bytes_returned, NULL))
+		fprintf(stderr, "Failed to make %s sparse, writing it dense: %s\n", path.c_str(), error_to_string(GetLastError()).c_str());
+
+	for (uint32_t i = 0; i < extent_count; i++)
+	{
+		LARGE_INTEGER offset;
+		offset.QuadPart = LONGLONG(SparseExtent::Offset::load(extents.data() + i * SparseExtent::size));
+		uint64_t length = SparseExtent::Length::load(extents.data() + i * SparseExtent::size);
+		if (!SetFilePointerEx(file_handle, offset, NULL, FILE_BEGIN))
 		{
-			fprintf(stderr, "Failed to write to file %s: %s\n", path.c_str(), error_to_string(GetLastError()).c_str());
-			closesocket(socket);
+			fprintf(stderr, "Failed to seek in file %s: %s\n", path.c_str(), error_to_string(GetLastError()).c_str());
+			closesocket(connection.socket);
 			return SocketState::Error;
 		}
-		assert(bytes_written == read_size);
-		full_bytes_written += bytes_written;
+		socket_state = receive_to_file(relay, connection, file_handle, path, length, receive_time, write_time);
+		if (socket_state != SocketState::NoError)
+			return socket_state;
+	}
+	LARGE_INTEGER end;
+	end.QuadPart = LONGLONG(file_size);
+	if (!SetFilePointerEx(file_handle, end, NULL, FILE_BEGIN) || !SetEndOfFile(file_handle))
+	{
+		fprintf(stderr, "Failed to set the size of %s: %s\n", path.c_str(), error_to_string(GetLastError()).c_str());
+		closesocket(connection.socket);
+		return SocketState::Error;
+	}
+	relay_end(relay);
+	stats_record(Stage::ServerReceive, receive_time);
+	stats_record(Stage::ServerWrite, write_time);
+	stats_add(Counter::FilesWritten, 1);
+
+	BY_HANDLE_FILE_INFORMATION info;
+	if (GetFileInformationByHandle(file_handle, &info))
+	{
+		uint64_t size = (uint64_t(info.nFileSizeHigh) << 32) | info.nFileSizeLow;
+		catalog_update(catalog, path, algorithm, header.digest(), size, file_time_to_uint64(info.ftLastWriteTime));
+	}
+	else
+	{
+		fprintf(stderr, "Failed to read file information for %s: %s\n", path.c_str(), error_to_string(GetLastError()).c_str());
+		catalog_remove(catalog, path);
 	}
 
+	durability_hand_off(durability, closer.release());
 	return SocketState::NoError;
 }
 
-static SocketState handle_remove(const std::string &target_directory, SOCKET socket, Header &header)
+static SocketState handle_remove(const std::string &target_directory, Catalog &catalog, Relay &relay, Durability &durability, Connection &connection, HashAlgorithm algorithm, const HeaderView &header)
 {
+	TraceScope trace("handle_remove");
 	fprintf(stderr, "Remove\n");
 	char buffer[1 << 12];
-	if (header.full_size - header.header_size)
+	if (header.data_size())
 	{
 		fprintf(stderr, "illigal datasize for removing file\n");
-		closesocket(socket);
+		closesocket(connection.socket);
 		return SocketState::Error;
 	}
-	uint32_t read_size = uint32_t(std::min(header.path_size + (header.full_size - header.header_size), sizeof(buffer)));
-	SocketState socket_state = read_from_socket(socket, buffer, read_size);
+	uint32_t read_size = uint32_t(std::min(header.path_size() + header.data_size(), sizeof(buffer)));
+	SocketState socket_state = read_from_connection(connection, buffer, read_size);
 	if (socket_state != SocketState::NoError)
 		return socket_state;
-	std::string path(buffer, header.path_size);
-	if (!is_sub_path(target_directory, path))
+	std::string path(buffer, header.path_size());
+	trace.set_detail(path);
+	trace.bytes = header.data_size();
+	if (!is_writable_path(target_directory, path, false))
 	{
-		fprintf(stderr, "illigal path specified. Not a sub path of %s -> %s\n", target_directory.c_str(), path.c_str());
-		closesocket(socket);
+		closesocket(connection.socket);
 		return SocketState::Error;
 	}
-	DeleteFileW(s2ws(path).c_str());
+	relay_begin(relay, algorithm);
+	relay_send(relay, header.data, MessageHeader::size);
+	relay_send(relay, buffer, read_size);
+	relay_end(relay);
+	durability_barrier(durability);
+	if (DeleteFileW(s2ws(path).c_str()) || GetLastError() == ERROR_FILE_NOT_FOUND)
+		catalog_remove(catalog, path);
 	return SocketState::NoError;
 }
 
-static SocketState handle_rename(const std::string &target_directory, SOCKET socket, Header &header)
+static SocketState handle_rename(const std::string &target_directory, Catalog &catalog, Relay &relay, Durability &durability, Connection &connection, HashAlgorithm algorithm, const HeaderView &header)
 {
+	TraceScope trace("handle_rename");
 	fprintf(stderr, "Rename\n");
 	char buffer[1 << 13];
-	if (sizeof(buffer) < header.full_size - header.header_size + header.path_size)
+	if (sizeof(buffer) < header.data_size() + header.path_size())
 	{
 		fprintf(stderr, "illigal datasize for renaming. Giving up\n");
-		closesocket(socket);
+		closesocket(connection.socket);
 		return SocketState::Error;
 	}
-	uint32_t read_size = uint32_t(std::min(header.path_size + (header.full_size - header.header_size), sizeof(buffer)));
-	SocketState socket_state = read_from_socket(socket, buffer, read_size);
+	uint32_t read_size = uint32_t(std::min(header.path_size() + header.data_size(), sizeof(buffer)));
+	SocketState socket_state = read_from_connection(connection, buffer, read_size);
 	if (socket_state != SocketState::NoError)
 		return socket_state;
-	std::string path(buffer, header.path_size);
-	if (!is_sub_path(target_directory, path))
+	std::string path(buffer, header.path_size());
+	trace.set_detail(path);
+	trace.bytes = header.data_size();
+	if (!is_writable_path(target_directory, path, false))
 	{
-		fprintf(stderr, "illigal path specified. Not a sub path of %s -> %s\n", target_directory.c_str(), path.c_str());
-		closesocket(socket);
+		closesocket(connection.socket);
 		return SocketState::Error;
 	}
 
-	std::string to_path(buffer + header.path_size, header.full_size - header.header_size);
-	if (!is_sub_path(target_directory, to_path))
+	std::string to_path(buffer + header.path_size(), header.data_size());
+	if (!is_writable_path(target_directory, to_path, true))
 	{
-		fprintf(stderr, "illigal path specified. Not a sub path of %s -> %s\n", target_directory.c_str(), to_path.c_str());
-		closesocket(socket);
+		closesocket(connection.socket);
 		return SocketState::Error;
 	}
+	relay_begin(relay, algorithm);
+	relay_send(relay, header.data, MessageHeader::size);
+	relay_send(relay, buffer, read_size);
+	relay_end(relay);
+	durability_barrier(durability);
 	if (!MoveFileW(s2ws(path).c_str(), s2ws(to_path).c_str()))
 	{
 		DWORD error = GetLastError();
 		fprintf(stderr, "Failed to move filr %s to %s: %d %s\n", path.c_str(), to_path.c_str(), error, error_to_string(error).c_str());
 	}
+	else
+	{
+		catalog_rename(catalog, path, to_path);
+	}
 	return SocketState::NoError;
 }
 
-static SocketState handle_connection(const std::string &target_directory, SOCKET socket)
+// Deletes a directory and everything in it. Links to other directories
+// are removed, not followed.
+static bool remove_directory_tree(const std::wstring &directory)
+{
+	WIN32_FIND_DATAW find_data;
+	HANDLE find_handle = FindFirstFileW((directory + L"\\*").c_str(), &find_data);
+	bool success = true;
+	if (find_handle != INVALID_HANDLE_VALUE)
+	{
+		do
+		{
+			if (wcscmp(find_data.cFileName, L".") == 0 || wcscmp(find_data.cFileName, L"..") == 0)
+				continue;
+			std::wstring child = directory + L"\\" + find_data.cFileName;
+			if (find_data.dwFileAttributes & FILE_ATTRIBUTE_READONLY)
+				SetFileAttributesW(child.c_str(), find_data.dwFileAttributes & ~FILE_ATTRIBUTE_READONLY);
+			if ((find_data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) && !(find_data.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT))
+				success = remove_directory_tree(child) && success;
+			else if (find_data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+				success = RemoveDirectoryW(child.c_str()) && success;
+			else
+				success = DeleteFileW(child.c_str()) && success;
+		} while (FindNextFileW(find_handle, &find_data));
+		FindClose(find_handle);
+	}
+	return RemoveDirectoryW(directory.c_str()) && success;
+}
+
+// Creating, removing and renaming a directory are single operations no
+// matter how much is below it. The catalog entries below a removed or
+// renamed directory follow it.
+static SocketState handle_directory(const std::string &target_directory, Catalog &catalog, Relay &relay, Durability &durability, Connection &connection, HashAlgorithm algorithm, const HeaderView &header)
+{
+	TraceScope trace("handle_directory");
+	char buffer[1 << 13];
+	bool rename = header.action() == FileAction::DirectoryRenamed;
+	if ((!rename && header.data_size()) || sizeof(buffer) < header.data_size() + header.path_size())
+	{
+		fprintf(stderr, "illigal datasize for directory operation\n");
+		closesocket(connection.socket);
+		return SocketState::Error;
+	}
+	uint32_t read_size = uint32_t(header.path_size() + header.data_size());
+	SocketState socket_state = read_from_connection(connection, buffer, read_size);
+	if (socket_state != SocketState::NoError)
+		return socket_state;
+	std::string path(buffer, header.path_size());
+	std::string to_path(buffer + header.path_size(), size_t(header.data_size()));
+	trace.set_detail(path);
+	bool create_parents = header.action() == FileAction::DirectoryAdded;
+	if (!is_writable_path(target_directory, path, create_parents)
+		|| (rename && !is_writable_path(target_directory, to_path, true)))
+	{
+		closesocket(connection.socket);
+		return SocketState::Error;
+	}
+	relay_begin(relay, algorithm);
+	relay_send(relay, header.data, MessageHeader::size);
+	relay_send(relay, buffer, read_size);
+	relay_end(relay);
+	durability_barrier(durability);
+
+	std::wstring wide_path = s2ws(path);
+	DWORD attr = GetFileAttributesW(wide_path.c_str());
+	switch (header.action())
+	{
+	case FileAction::DirectoryAdded:
+		fprintf(stderr, "Add directory %s\n", path.c_str());
+		if (!CreateDirectoryW(wide_path.c_str(), NULL) && GetLastError() != ERROR_ALREADY_EXISTS)
+			fprintf(stderr, "Failed to create directory %s: %s\n", path.c_str(), error_to_string(GetLastError()).c_str());
+		break;
+	case FileAction::DirectoryRemoved:
+		fprintf(stderr, "Remove directory %s\n", path.c_str());
+		if (file_exist(attr) && !(attr & FILE_ATTRIBUTE_DIRECTORY))
+		{
+			fprintf(stderr, "%s is not a directory, not removing it\n", path.c_str());
+			break;
+		}
+		if (file_exist(attr) && !remove_directory_tree(wide_path))
+			fprintf(stderr, "Failed to remove all of directory %s: %s\n", path.c_str(), error_to_string(GetLastError()).c_str());
+		catalog_remove_directory(catalog, path);
+		break;
+	case FileAction::DirectoryRenamed:
+		fprintf(stderr, "Rename directory %s to %s\n", path.c_str(), to_path.c_str());
+		if (!MoveFileW(wide_path.c_str(), s2ws(to_path).c_str()))
+		{
+			DWORD error = GetLastError();
+			fprintf(stderr, "Failed to move directory %s to %s: %d %s\n", path.c_str(), to_path.c_str(), error, error_to_string(error).c_str());
+			break;
+		}
+		catalog_rename_directory(catalog, path, to_path);
+		break;
+	default:
+		break;
+	}
+	return SocketState::NoError;
+}
+
+static SocketState handle_messages(const std::string &target_directory, Catalog &catalog, Relay &relay, Durability &durability, DirectWriter &direct_writer, Connection &connection, HashAlgorithm algorithm)
 {
 	while (true)
 	{
-		Header header;
-		SocketState socket_state = read_header(socket, header);
+		uint8_t header_buffer[MessageHeader::size];
+		SocketState socket_state = read_header(connection, header_buffer);
 		if (socket_state != SocketState::NoError)
 			return socket_state;
 
-		switch (header.action)
+		HeaderView header(header_buffer);
+		if (header.digest_size() != hash_digest_size(algorithm))
+		{
+			fprintf(stderr, "Digest of %u bytes does not match %s\n", header.digest_size(), hash_name(algorithm));
+			closesocket(connection.socket);
+			return SocketState::Error;
+		}
+		switch (header.action())
 		{
 		case FileAction::Added:
 		case FileAction::Modified:
-			socket_state = handle_added_modified(target_directory, socket, header);
+			socket_state = handle_added_modified(target_directory, catalog, relay, durability, direct_writer, connection, algorithm, header);
 			break;
 		case FileAction::Removed:
-			socket_state = handle_remove(target_directory, socket, header);
+			socket_state = handle_remove(target_directory, catalog, relay, durability, connection, algorithm, header);
 			break;
 		case FileAction::Renamed:
-			socket_state = handle_rename(target_directory, socket, header);
+			socket_state = handle_rename(target_directory, catalog, relay, durability, connection, algorithm, header);
+			break;
+		case FileAction::Appended:
+			socket_state = handle_append(target_directory, catalog, relay, durability, connection, algorithm, header);
+			break;
+		case FileAction::Sparse:
+			socket_state = handle_sparse(target_directory, catalog, relay, durability, connection, algorithm, header);
+			break;
+		case FileAction::DirectoryAdded:
+		case FileAction::DirectoryRemoved:
+		case FileAction::DirectoryRenamed:
+			socket_state = handle_directory(target_directory, catalog, relay, durability, connection, algorithm, header);
 		}
 
 		if (socket_state != SocketState::NoError)
+		{
+			// Downstream has part of a message it will never get the rest of.
+			if (relay.active)
+				relay_close(relay);
 			return socket_state;
+		}
+		durability_complete(durability);
+		stats_add(Counter::BytesReceived, header.message_size());
 	}
+}
 
+// Creates a ring for a client on this host and waits for it to attach. The
+// socket is unique among open handles, so it names the ring.
+static SocketState attach_shared_ring(Connection &connection)
+{
+	uint32_t process_id = GetCurrentProcessId();
+	uint32_t ring_id = uint32_t(connection.socket);
+	if (!shared_ring_create(connection.ring, process_id, ring_id, SHARED_RING_CAPACITY))
+	{
+		closesocket(connection.socket);
+		return SocketState::Error;
+	}
+	uint8_t offer[SharedRingOffer::size];
+	encode_shared_ring_offer(offer, process_id, ring_id);
+	if (send(connection.socket, (const char *)offer, sizeof(offer), 0) != sizeof(offer))
+	{
+		fprintf(stderr, "Failed to offer the shared ring: %d\n", WSAGetLastError());
+		shared_ring_close(connection.ring, false);
+		closesocket(connection.socket);
+		return SocketState::Error;
+	}
+	uint8_t attach[SharedRingAttach::size];
+	SocketState socket_state = read_from_socket(connection.socket, attach, sizeof(attach));
+	if (socket_state != SocketState::NoError)
+	{
+		shared_ring_close(connection.ring, false);
+		if (socket_state == SocketState::Closed)
+			closesocket(connection.socket);
+		return socket_state;
+	}
+	uint32_t client_process = decode_shared_ring_attach(attach);
+	if (!client_process || !shared_ring_watch_peer(connection.ring, client_process))
+	{
+		fprintf(stderr, "Client could not attach to the shared ring\n");
+		shared_ring_close(connection.ring, false);
+		closesocket(connection.socket);
+		return SocketState::Error;
+	}
+	connection.shared = true;
+	fprintf(stderr, "Receiving through shared memory\n");
+	return SocketState::NoError;
+}
+
+static SocketState handle_connection(const std::string &target_directory, Catalog &catalog, Relay &relay, Durability &durability, DirectWriter &direct_writer, SOCKET socket)
+{
+	HashAlgorithm algorithm;
+	bool acknowledge;
+	bool shared;
+	SocketState socket_state = read_hello(socket, durability.options.enabled, algorithm, acknowledge, shared);
+	if (socket_state != SocketState::NoError)
+		return socket_state;
+	Connection connection;
+	connection.socket = socket;
+	if (shared)
+	{
+		socket_state = attach_shared_ring(connection);
+		if (socket_state != SocketState::NoError)
+			return socket_state;
+	}
+	durability_start(durability, socket, acknowledge);
+	socket_state = handle_messages(target_directory, catalog, relay, durability, direct_writer, connection, algorithm);
+	// Errors have closed the socket already.
+	durability_stop(durability, socket_state == SocketState::Closed);
+	if (connection.shared)
+		shared_ring_close(connection.ring, false);
+	if (socket_state == SocketState::Closed)
+		closesocket(socket);
+	return socket_state;
 }
 
-bool run_server(const std::string &target_directory)
+bool run_server(const std::string &target_directory, const ServerOptions &options)
 {
+	Relay relay;
+	relay.server = options.relay;
+	Durability durability;
+	durability.options = options.durability;
+	DirectWriter direct_writer;
+	direct_writer.options = options.direct_write;
+	Catalog catalog;
+	if (!open_catalog(catalog, target_directory))
+	{
+		WSACleanup();
+		return false;
+	}
+	validate_catalog(catalog);
+
 	struct addrinfo hints;
 	memset(&hints, 0, sizeof(hints));
 	hints.ai_family = AF_INET;
@@ -322,12 +1019,16 @@ bool run_server(const std::string &target_directory)
 		return false;
 	}
 
+	if (direct_writer.options.enabled)
+		direct_writer_start(direct_writer);
+
 	SOCKET client;
 	while (true)
 	{
 		client = accept(_listen, NULL, NULL);
 		if (client == INVALID_SOCKET) {
 			fprintf(stderr, "accept failed with error: %d\n", WSAGetLastError());
+			direct_writer_stop(direct_writer);
 			closesocket(_listen);
 			WSACleanup();
 			return false;
@@ -341,11 +1042,14 @@ bool run_server(const std::string &target_directory)
 		char *ip = inet_ntoa(info.sin_addr);
 		fprintf(stderr, "Connection received from ip %s\n", ip);
 
-		handle_connection(target_directory, client);
+		handle_connection(target_directory, catalog, relay, durability, direct_writer, client);
 	}
 
 
 	closesocket(_listen);
+	close_catalog(catalog);
+	relay_close(relay);
+	direct_writer_stop(direct_writer);
 
 	success = shutdown(client, SD_SEND);
 	if (success == SOCKET_ERROR) {
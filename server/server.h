@@ -1,2 +1,14 @@
+#include <string>
 
-bool run_server(const std::string &target_directory);
\ No newline at end of file
+#include "durability.h"
+#include "direct_writer.h"
+
+struct ServerOptions
+{
+	// Downstream server every accepted operation is forwarded to.
+	std::string relay;
+	DurabilityOptions durability;
+	DirectWriteOptions direct_write;
+};
+
+bool run_server(const std::string &target_directory, const ServerOptions &options);
\ No newline at end of file
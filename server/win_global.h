@@ -1,3 +1,4 @@
+#pragma once
 #define WIN32_LEAN_AND_MEAN
 #define NOMINMAX
 #include <windows.h>